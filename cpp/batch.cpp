@@ -0,0 +1,246 @@
+#include "batch.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "karel.h"
+#include "logging.h"
+#include "scheduler.h"
+#include "util.h"
+#include "xml.h"
+
+namespace karel {
+
+namespace {
+
+// Appends |str| as a JSON string literal.
+void AppendJsonString(std::string* output, std::string_view str) {
+  output->push_back('"');
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      output->push_back('\\');
+      output->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      output->append(StringPrintf("\\u%04x", c));
+    } else {
+      output->push_back(c);
+    }
+  }
+  output->push_back('"');
+}
+
+class Batch {
+ public:
+  Batch(const Program& program,
+        const std::vector<std::string>& paths,
+        const BatchOptions& options)
+      : program_(program),
+        paths_(paths),
+        options_(options),
+        cases_(paths.size()) {
+    if (options_.result_cache || options_.cost_history)
+      program_key_ = program_.CanonicalKey();
+  }
+
+  bool Run() {
+    std::vector<Scheduler::Task> tasks;
+    for (size_t i = 0; i < cases_.size(); ++i) {
+      Scheduler::Task task;
+      // Estimating the cost needs the key of the world, so it is read here
+      // instead of by the worker.
+      if (options_.cost_history && ReadCase(i)) {
+        task.cost = options_.cost_history->Estimate(program_key_,
+                                                    cases_[i].world_key);
+      }
+      task.run = [this, i](size_t slice) { return Step(i, slice); };
+      tasks.emplace_back(std::move(task));
+    }
+
+    Scheduler scheduler(options_.jobs, options_.slice);
+    scheduler.Submit(std::move(tasks));
+
+    bool success = true;
+    xml::Buffer out(STDOUT_FILENO);
+    for (size_t i = 0; i < cases_.size(); ++i) {
+      std::string output;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this, i]() { return cases_[i].done; });
+        output = std::move(cases_[i].output);
+        success &= cases_[i].loaded;
+      }
+      out.Add(output);
+      out.Flush();
+    }
+    return success;
+  }
+
+ private:
+  // The World and the stacks of a run in progress. Cases take one when they
+  // start and give it back when they finish, so that the next case reuses
+  // its allocations instead of making its own.
+  struct RunStorage {
+    std::optional<World> world;
+    ExecutionState state;
+  };
+
+  // The outcome of running the program against one world, and the state of
+  // the run while it is in progress.
+  struct Case {
+    bool done = false;
+    bool loaded = false;
+    std::string output;
+
+    std::optional<FileContents> contents;
+    hash::Key world_key;
+    std::unique_ptr<RunStorage> storage;
+    hash::Key result_key;
+  };
+
+  bool ReadCase(size_t index) {
+    Case& current = cases_[index];
+    const std::string& path = paths_[index];
+    ScopedFD fd(open(path.c_str(), O_RDONLY));
+    if (!fd) {
+      PLOG(ERROR) << "Failed to open " << path;
+      return false;
+    }
+    current.contents = FileContents::Read(fd.get());
+    if (!current.contents)
+      return false;
+    current.world_key = hash::Key::Of(current.contents->view());
+    return true;
+  }
+
+  // Runs one slice of a case. Returns true once it is done.
+  bool Step(size_t index, size_t slice) {
+    Case& current = cases_[index];
+    if (!current.storage) {
+      std::string output;
+      bool loaded = Load(index, &output);
+      if (!loaded || !output.empty()) {
+        Finish(index, loaded, std::move(output));
+        return true;
+      }
+    }
+
+    World& world = current.storage->world.value();
+    auto result = RunSlice(program_.instructions(), program_.size(),
+                           world.runtime(), &current.storage->state, slice);
+    if (!result)
+      return false;
+
+    std::string output;
+    {
+      xml::Buffer buffer(&output);
+      world.DumpResult(result.value(), options_.format, &buffer);
+    }
+    if (options_.result_cache)
+      options_.result_cache->Put(current.result_key, result.value(), output);
+    if (options_.cost_history) {
+      options_.cost_history->Record(program_key_, current.world_key,
+                                    current.storage->state.instruction_count);
+    }
+    Finish(index, true, std::move(output));
+    return true;
+  }
+
+  // Loads the world of a case. If its result was cached, it is written to
+  // |output| instead.
+  bool Load(size_t index, std::string* output) {
+    Case& current = cases_[index];
+    const std::string& path = paths_[index];
+    if (!current.contents && !ReadCase(index)) {
+      LOG(ERROR) << "Failed to load " << path;
+      return false;
+    }
+    auto image = WorldImage::Parse(current.contents->view());
+    current.contents.reset();
+    if (!image) {
+      LOG(ERROR) << "Failed to load " << path;
+      return false;
+    }
+
+    current.storage = AcquireStorage();
+    std::optional<World>& world = current.storage->world;
+    if (world)
+      world->Reset(image);
+    else
+      world.emplace(image);
+    if (options_.result_cache) {
+      current.result_key = ResultCache::Key(program_key_, *image,
+                                            *world->runtime(), options_.format);
+      if (auto entry = options_.result_cache->Get(current.result_key))
+        *output = std::move(entry->output);
+    }
+    return true;
+  }
+
+  std::unique_ptr<RunStorage> AcquireStorage() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_storage_.empty())
+      return std::make_unique<RunStorage>();
+    std::unique_ptr<RunStorage> storage = std::move(free_storage_.back());
+    free_storage_.pop_back();
+    return storage;
+  }
+
+  // Wraps the result of a case and hands it to Run().
+  void Finish(size_t index, bool loaded, std::string result) {
+    std::string output;
+    if (options_.format == World::ResultFormat::JSON) {
+      output.append("{\"case\":");
+      AppendJsonString(&output, paths_[index]);
+      if (loaded) {
+        output.append(",\"result\":");
+        // Replace the newline that ends the result.
+        result.back() = '}';
+        output.append(result).push_back('\n');
+      } else {
+        output.append(",\"error\":\"Failed to load the world\"}\n");
+      }
+    } else {
+      output = std::move(result);
+    }
+
+    Case& current = cases_[index];
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current.storage) {
+      current.storage->state.Reset();
+      free_storage_.push_back(std::move(current.storage));
+    }
+    current.done = true;
+    current.loaded = loaded;
+    current.output = std::move(output);
+    done_.notify_all();
+  }
+
+  const Program& program_;
+  const std::vector<std::string>& paths_;
+  const BatchOptions& options_;
+  hash::Key program_key_;
+
+  std::mutex mutex_;
+  std::condition_variable done_;
+  std::vector<Case> cases_;
+  std::vector<std::unique_ptr<RunStorage>> free_storage_;
+
+  DISALLOW_COPY_AND_ASSIGN(Batch);
+};
+
+}  // namespace
+
+bool RunBatch(const Program& program,
+              const std::vector<std::string>& paths,
+              const BatchOptions& options) {
+  if (paths.empty())
+    return true;
+  return Batch(program, paths, options).Run();
+}
+
+}  // namespace karel
@@ -0,0 +1,45 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <string>
+#include <vector>
+
+#include "program.h"
+#include "result_cache.h"
+#include "scheduler.h"
+#include "world.h"
+
+namespace karel {
+
+struct BatchOptions {
+  // How many worlds are run at the same time.
+  size_t jobs = 1;
+  World::ResultFormat format = World::ResultFormat::XML;
+  // If set, results are looked up in and added to it.
+  const ResultCache* result_cache = nullptr;
+  // How many instructions a run executes before it lets others run.
+  size_t slice = kDefaultSlice;
+  // If set, runs are started in decreasing order of their estimated cost, and
+  // the cost of every run is recorded in it.
+  CostHistory* cost_history = nullptr;
+};
+
+// Runs |program| against each of the worlds in |paths| with a Scheduler of
+// |options.jobs| workers, which preempts long runs every |options.slice|
+// instructions so that short ones are not stuck behind them. The program is
+// shared by all of them.
+//
+// Results are written to stdout in the order of |paths| as soon as all the
+// ones before them are done. They are written back to back in
+// |options.format|, except for JSON, which is written as JSON lines of the
+// form {"case":path,"result":result}, or {"case":path,"error":message} for
+// worlds that could not be loaded.
+//
+// Returns false if any of the worlds could not be loaded.
+bool RunBatch(const Program& program,
+              const std::vector<std::string>& paths,
+              const BatchOptions& options);
+
+}  // namespace karel
+
+#endif  // BATCH_H_
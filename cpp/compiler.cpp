@@ -0,0 +1,1383 @@
+#include "compiler.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+#include "logging.h"
+
+namespace karel {
+
+namespace {
+
+// The properties of Object.prototype. The JavaScript compilers look functions
+// up in plain objects, where these names are always taken, so any program
+// that defines or calls a function named like one of them fails to compile.
+constexpr const std::string_view kInheritedNames[] = {
+    "__defineGetter__", "__defineSetter__",     "__lookupGetter__",
+    "__lookupSetter__", "__proto__",            "constructor",
+    "hasOwnProperty",   "isPrototypeOf",        "propertyIsEnumerable",
+    "toLocaleString",   "toString",             "valueOf"};
+
+constexpr uint32_t kReplacementCharacter = 0xfffd;
+
+// JavaScript prints numbers from here on in exponent notation.
+constexpr double kExponentThreshold = 1e21;
+
+enum class Token {
+  END_OF_FILE,
+  // Karel Java.
+  CLASS,
+  PROG,
+  // Karel Pascal.
+  BEGINPROG,
+  BEGINEXEC,
+  ENDEXEC,
+  ENDPROG,
+  PROTO,
+  AS,
+  THEN,
+  DO,
+  TIMES,
+  // Both languages.
+  DEF,
+  RET,
+  HALT,
+  LEFT,
+  FORWARD,
+  PICKBUZZER,
+  LEAVEBUZZER,
+  WHILE,
+  REPEAT,
+  DEC,
+  INC,
+  IFZ,
+  IFNFWALL,
+  IFFWALL,
+  IFNLWALL,
+  IFLWALL,
+  IFNRWALL,
+  IFRWALL,
+  IFWBUZZER,
+  IFNWBUZZER,
+  IFBBUZZER,
+  IFNBBUZZER,
+  IFN,
+  IFS,
+  IFE,
+  IFW,
+  IFNN,
+  IFNS,
+  IFNE,
+  IFNW,
+  ELSE,
+  IF,
+  NOT,
+  OR,
+  AND,
+  LPAREN,
+  RPAREN,
+  BEGIN,
+  END,
+  SEMICOLON,
+  NUM,
+  VAR,
+};
+
+struct Keyword {
+  std::string_view text;
+  Token token;
+};
+
+constexpr const Keyword kJavaKeywords[] = {
+    {"class", Token::CLASS},
+    {"program", Token::PROG},
+    {"define", Token::DEF},
+    {"void", Token::DEF},
+    {"return", Token::RET},
+    {"turnoff", Token::HALT},
+    {"turnleft", Token::LEFT},
+    {"move", Token::FORWARD},
+    {"pickbeeper", Token::PICKBUZZER},
+    {"putbeeper", Token::LEAVEBUZZER},
+    {"while", Token::WHILE},
+    {"iterate", Token::REPEAT},
+    {"pred", Token::DEC},
+    {"succ", Token::INC},
+    {"iszero", Token::IFZ},
+    {"frontIsClear", Token::IFNFWALL},
+    {"frontIsBlocked", Token::IFFWALL},
+    {"leftIsClear", Token::IFNLWALL},
+    {"leftIsBlocked", Token::IFLWALL},
+    {"rightIsClear", Token::IFNRWALL},
+    {"rightIsBlocked", Token::IFRWALL},
+    {"nextToABeeper", Token::IFWBUZZER},
+    {"notNextToABeeper", Token::IFNWBUZZER},
+    {"anyBeepersInBeeperBag", Token::IFBBUZZER},
+    {"noBeepersInBeeperBag", Token::IFNBBUZZER},
+    {"facingNorth", Token::IFN},
+    {"facingSouth", Token::IFS},
+    {"facingEast", Token::IFE},
+    {"facingWest", Token::IFW},
+    {"notFacingNorth", Token::IFNN},
+    {"notFacingSouth", Token::IFNS},
+    {"notFacingEast", Token::IFNE},
+    {"notFacingWest", Token::IFNW},
+    {"else", Token::ELSE},
+    {"if", Token::IF},
+};
+
+constexpr const Keyword kPascalKeywords[] = {
+    {"iniciar-programa", Token::BEGINPROG},
+    {"inicia-ejecucion", Token::BEGINEXEC},
+    {"inicia-ejecución", Token::BEGINEXEC},
+    {"termina-ejecucion", Token::ENDEXEC},
+    {"termina-ejecución", Token::ENDEXEC},
+    {"finalizar-programa", Token::ENDPROG},
+    {"define-nueva-instruccion", Token::DEF},
+    {"define-nueva-instrucción", Token::DEF},
+    {"define-prototipo-instruccion", Token::PROTO},
+    {"define-prototipo-instrucción", Token::PROTO},
+    {"sal-de-instruccion", Token::RET},
+    {"sal-de-instrucción", Token::RET},
+    {"como", Token::AS},
+    {"apagate", Token::HALT},
+    {"apágate", Token::HALT},
+    {"gira-izquierda", Token::LEFT},
+    {"avanza", Token::FORWARD},
+    {"coge-zumbador", Token::PICKBUZZER},
+    {"deja-zumbador", Token::LEAVEBUZZER},
+    {"inicio", Token::BEGIN},
+    {"fin", Token::END},
+    {"entonces", Token::THEN},
+    {"mientras", Token::WHILE},
+    {"hacer", Token::DO},
+    {"repetir", Token::REPEAT},
+    {"veces", Token::TIMES},
+    {"precede", Token::DEC},
+    {"sucede", Token::INC},
+    {"si-es-cero", Token::IFZ},
+    {"frente-libre", Token::IFNFWALL},
+    {"frente-bloqueado", Token::IFFWALL},
+    {"izquierda-libre", Token::IFNLWALL},
+    {"izquierda-bloqueada", Token::IFLWALL},
+    {"derecha-libre", Token::IFNRWALL},
+    {"derecha-bloqueada", Token::IFRWALL},
+    {"junto-a-zumbador", Token::IFWBUZZER},
+    {"no-junto-a-zumbador", Token::IFNWBUZZER},
+    {"algun-zumbador-en-la-mochila", Token::IFBBUZZER},
+    {"algún-zumbador-en-la-mochila", Token::IFBBUZZER},
+    {"ningun-zumbador-en-la-mochila", Token::IFNBBUZZER},
+    {"ningún-zumbador-en-la-mochila", Token::IFNBBUZZER},
+    {"orientado-al-norte", Token::IFN},
+    {"orientado-al-sur", Token::IFS},
+    {"orientado-al-este", Token::IFE},
+    {"orientado-al-oeste", Token::IFW},
+    {"no-orientado-al-norte", Token::IFNN},
+    {"no-orientado-al-sur", Token::IFNS},
+    {"no-orientado-al-este", Token::IFNE},
+    {"no-orientado-al-oeste", Token::IFNW},
+    {"sino", Token::ELSE},
+    {"si-no", Token::ELSE},
+    {"si", Token::IF},
+    {"no", Token::NOT},
+    {"o", Token::OR},
+    {"u", Token::OR},
+    {"y", Token::AND},
+    {"e", Token::AND},
+};
+
+constexpr size_t kKeywordHashSize = 128;
+
+constexpr size_t HashKeyword(std::string_view text) {
+  return (7 * static_cast<uint8_t>(text.front()) +
+          31 * static_cast<uint8_t>(text[text.size() / 2]) +
+          13 * static_cast<uint8_t>(text.back()) + text.size()) %
+         kKeywordHashSize;
+}
+
+// An open-addressed hash table of indices into a keyword list, since every
+// identifier is looked up.
+struct KeywordTable {
+  int8_t keywords[kKeywordHashSize];
+};
+
+template <size_t N>
+constexpr KeywordTable MakeKeywordTable(const Keyword (&keywords)[N]) {
+  KeywordTable table{};
+  for (size_t i = 0; i < kKeywordHashSize; ++i)
+    table.keywords[i] = -1;
+  for (size_t i = 0; i < N; ++i) {
+    size_t slot = HashKeyword(keywords[i].text);
+    while (table.keywords[slot] != -1)
+      slot = (slot + 1) % kKeywordHashSize;
+    table.keywords[slot] = i;
+  }
+  return table;
+}
+
+constexpr KeywordTable kJavaKeywordTable = MakeKeywordTable(kJavaKeywords);
+constexpr KeywordTable kPascalKeywordTable = MakeKeywordTable(kPascalKeywords);
+
+template <size_t N>
+Token LookupKeyword(const Keyword (&keywords)[N],
+                    const KeywordTable& table,
+                    std::string_view text) {
+  for (size_t slot = HashKeyword(text); table.keywords[slot] != -1;
+       slot = (slot + 1) % kKeywordHashSize) {
+    if (keywords[table.keywords[slot]].text == text)
+      return keywords[table.keywords[slot]].token;
+  }
+  return Token::VAR;
+}
+
+bool IsInheritedName(std::string_view name) {
+  return std::find(std::begin(kInheritedNames), std::end(kInheritedNames),
+                   name) != std::end(kInheritedNames);
+}
+
+uint32_t DecodeMultibyteCodePoint(std::string_view text, size_t* pos) {
+  uint8_t lead = text[*pos];
+  size_t length;
+  uint32_t code_point;
+  uint32_t min;
+  if ((lead & 0xe0) == 0xc0) {
+    length = 2;
+    code_point = lead & 0x1f;
+    min = 0x80;
+  } else if ((lead & 0xf0) == 0xe0) {
+    length = 3;
+    code_point = lead & 0x0f;
+    min = 0x800;
+  } else if ((lead & 0xf8) == 0xf0) {
+    length = 4;
+    code_point = lead & 0x07;
+    min = 0x10000;
+  } else {
+    ++*pos;
+    return kReplacementCharacter;
+  }
+  if (text.size() - *pos < length) {
+    ++*pos;
+    return kReplacementCharacter;
+  }
+  for (size_t i = 1; i < length; ++i) {
+    uint8_t c = text[*pos + i];
+    if ((c & 0xc0) != 0x80) {
+      ++*pos;
+      return kReplacementCharacter;
+    }
+    code_point = (code_point << 6) | (c & 0x3f);
+  }
+  if (code_point < min || code_point > 0x10ffff ||
+      (code_point >= 0xd800 && code_point <= 0xdfff)) {
+    ++*pos;
+    return kReplacementCharacter;
+  }
+  *pos += length;
+  return code_point;
+}
+
+// Decodes the code point at |*pos| and advances past it. Like node, invalid
+// UTF-8 decodes to U+FFFD, one byte at a time.
+inline uint32_t DecodeCodePoint(std::string_view text, size_t* pos) {
+  uint8_t c = text[*pos];
+  if (c < 0x80) {
+    ++*pos;
+    return c;
+  }
+  return DecodeMultibyteCodePoint(text, pos);
+}
+
+// Whether |c| matches \s in a JavaScript regexp.
+bool IsWhitespace(uint32_t c) {
+  return (c >= 0x09 && c <= 0x0d) || c == 0x20 || c == 0xa0 || c == 0x1680 ||
+         (c >= 0x2000 && c <= 0x200a) || c == 0x2028 || c == 0x2029 ||
+         c == 0x202f || c == 0x205f || c == 0x3000 || c == 0xfeff;
+}
+
+// Returns where the run of whitespace that starts at |pos| ends.
+size_t SkipWhitespace(std::string_view text, size_t pos) {
+  while (pos < text.size()) {
+    size_t next = pos;
+    if (!IsWhitespace(DecodeCodePoint(text, &next)))
+      break;
+    pos = next;
+  }
+  return pos;
+}
+
+// Counts the lines that |text| ends, like the jison lexer does: \r\n, \r and
+// \n all end one.
+int32_t CountLines(std::string_view text) {
+  int32_t lines = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == '\n' ||
+        (text[i] == '\r' && (i + 1 == text.size() || text[i + 1] != '\n'))) {
+      ++lines;
+    }
+  }
+  return lines;
+}
+
+bool IsAsciiAlpha(uint32_t c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+
+bool IsAsciiDigit(uint32_t c) {
+  return '0' <= c && c <= '9';
+}
+
+// [A-Za-zÀ-ÖØ-öø-ÿ_], the first character of a Karel Pascal identifier.
+bool IsPascalIdentifierStart(uint32_t c) {
+  return IsAsciiAlpha(c) || c == '_' ||
+         (c >= 0xc0 && c <= 0xff && c != 0xd7 && c != 0xf7);
+}
+
+bool IsPascalIdentifierPart(uint32_t c) {
+  return IsPascalIdentifierStart(c) || IsAsciiDigit(c) || c == '-';
+}
+
+// Lowercases a Karel Pascal identifier like String.prototype.toLowerCase().
+// Only ASCII letters and À-Þ, which are encoded as C3 80-9E, have lowercase
+// versions among the characters of an identifier.
+std::string ToLower(std::string_view text) {
+  std::string lower(text);
+  for (size_t i = 0; i < lower.size(); ++i) {
+    char c = lower[i];
+    if ('A' <= c && c <= 'Z') {
+      lower[i] = c - 'A' + 'a';
+    } else if (c == '\xc3' && i + 1 < lower.size()) {
+      uint8_t next = lower[++i];
+      if (next >= 0x80 && next <= 0x9e && next != 0x97)
+        lower[i] = static_cast<char>(next + 0x20);
+    }
+  }
+  return lower;
+}
+
+// Returns the argument of the LOAD of |digits| as the .kx file would have it:
+// parseInt() rounds the number to a double, JSON.stringify() prints its
+// shortest representation padded with zeros, and the .kx loader wraps that
+// to 32 bits. Numbers that print in exponent notation can't be loaded.
+std::optional<int32_t> LoadArgument(std::string_view digits) {
+  std::string printed;
+  // Doubles hold any integer of up to 15 digits exactly.
+  size_t first_digit = std::min(digits.find_first_not_of('0'), digits.size());
+  if (digits.size() - first_digit <= 15) {
+    printed = std::string(digits);
+  } else {
+    double value = strtod(std::string(digits).c_str(), nullptr);
+    if (value >= kExponentThreshold)
+      return std::nullopt;
+    char buffer[32];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value,
+                                   std::chars_format::scientific);
+    if (ec != std::errc())
+      return std::nullopt;
+    std::string_view scientific(buffer, end - buffer);
+    size_t exponent_begin = scientific.find('e');
+    int exponent = atoi(scientific.data() + exponent_begin + 1);
+    for (char c : scientific.substr(0, exponent_begin)) {
+      if (c != '.')
+        printed.push_back(c);
+    }
+    printed.resize(exponent + 1, '0');
+  }
+  uint32_t value = 0;
+  for (char c : printed)
+    value = 10 * value + (c - '0');
+  return static_cast<int32_t>(value);
+}
+
+struct Lexeme {
+  Token token = Token::END_OF_FILE;
+  std::string_view text;
+  // Tokens never span lines, so this is both where the token is and the
+  // jison lexer's yylineno right after reading it.
+  int32_t line = 0;
+};
+
+// Splits a program into tokens like the jison lexers do. Java picks the first
+// rule that matches, and its keywords must end at a word boundary. Pascal
+// picks the longest match, preferring the first rule on ties, and skips any
+// character that no other rule matches.
+class Lexer {
+ public:
+  Lexer(std::string_view source, Language language)
+      : source_(source), language_(language) {}
+
+  // Reads the next token. Logs and returns false on a lexical error.
+  bool Next(Lexeme* lexeme) {
+    return language_ == Language::JAVA ? NextJava(lexeme)
+                                       : NextPascal(lexeme);
+  }
+
+ private:
+  bool NextJava(Lexeme* lexeme) {
+    while (pos_ < source_.size()) {
+      size_t start = pos_;
+      size_t next = pos_;
+      uint32_t c = DecodeCodePoint(source_, &next);
+      std::string_view rest = source_.substr(pos_);
+      if (IsWhitespace(c)) {
+        Skip(SkipWhitespace(source_, pos_));
+      } else if (rest.substr(0, 2) == "//") {
+        Skip(std::min(source_.find('\n', pos_), source_.size()));
+      } else if (rest.substr(0, 2) == "/*") {
+        size_t end = source_.find("*/", pos_ + 2);
+        if (end == std::string_view::npos)
+          return LexicalError();
+        Skip(end + 2);
+      } else if (IsAsciiAlpha(c)) {
+        while (pos_ < source_.size() &&
+               (IsAsciiAlpha(source_[pos_]) || IsAsciiDigit(source_[pos_]) ||
+                source_[pos_] == '_')) {
+          ++pos_;
+        }
+        std::string_view text = source_.substr(start, pos_ - start);
+        return Emit(LookupKeyword(kJavaKeywords, kJavaKeywordTable, text),
+                    start, lexeme);
+      } else if (IsAsciiDigit(c)) {
+        return EmitNumber(start, lexeme);
+      } else if (rest.substr(0, 2) == "||") {
+        pos_ += 2;
+        return Emit(Token::OR, start, lexeme);
+      } else if (rest.substr(0, 2) == "&&") {
+        pos_ += 2;
+        return Emit(Token::AND, start, lexeme);
+      } else {
+        pos_ = next;
+        switch (c) {
+          case '!':
+            return Emit(Token::NOT, start, lexeme);
+          case '&':
+            return Emit(Token::AND, start, lexeme);
+          case '(':
+            return Emit(Token::LPAREN, start, lexeme);
+          case ')':
+            return Emit(Token::RPAREN, start, lexeme);
+          case '{':
+            return Emit(Token::BEGIN, start, lexeme);
+          case '}':
+            return Emit(Token::END, start, lexeme);
+          case ';':
+            return Emit(Token::SEMICOLON, start, lexeme);
+        }
+        pos_ = start;
+        return LexicalError();
+      }
+    }
+    return Emit(Token::END_OF_FILE, pos_, lexeme);
+  }
+
+  bool NextPascal(Lexeme* lexeme) {
+    while (pos_ < source_.size()) {
+      size_t start = pos_;
+      size_t next = pos_;
+      uint32_t c = DecodeCodePoint(source_, &next);
+      if (IsWhitespace(c)) {
+        Skip(SkipWhitespace(source_, pos_));
+      } else if (c == '{') {
+        // An unterminated comment is just a stray '{'.
+        size_t end = source_.find('}', pos_ + 1);
+        Skip(end == std::string_view::npos ? next : end + 1);
+      } else if (c == '(') {
+        size_t end = source_.substr(pos_, 2) == "(*"
+                         ? source_.find("*)", pos_ + 2)
+                         : std::string_view::npos;
+        if (end == std::string_view::npos) {
+          pos_ = next;
+          return Emit(Token::LPAREN, start, lexeme);
+        }
+        Skip(end + 2);
+      } else if (c == ')') {
+        pos_ = next;
+        return Emit(Token::RPAREN, start, lexeme);
+      } else if (c == ';') {
+        pos_ = next;
+        return Emit(Token::SEMICOLON, start, lexeme);
+      } else if (IsAsciiDigit(c)) {
+        return EmitNumber(start, lexeme);
+      } else if (IsPascalIdentifierStart(c)) {
+        pos_ = next;
+        while (pos_ < source_.size()) {
+          next = pos_;
+          if (!IsPascalIdentifierPart(DecodeCodePoint(source_, &next)))
+            break;
+          pos_ = next;
+        }
+        std::string_view text = source_.substr(start, pos_ - start);
+        return Emit(LookupKeyword(kPascalKeywords, kPascalKeywordTable, text),
+                    start, lexeme);
+      } else {
+        pos_ = next;
+      }
+    }
+    return Emit(Token::END_OF_FILE, pos_, lexeme);
+  }
+
+  // Skips whitespace or a comment that ends at |end|.
+  void Skip(size_t end) {
+    line_ += CountLines(source_.substr(pos_, end - pos_));
+    pos_ = end;
+  }
+
+  bool EmitNumber(size_t start, Lexeme* lexeme) {
+    while (pos_ < source_.size() && IsAsciiDigit(source_[pos_]))
+      ++pos_;
+    return Emit(Token::NUM, start, lexeme);
+  }
+
+  bool Emit(Token token, size_t start, Lexeme* lexeme) {
+    lexeme->token = token;
+    lexeme->text = source_.substr(start, pos_ - start);
+    lexeme->line = line_;
+    return true;
+  }
+
+  bool LexicalError() {
+    LOG(ERROR) << "Lexical error on line " << line_ + 1
+               << ". Unrecognized text: "
+               << source_.substr(pos_, std::min<size_t>(20, source_.size() -
+                                                                pos_));
+    return false;
+  }
+
+  const std::string_view source_;
+  const Language language_;
+  size_t pos_ = 0;
+  int32_t line_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(Lexer);
+};
+
+// A recursive descent parser for the jison grammars in gramaticas/, emitting
+// instructions as it goes instead of concatenating arrays.
+class Compiler {
+ public:
+  // Real programs nest a few dozen levels at most. This keeps the recursion
+  // well within the stack of a worker thread.
+  static constexpr size_t kMaxDepth = 1000;
+
+  Compiler(std::string_view source, Language language)
+      : source_(source), language_(language), lexer_(source, language) {}
+
+  std::optional<Program> Compile() {
+    if (!lexer_.Next(&lookahead_))
+      return std::nullopt;
+    bool parsed = language_ == Language::JAVA ? ParseJavaProgram()
+                                              : ParsePascalProgram();
+    if (!parsed)
+      return std::nullopt;
+    return Link();
+  }
+
+ private:
+  struct Call {
+    size_t pc;
+    std::string name;
+    int32_t arity;
+    int32_t line;
+  };
+
+  // The main program, a function or, in Pascal, a prototype. The arity
+  // counts the parameter the way the JavaScript compilers do, which is 1
+  // without a parameter and 2 with one.
+  struct Function {
+    std::string name;
+    int32_t arity = 1;
+    int32_t line = 0;
+    bool prototype = false;
+    std::vector<Instruction> code;
+    std::vector<Call> calls;
+    std::optional<std::string> parameter;
+  };
+
+  // Consumes the lookahead token, which becomes the last token shifted.
+  bool Shift() {
+    line_ = lookahead_.line;
+    return lexer_.Next(&lookahead_);
+  }
+
+  bool Expect(Token token) {
+    if (lookahead_.token != token)
+      return UnexpectedToken();
+    return Shift();
+  }
+
+  bool UnexpectedToken() {
+    if (lookahead_.token == Token::END_OF_FILE) {
+      LOG(ERROR) << "Parse error on line " << lookahead_.line + 1
+                 << ": Unexpected end of input";
+    } else {
+      LOG(ERROR) << "Parse error on line " << lookahead_.line + 1
+                 << ": Unexpected '" << lookahead_.text << "'";
+    }
+    return false;
+  }
+
+  bool Error(const char* message, std::string_view name, int32_t line) {
+    LOG(ERROR) << message << ": " << name << " on line " << line + 1;
+    return false;
+  }
+
+  // The parser recurses once per nested statement and parenthesized term. A
+  // Nesting is alive for each of those, and Nest() fails the compilation
+  // once they are too deep, before the recursion overflows the stack.
+  class Nesting {
+   public:
+    explicit Nesting(size_t* depth) : depth_(depth) { ++*depth_; }
+    ~Nesting() { --*depth_; }
+
+   private:
+    size_t* const depth_;
+
+    DISALLOW_COPY_AND_ASSIGN(Nesting);
+  };
+
+  bool Nest() {
+    if (depth_ <= kMaxDepth)
+      return true;
+    LOG(ERROR) << "Parse error on line " << lookahead_.line + 1
+               << ": Nesting deeper than " << kMaxDepth;
+    return false;
+  }
+
+  // Function names are case-insensitive in Pascal.
+  std::string Name(std::string_view text) const {
+    return language_ == Language::PASCAL ? ToLower(text) : std::string(text);
+  }
+
+  size_t Emit(Opcode opcode, int32_t arg = 0) {
+    function_->code.emplace_back(Instruction{opcode, arg});
+    return function_->code.size() - 1;
+  }
+
+  size_t size() const { return function_->code.size(); }
+
+  void EmitEz(RunResult result) {
+    Emit(Opcode::EZ, static_cast<int32_t>(result));
+  }
+
+  // Emits the statements that don't take arguments, with the line of the
+  // last token shifted.
+  void EmitPrimitive(Token token) {
+    Emit(Opcode::LINE, line_);
+    switch (token) {
+      case Token::FORWARD:
+        Emit(Opcode::WORLDWALLS);
+        Emit(Opcode::ORIENTATION);
+        Emit(Opcode::MASK);
+        Emit(Opcode::AND);
+        Emit(Opcode::NOT);
+        EmitEz(RunResult::WALL);
+        Emit(Opcode::FORWARD);
+        break;
+      case Token::LEFT:
+        Emit(Opcode::LEFT);
+        break;
+      case Token::PICKBUZZER:
+        Emit(Opcode::WORLDBUZZERS);
+        EmitEz(RunResult::WORLDUNDERFLOW);
+        Emit(Opcode::PICKBUZZER);
+        break;
+      case Token::LEAVEBUZZER:
+        Emit(Opcode::BAGBUZZERS);
+        EmitEz(RunResult::BAGUNDERFLOW);
+        Emit(Opcode::LEAVEBUZZER);
+        break;
+      case Token::HALT:
+        Emit(Opcode::HALT);
+        break;
+      default:
+        Emit(Opcode::RET);
+        break;
+    }
+  }
+
+  static bool IsPrimitive(Token token) {
+    return token == Token::FORWARD || token == Token::LEFT ||
+           token == Token::PICKBUZZER || token == Token::LEAVEBUZZER ||
+           token == Token::HALT || token == Token::RET;
+  }
+
+  // Emits a bool_fun, or returns false if |token| isn't one.
+  bool EmitBooleanFunction(Token token) {
+    Opcode rotation = Opcode::HALT;
+    bool negate = false;
+    int32_t orientation = 0;
+    switch (token) {
+      case Token::IFNFWALL:
+      case Token::IFNLWALL:
+      case Token::IFNRWALL:
+        negate = true;
+        [[fallthrough]];
+      case Token::IFFWALL:
+      case Token::IFLWALL:
+      case Token::IFRWALL:
+        if (token == Token::IFNLWALL || token == Token::IFLWALL)
+          rotation = Opcode::ROTL;
+        else if (token == Token::IFNRWALL || token == Token::IFRWALL)
+          rotation = Opcode::ROTR;
+        Emit(Opcode::WORLDWALLS);
+        Emit(Opcode::ORIENTATION);
+        if (rotation != Opcode::HALT)
+          Emit(rotation);
+        Emit(Opcode::MASK);
+        Emit(Opcode::AND);
+        if (negate)
+          Emit(Opcode::NOT);
+        return true;
+      case Token::IFWBUZZER:
+      case Token::IFBBUZZER:
+        Emit(token == Token::IFWBUZZER ? Opcode::WORLDBUZZERS
+                                       : Opcode::BAGBUZZERS);
+        Emit(Opcode::LOAD, 0);
+        Emit(Opcode::EQ);
+        Emit(Opcode::NOT);
+        return true;
+      case Token::IFNWBUZZER:
+      case Token::IFNBBUZZER:
+        Emit(token == Token::IFNWBUZZER ? Opcode::WORLDBUZZERS
+                                        : Opcode::BAGBUZZERS);
+        Emit(Opcode::NOT);
+        return true;
+      case Token::IFNW:
+      case Token::IFNN:
+      case Token::IFNE:
+      case Token::IFNS:
+        negate = true;
+        [[fallthrough]];
+      case Token::IFW:
+      case Token::IFN:
+      case Token::IFE:
+      case Token::IFS:
+        if (token == Token::IFN || token == Token::IFNN)
+          orientation = 1;
+        else if (token == Token::IFE || token == Token::IFNE)
+          orientation = 2;
+        else if (token == Token::IFS || token == Token::IFNS)
+          orientation = 3;
+        Emit(Opcode::ORIENTATION);
+        Emit(Opcode::LOAD, orientation);
+        Emit(Opcode::EQ);
+        if (negate)
+          Emit(Opcode::NOT);
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  bool ParseInteger() {
+    Nesting nesting(&depth_);
+    if (!Nest())
+      return false;
+    Token token = lookahead_.token;
+    switch (token) {
+      case Token::VAR: {
+        std::string name = Name(lookahead_.text);
+        if (!Shift())
+          return false;
+        if (function_->parameter != name)
+          return Error("Unknown variable", name, line_);
+        Emit(Opcode::PARAM, 0);
+        return true;
+      }
+      case Token::NUM: {
+        auto value = LoadArgument(lookahead_.text);
+        if (!value)
+          return Error("Number too large", lookahead_.text, lookahead_.line);
+        Emit(Opcode::LOAD, value.value());
+        return Shift();
+      }
+      case Token::INC:
+      case Token::DEC:
+        if (!Shift() || !Expect(Token::LPAREN) || !ParseInteger() ||
+            !Expect(Token::RPAREN)) {
+          return false;
+        }
+        Emit(token == Token::INC ? Opcode::INC : Opcode::DEC);
+        return true;
+      default:
+        return UnexpectedToken();
+    }
+  }
+
+  bool ParseClause() {
+    Token token = lookahead_.token;
+    if (token == Token::IFZ) {
+      if (!Shift() || !Expect(Token::LPAREN) || !ParseInteger() ||
+          !Expect(Token::RPAREN)) {
+        return false;
+      }
+      Emit(Opcode::NOT);
+      return true;
+    }
+    if (token == Token::LPAREN) {
+      Nesting nesting(&depth_);
+      return Nest() && Shift() && ParseTerm() && Expect(Token::RPAREN);
+    }
+    if (!EmitBooleanFunction(token))
+      return UnexpectedToken();
+    if (!Shift())
+      return false;
+    // Java allows an empty argument list after the bool_fun.
+    if (language_ == Language::JAVA && lookahead_.token == Token::LPAREN)
+      return Shift() && Expect(Token::RPAREN);
+    return true;
+  }
+
+  bool ParseNotTerm() {
+    if (lookahead_.token != Token::NOT)
+      return ParseClause();
+    if (!Shift() || !ParseClause())
+      return false;
+    Emit(Opcode::NOT);
+    return true;
+  }
+
+  bool ParseAndTerm() {
+    if (!ParseNotTerm())
+      return false;
+    while (lookahead_.token == Token::AND) {
+      if (!Shift() || !ParseNotTerm())
+        return false;
+      Emit(Opcode::AND);
+    }
+    return true;
+  }
+
+  bool ParseTerm() {
+    if (!ParseAndTerm())
+      return false;
+    while (lookahead_.token == Token::OR) {
+      if (!Shift() || !ParseAndTerm())
+        return false;
+      Emit(Opcode::OR);
+    }
+    return true;
+  }
+
+  // Parses the condition of an if or a while: "(term)" in Java and "term
+  // |terminator|" in Pascal.
+  bool ParseCondition(Token terminator) {
+    if (language_ == Language::JAVA)
+      return Expect(Token::LPAREN) && ParseTerm() && Expect(Token::RPAREN);
+    return ParseTerm() && Expect(terminator);
+  }
+
+  bool ParseCall() {
+    std::string name = Name(lookahead_.text);
+    if (!Shift())
+      return false;
+    size_t line_pc = Emit(Opcode::LINE);
+    int32_t arity = 1;
+    if (language_ == Language::JAVA) {
+      if (!Expect(Token::LPAREN))
+        return false;
+      if (lookahead_.token != Token::RPAREN) {
+        if (!ParseInteger())
+          return false;
+        arity = 2;
+      }
+      if (!Expect(Token::RPAREN))
+        return false;
+    } else if (lookahead_.token == Token::LPAREN) {
+      if (!Shift() || !ParseInteger() || !Expect(Token::RPAREN))
+        return false;
+      arity = 2;
+    }
+    if (arity == 1)
+      Emit(Opcode::LOAD, 0);
+    // The line is the one of the last token of the call, which comes after
+    // its argument.
+    function_->code[line_pc].arg = line_;
+    function_->calls.emplace_back(Call{size(), std::move(name), arity, line_});
+    Emit(Opcode::CALL);
+    Emit(Opcode::LINE, line_);
+    return true;
+  }
+
+  bool ParseIf() {
+    if (!Shift())
+      return false;
+    Emit(Opcode::LINE, line_);
+    if (!ParseCondition(Token::THEN))
+      return false;
+    size_t jz = Emit(Opcode::JZ);
+    if (!ParseStatement())
+      return false;
+    if (lookahead_.token != Token::ELSE) {
+      function_->code[jz].arg = size() - jz - 1;
+      return true;
+    }
+    if (!Shift())
+      return false;
+    size_t jmp = Emit(Opcode::JMP);
+    function_->code[jz].arg = jmp - jz;
+    if (!ParseStatement())
+      return false;
+    function_->code[jmp].arg = size() - jmp - 1;
+    return true;
+  }
+
+  bool ParseWhile() {
+    if (!Shift())
+      return false;
+    Emit(Opcode::LINE, line_);
+    size_t condition = size();
+    if (!ParseCondition(Token::DO))
+      return false;
+    size_t jz = Emit(Opcode::JZ);
+    if (!ParseStatement())
+      return false;
+    size_t jmp = Emit(Opcode::JMP);
+    function_->code[jz].arg = jmp - jz;
+    function_->code[jmp].arg = -1 - static_cast<int32_t>(jmp - condition);
+    return true;
+  }
+
+  bool ParseRepeat() {
+    if (!Shift())
+      return false;
+    Emit(Opcode::LINE, line_);
+    bool parsed = language_ == Language::JAVA
+                      ? Expect(Token::LPAREN) && ParseInteger() &&
+                            Expect(Token::RPAREN)
+                      : ParseInteger() && Expect(Token::TIMES);
+    if (!parsed)
+      return false;
+    Emit(Opcode::DUP);
+    Emit(Opcode::LOAD, 0);
+    Emit(Opcode::EQ);
+    Emit(Opcode::NOT);
+    size_t jz = Emit(Opcode::JZ);
+    if (!ParseStatement())
+      return false;
+    int32_t length = size() - jz - 1;
+    function_->code[jz].arg = length + 2;
+    Emit(Opcode::DEC);
+    Emit(Opcode::JMP, -1 - (length + 6));
+    Emit(Opcode::POP);
+    return true;
+  }
+
+  bool ParseStatement() {
+    return language_ == Language::JAVA ? ParseJavaStatement()
+                                       : ParsePascalStatement();
+  }
+
+  bool ParseJavaStatement() {
+    Nesting nesting(&depth_);
+    if (!Nest())
+      return false;
+    Token token = lookahead_.token;
+    if (IsPrimitive(token)) {
+      if (!Shift() || !Expect(Token::LPAREN) || !Expect(Token::RPAREN) ||
+          !Expect(Token::SEMICOLON)) {
+        return false;
+      }
+      EmitPrimitive(token);
+      return true;
+    }
+    switch (token) {
+      case Token::VAR:
+        return ParseCall() && Expect(Token::SEMICOLON);
+      case Token::IF:
+        return ParseIf();
+      case Token::WHILE:
+        return ParseWhile();
+      case Token::REPEAT:
+        return ParseRepeat();
+      case Token::BEGIN:
+        return ParseJavaBlock();
+      case Token::SEMICOLON:
+        return Shift();
+      default:
+        return UnexpectedToken();
+    }
+  }
+
+  // A block needs at least one statement, even if it is just a ';'.
+  bool ParseJavaBlock() {
+    if (!Expect(Token::BEGIN))
+      return false;
+    do {
+      if (!ParseJavaStatement())
+        return false;
+    } while (lookahead_.token != Token::END);
+    return Shift();
+  }
+
+  bool ParseJavaDefinition() {
+    Function function;
+    if (!Shift())
+      return false;
+    function.line = line_;
+    if (lookahead_.token != Token::VAR)
+      return UnexpectedToken();
+    function.name = std::string(lookahead_.text);
+    if (!Shift() || !Expect(Token::LPAREN))
+      return false;
+    if (lookahead_.token == Token::VAR) {
+      function.parameter = std::string(lookahead_.text);
+      function.arity = 2;
+      if (!Shift())
+        return false;
+    }
+    if (!Expect(Token::RPAREN))
+      return false;
+
+    function_ = &functions_.emplace_back(std::move(function));
+    Emit(Opcode::LINE, function_->line);
+    if (!ParseJavaBlock())
+      return false;
+    Emit(Opcode::RET);
+    return true;
+  }
+
+  bool ParseJavaProgram() {
+    if (!Expect(Token::CLASS) || !Expect(Token::PROG) ||
+        !Expect(Token::BEGIN)) {
+      return false;
+    }
+    while (lookahead_.token == Token::DEF) {
+      if (!ParseJavaDefinition())
+        return false;
+    }
+    if (!Expect(Token::PROG) || !Expect(Token::LPAREN) ||
+        !Expect(Token::RPAREN)) {
+      return false;
+    }
+    function_ = &main_;
+    if (!ParseJavaBlock() || !Expect(Token::END))
+      return false;
+    return ParseEnd();
+  }
+
+  static bool StartsPascalStatement(Token token) {
+    return IsPrimitive(token) || token == Token::VAR || token == Token::IF ||
+           token == Token::WHILE || token == Token::REPEAT ||
+           token == Token::BEGIN;
+  }
+
+  bool ParsePascalStatement() {
+    Nesting nesting(&depth_);
+    if (!Nest())
+      return false;
+    Token token = lookahead_.token;
+    if (IsPrimitive(token)) {
+      if (!Shift())
+        return false;
+      EmitPrimitive(token);
+      return true;
+    }
+    switch (token) {
+      case Token::VAR:
+        return ParseCall();
+      case Token::IF:
+        return ParseIf();
+      case Token::WHILE:
+        return ParseWhile();
+      case Token::REPEAT:
+        return ParseRepeat();
+      case Token::BEGIN:
+        return Shift() && ParsePascalStatementList() && Expect(Token::END);
+      default:
+        return UnexpectedToken();
+    }
+  }
+
+  // Statements are separated by ';', and any of them may be empty.
+  bool ParsePascalStatementList() {
+    while (true) {
+      if (StartsPascalStatement(lookahead_.token) && !ParsePascalStatement())
+        return false;
+      if (lookahead_.token != Token::SEMICOLON)
+        return true;
+      if (!Shift())
+        return false;
+    }
+  }
+
+  bool ParsePascalDefinition() {
+    Function function;
+    function.prototype = lookahead_.token == Token::PROTO;
+    if (!Shift())
+      return false;
+    function.line = line_;
+    if (lookahead_.token != Token::VAR)
+      return UnexpectedToken();
+    function.name = ToLower(lookahead_.text);
+    if (!Shift())
+      return false;
+    if (lookahead_.token == Token::LPAREN) {
+      if (!Shift())
+        return false;
+      if (lookahead_.token != Token::VAR)
+        return UnexpectedToken();
+      function.parameter = ToLower(lookahead_.text);
+      function.arity = 2;
+      if (!Shift() || !Expect(Token::RPAREN))
+        return false;
+    }
+    if (function.prototype) {
+      function.parameter.reset();
+      functions_.emplace_back(std::move(function));
+      return true;
+    }
+    if (!Expect(Token::AS))
+      return false;
+
+    function_ = &functions_.emplace_back(std::move(function));
+    Emit(Opcode::LINE, function_->line);
+    if (!ParsePascalStatement())
+      return false;
+    Emit(Opcode::RET);
+    return true;
+  }
+
+  bool ParsePascalProgram() {
+    if (!Expect(Token::BEGINPROG))
+      return false;
+    while (lookahead_.token == Token::PROTO || lookahead_.token == Token::DEF) {
+      if (!ParsePascalDefinition() || !Expect(Token::SEMICOLON))
+        return false;
+    }
+    if (!Expect(Token::BEGINEXEC))
+      return false;
+    function_ = &main_;
+    if (!ParsePascalStatementList() || !Expect(Token::ENDEXEC) ||
+        !Expect(Token::ENDPROG)) {
+      return false;
+    }
+    return ParseEnd();
+  }
+
+  // The main program ends with the line of the end of the input.
+  bool ParseEnd() {
+    if (lookahead_.token != Token::END_OF_FILE)
+      return UnexpectedToken();
+    line_ = lookahead_.line;
+    Emit(Opcode::LINE, line_);
+    Emit(Opcode::HALT);
+    return true;
+  }
+
+  // Checks the functions and calls like validate() in the grammars does, in
+  // the same order, and lays the functions out after the main program.
+  std::optional<Program> Link() {
+    std::unordered_map<std::string_view, int32_t> entries;
+    std::unordered_map<std::string_view, int32_t> arities;
+    int32_t pc = main_.code.size();
+    for (const auto& function : functions_) {
+      std::string_view name = function.name;
+      bool inherited = IsInheritedName(name);
+      if (function.prototype) {
+        if (inherited || arities.count(name) || entries.count(name)) {
+          Error("Prototype redefinition", name, function.line);
+          return std::nullopt;
+        }
+        arities[name] = function.arity;
+        continue;
+      }
+      if (inherited || entries.count(name)) {
+        Error("Function redefinition", name, function.line);
+        return std::nullopt;
+      }
+      if (language_ == Language::PASCAL) {
+        auto arity = arities.find(name);
+        if (arity != arities.end() && arity->second != function.arity) {
+          Error("Prototype parameter mismatch", name, function.line);
+          return std::nullopt;
+        }
+      }
+      arities[name] = function.arity;
+      entries[name] = pc;
+      // Pascal functions may only call functions that were declared before.
+      if (language_ == Language::PASCAL) {
+        for (const auto& call : function.calls) {
+          if (!IsInheritedName(call.name) && !entries.count(call.name) &&
+              !arities.count(call.name)) {
+            Error("Undefined function", call.name, call.line);
+            return std::nullopt;
+          }
+        }
+      }
+      pc += function.code.size();
+    }
+
+    std::vector<Instruction> instructions;
+    instructions.reserve(pc);
+    std::vector<std::pair<int32_t, std::string_view>> called;
+    auto append = [&](const Function& function) {
+      size_t base = instructions.size();
+      instructions.insert(instructions.end(), function.code.begin(),
+                          function.code.end());
+      for (const auto& call : function.calls) {
+        auto entry = entries.find(call.name);
+        if (IsInheritedName(call.name) || entry == entries.end() ||
+            arities[call.name] != call.arity) {
+          Error(entry == entries.end() ? "Undefined function"
+                                       : "Function parameter mismatch",
+                call.name, call.line);
+          return false;
+        }
+        instructions[base + call.pc].arg = entry->second;
+        called.emplace_back(entry->second, entry->first);
+      }
+      return true;
+    };
+    if (!append(main_))
+      return std::nullopt;
+    for (const auto& function : functions_) {
+      if (!function.prototype && !append(function))
+        return std::nullopt;
+    }
+
+    // Like the .kx loader, keep the name of every function that is called,
+    // once per entry point.
+    std::stable_sort(
+        called.begin(), called.end(),
+        [](const auto& a, const auto& b) { return a.first < b.first; });
+    called.erase(std::unique(called.begin(), called.end(),
+                             [](const auto& a, const auto& b) {
+                               return a.first == b.first;
+                             }),
+                 called.end());
+    std::string names;
+    for (const auto& function : called)
+      names.append(function.second);
+    FileContents contents = FileContents::Copy(names);
+    std::vector<FunctionName> function_names;
+    function_names.reserve(called.size());
+    size_t offset = 0;
+    for (const auto& function : called) {
+      function_names.emplace_back(FunctionName{
+          function.first,
+          contents.view().substr(offset, function.second.size())});
+      offset += function.second.size();
+    }
+
+    Program program(std::move(instructions), std::move(contents),
+                    std::move(function_names));
+    program.set_source_key(hash::Key::Of(source_));
+    return std::make_optional<Program>(std::move(program));
+  }
+
+  const std::string_view source_;
+  const Language language_;
+  Lexer lexer_;
+  Lexeme lookahead_;
+  // The line of the last token shifted, the jison parser's yylineno.
+  int32_t line_ = 0;
+  // How many Nestings are alive.
+  size_t depth_ = 0;
+
+  Function main_;
+  // Functions and prototypes in the order in which they appear.
+  std::vector<Function> functions_;
+  Function* function_ = nullptr;
+
+  DISALLOW_COPY_AND_ASSIGN(Compiler);
+};
+
+// Matches /\/\*(?:[^*]|\*[^)])*\*\// with |close| as the last character (or
+// the same with "(*" and ")") at the start of |code|, the way a backtracking
+// JavaScript regexp does. The loop can only take one path, and being greedy,
+// the match ends at the last "*<close>" on it. Returns the length of the
+// match, or 0 if there is none.
+size_t MatchDetectionComment(std::string_view code, char close) {
+  size_t end = 0;
+  size_t pos = 2;
+  while (pos < code.size()) {
+    if (code[pos] == '*' && pos + 1 < code.size() && code[pos + 1] == close)
+      end = pos + 2;
+    if (code[pos] != '*')
+      ++pos;
+    else if (pos + 1 < code.size() && code[pos + 1] != ')')
+      pos += 2;
+    else
+      break;
+  }
+  return end;
+}
+
+bool IsDetectionWordCharacter(char c) {
+  return IsAsciiAlpha(c) || IsAsciiDigit(c) || c == '_' || c == '-';
+}
+
+}  // namespace
+
+Language DetectLanguage(std::string_view source) {
+  size_t i = 0;
+  while (i < source.size()) {
+    std::string_view code = source.substr(i);
+    size_t next = i;
+    if (IsWhitespace(DecodeCodePoint(source, &next))) {
+      i = SkipWhitespace(source, i);
+      continue;
+    }
+    if (code.substr(0, 2) == "//" || code[0] == '#') {
+      i = std::min(source.find('\n', i), source.size());
+      continue;
+    }
+    size_t comment = 0;
+    if (code.substr(0, 2) == "/*") {
+      comment = MatchDetectionComment(code, '/');
+    } else if (code[0] == '{') {
+      size_t end = code.find('}');
+      if (end != std::string_view::npos)
+        comment = end + 1;
+    } else if (code.substr(0, 2) == "(*") {
+      comment = MatchDetectionComment(code, ')');
+    }
+    if (comment != 0) {
+      i += comment;
+      continue;
+    }
+
+    size_t length = 0;
+    if (!IsDetectionWordCharacter(code[0])) {
+      while (length < code.size() && !IsDetectionWordCharacter(code[length]))
+        ++length;
+      i += length;
+      continue;
+    }
+    while (length < code.size() && IsDetectionWordCharacter(code[length]))
+      ++length;
+    std::string_view word = code.substr(0, length);
+    if (word == "class")
+      return Language::JAVA;
+    if (ToLower(word) == "iniciar-programa")
+      return Language::PASCAL;
+    return Language::RUBY;
+  }
+  return Language::NONE;
+}
+
+std::optional<Program> CompileProgram(std::string_view source) {
+  Language language = DetectLanguage(source);
+  switch (language) {
+    case Language::JAVA:
+    case Language::PASCAL:
+      return Compiler(source, language).Compile();
+    case Language::RUBY:
+      LOG(ERROR) << "Karel Ruby programs are not supported";
+      return std::nullopt;
+    case Language::NONE:
+      break;
+  }
+  LOG(ERROR) << "The source has no program";
+  return std::nullopt;
+}
+
+}  // namespace karel
@@ -0,0 +1,37 @@
+#ifndef COMPILER_H_
+#define COMPILER_H_
+
+#include <optional>
+#include <string_view>
+
+#include "program.h"
+
+namespace karel {
+
+enum class Language { NONE, JAVA, PASCAL, RUBY };
+
+// Guesses the language of |source| from its first word, like detectLanguage()
+// in js/karel.js.
+Language DetectLanguage(std::string_view source);
+
+// Compiles a Karel Java or Karel Pascal program straight into instructions.
+// The result is exactly what karel.compile() in js/karel.js would produce and
+// Program::Parse() would load from the .kx file, function names included, so
+// the quirks of the jison parsers are reproduced too:
+//
+//  * LINE instructions carry the 0-based line of the last token the parser
+//    had shifted, and the line that ends the main program is the one of the
+//    end of the input. A \r\n that ends a Java // comment counts twice.
+//  * Keywords are case-sensitive in both languages, and Karel Pascal skips
+//    any character that does not start a token.
+//  * Numbers go through a double, so large ones are rounded like
+//    JSON.stringify() prints them, and then wrapped to 32 bits like the .kx
+//    loader does. Numbers of 1e21 and above, which the loader rejects, are
+//    rejected here.
+//
+// Logs the error and returns std::nullopt if the program does not compile.
+std::optional<Program> CompileProgram(std::string_view source);
+
+}  // namespace karel
+
+#endif  // COMPILER_H_
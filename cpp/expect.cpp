@@ -0,0 +1,311 @@
+#include "expect.h"
+
+#include <charconv>
+#include <type_traits>
+
+#include "logging.h"
+#include "xml.h"
+
+namespace karel {
+
+namespace {
+
+// The characters that `diff -w` ignores.
+bool IsWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+void AppendWithoutWhitespace(std::string* out, std::string_view str) {
+  for (char c : str) {
+    if (!IsWhitespace(c))
+      out->push_back(c);
+  }
+}
+
+// Whether |value| is |stripped| once its whitespace is removed.
+bool EqualsIgnoringWhitespace(std::string_view stripped,
+                              std::string_view value) {
+  size_t i = 0;
+  for (char c : value) {
+    if (IsWhitespace(c))
+      continue;
+    if (i == stripped.size() || stripped[i] != c)
+      return false;
+    ++i;
+  }
+  return i == stripped.size();
+}
+
+// The attributes of an element of the actual result. Numbers are formatted
+// in place, exactly like World::DumpResult() writes them.
+class Attributes {
+ public:
+  Attributes() = default;
+
+  void Add(std::string_view name, std::string_view value) {
+    entries_[size_++] = {name, value};
+  }
+  template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+  void Add(std::string_view name, T value) {
+    char* buffer = numbers_[size_];
+    char* end = std::to_chars(buffer, buffer + kMaxNumberSize, value).ptr;
+    Add(name, std::string_view(buffer, end - buffer));
+  }
+
+  const std::pair<std::string_view, std::string_view>* begin() const {
+    return entries_;
+  }
+  const std::pair<std::string_view, std::string_view>* end() const {
+    return entries_ + size_;
+  }
+  size_t size() const { return size_; }
+
+ private:
+  // <instrucciones> has the most attributes.
+  static constexpr size_t kMaxAttributes = 4;
+  // Enough for any 64-bit integer, including its sign.
+  static constexpr size_t kMaxNumberSize = 24;
+
+  std::pair<std::string_view, std::string_view> entries_[kMaxAttributes];
+  char numbers_[kMaxAttributes][kMaxNumberSize];
+  size_t size_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(Attributes);
+};
+
+}  // namespace
+
+// Walks the actual result in document order and matches every element and
+// every token of its text against the expected nodes, stopping at the first
+// difference. It is also the sink for World::ForEachResultLine().
+class ExpectedResult::Comparer {
+ public:
+  explicit Comparer(const std::vector<Node>& nodes) : nodes_(nodes) {}
+
+  // Matches the start of an element. Its text follows through Token(), and
+  // End() must be called once it is complete.
+  void Begin(size_t depth,
+             std::string_view name,
+             const Attributes& attributes = Attributes()) {
+    if (mismatch_)
+      return;
+    if (cursor_ == nodes_.size()) {
+      mismatch_ = "unexpected " + Describe(name, attributes);
+      return;
+    }
+    const Node& node = nodes_[cursor_++];
+    if (!Matches(node, depth, name, attributes)) {
+      mismatch_ = "expected " + Describe(node) + ", got " +
+                  Describe(name, attributes);
+      return;
+    }
+    text_offset_ = 0;
+  }
+
+  void Token(std::string_view token) {
+    if (mismatch_) {
+      if (actual_text_)
+        actual_text_->append(token);
+      return;
+    }
+    std::string_view text = nodes_[cursor_ - 1].text;
+    if (text.compare(text_offset_, token.size(), token) != 0) {
+      actual_text_ = std::string(text.substr(0, text_offset_));
+      mismatch_.emplace();
+      actual_text_->append(token);
+      return;
+    }
+    text_offset_ += token.size();
+  }
+
+  void End() {
+    if (actual_text_) {
+      const Node& node = nodes_[cursor_ - 1];
+      mismatch_ = Describe(node) + ": expected \"" + node.text + "\", got \"" +
+                  actual_text_.value() + "\"";
+      actual_text_.reset();
+      return;
+    }
+    if (mismatch_)
+      return;
+    const Node& node = nodes_[cursor_ - 1];
+    if (text_offset_ != node.text.size()) {
+      mismatch_ = Describe(node) + ": expected \"" + node.text + "\", got \"" +
+                  node.text.substr(0, text_offset_) + "\"";
+    }
+  }
+
+  // The sink interface of World::ForEachResultLine().
+  void BeginLine(size_t y) {
+    Attributes attributes;
+    attributes.Add("fila", static_cast<ssize_t>(y + 1));
+    attributes.Add("compresionDeCeros", "true");
+    Begin(3, "linea", attributes);
+  }
+  void Coordinate(uint32_t x) {
+    char buffer[16] = "(";
+    char* end =
+        std::to_chars(buffer + 1, buffer + sizeof(buffer) - 1, x + 1).ptr;
+    *end++ = ')';
+    Token(std::string_view(buffer, end - buffer));
+  }
+  void Value(uint32_t buzzers) {
+    char buffer[16];
+    char* end = std::to_chars(buffer, buffer + sizeof(buffer), buzzers).ptr;
+    Token(std::string_view(buffer, end - buffer));
+  }
+  void EndLine() { End(); }
+
+  std::optional<std::string> Finish() {
+    if (!mismatch_ && cursor_ != nodes_.size())
+      mismatch_ = "missing " + Describe(nodes_[cursor_]);
+    return std::move(mismatch_);
+  }
+
+ private:
+  static bool Matches(const Node& node,
+                      size_t depth,
+                      std::string_view name,
+                      const Attributes& attributes) {
+    if (node.depth != depth || node.name != name ||
+        node.attributes.size() != attributes.size()) {
+      return false;
+    }
+    for (const auto& [attribute_name, value] : attributes) {
+      bool found = false;
+      for (const auto& expected : node.attributes) {
+        if (expected.first == attribute_name) {
+          found = EqualsIgnoringWhitespace(expected.second, value);
+          break;
+        }
+      }
+      if (!found)
+        return false;
+    }
+    return true;
+  }
+
+  static std::string Describe(const Node& node) {
+    std::string description = "<" + node.name;
+    for (const auto& [name, value] : node.attributes)
+      description += " " + name + "=\"" + value + "\"";
+    return description + ">";
+  }
+
+  static std::string Describe(std::string_view name,
+                              const Attributes& attributes) {
+    std::string description = "<" + std::string(name);
+    for (const auto& [attribute_name, value] : attributes) {
+      description += " " + std::string(attribute_name) + "=\"";
+      AppendWithoutWhitespace(&description, value);
+      description += "\"";
+    }
+    return description + ">";
+  }
+
+  const std::vector<Node>& nodes_;
+  size_t cursor_ = 0;
+  size_t text_offset_ = 0;
+  std::optional<std::string> mismatch_;
+  // The text of the current element up to the first difference and beyond,
+  // only kept once it differs.
+  std::optional<std::string> actual_text_;
+
+  DISALLOW_COPY_AND_ASSIGN(Comparer);
+};
+
+ExpectedResult::ExpectedResult() = default;
+ExpectedResult::ExpectedResult(ExpectedResult&&) = default;
+ExpectedResult& ExpectedResult::operator=(ExpectedResult&&) = default;
+ExpectedResult::~ExpectedResult() = default;
+
+// static
+std::optional<ExpectedResult> ExpectedResult::Parse(std::string_view document) {
+  ExpectedResult expected;
+  std::vector<Node>& nodes = expected.nodes_;
+  xml::Reader reader;
+  bool success = reader.Parse(
+      document,
+      [&nodes](xml::Reader::Element element) {
+        Node node{std::string(element.GetName()), element.depth(), {}, {}};
+        for (const auto& [name, value] : element.GetAttributes()) {
+          node.attributes.emplace_back(std::string(name), std::string());
+          AppendWithoutWhitespace(&node.attributes.back().second, value);
+        }
+        nodes.push_back(std::move(node));
+        return true;
+      },
+      [&nodes](std::string_view text) {
+        // Results have no mixed content, so text always belongs to the last
+        // element that was opened.
+        if (!nodes.empty())
+          AppendWithoutWhitespace(&nodes.back().text, text);
+      });
+  if (!success || nodes.empty()) {
+    LOG(ERROR) << "Invalid expected result";
+    return std::nullopt;
+  }
+  return std::make_optional<ExpectedResult>(std::move(expected));
+}
+
+std::optional<std::string> ExpectedResult::Compare(const World& world,
+                                                   RunResult result) const {
+  const WorldImage& image = world.image();
+  const Runtime& runtime = world.runtime();
+  Comparer comparer(nodes_);
+
+  comparer.Begin(0, "resultados");
+  if (image.dump_world() || image.dump_universe()) {
+    comparer.Begin(1, "mundos");
+    comparer.End();
+    Attributes mundo;
+    mundo.Add("nombre", image.name());
+    comparer.Begin(2, "mundo", mundo);
+    comparer.End();
+    world.ForEachResultLine(&comparer);
+  }
+
+  comparer.Begin(1, "programas");
+  comparer.End();
+  Attributes programa;
+  programa.Add("nombre", image.program_name());
+  programa.Add("resultadoEjecucion", World::ExecutionResultName(result));
+  comparer.Begin(2, "programa", programa);
+  comparer.End();
+  if (image.dump_position() || image.dump_orientation() || image.dump_bag()) {
+    Attributes karel;
+    if (image.dump_position()) {
+      karel.Add("x", runtime.x + 1);
+      karel.Add("y", runtime.y + 1);
+    }
+    auto direccion = World::OrientationName(runtime.orientation);
+    if (image.dump_orientation() && direccion)
+      karel.Add("direccion", direccion.value());
+    if (image.dump_bag()) {
+      if (runtime.bag == kInfinity)
+        karel.Add("mochila", "INFINITO");
+      else
+        karel.Add("mochila", runtime.bag);
+    }
+    comparer.Begin(3, "karel", karel);
+    comparer.End();
+  }
+  if (image.dump_forward() || image.dump_left() || image.dump_leavebuzzer() ||
+      image.dump_pickbuzzer()) {
+    Attributes instrucciones;
+    if (image.dump_forward())
+      instrucciones.Add("avanza", runtime.forward_count);
+    if (image.dump_left())
+      instrucciones.Add("gira_izquierda", runtime.left_count);
+    if (image.dump_pickbuzzer())
+      instrucciones.Add("coge_zumbador", runtime.pickbuzzer_count);
+    if (image.dump_leavebuzzer())
+      instrucciones.Add("deja_zumbador", runtime.leavebuzzer_count);
+    comparer.Begin(3, "instrucciones", instrucciones);
+    comparer.End();
+  }
+  return comparer.Finish();
+}
+
+}  // namespace karel
@@ -0,0 +1,56 @@
+#ifndef EXPECT_H_
+#define EXPECT_H_
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "karel.h"
+#include "macros.h"
+#include "world.h"
+
+namespace karel {
+
+// The expected XML result of a case, parsed once so that runs can be graded
+// against it without writing their own result. A run matches if the result
+// that World::DumpResult() would write has the same elements, with the same
+// attributes and contents, ignoring whitespace like `diff -w` does. Attributes
+// may appear in any order.
+class ExpectedResult {
+ public:
+  ExpectedResult(ExpectedResult&&);
+  ExpectedResult& operator=(ExpectedResult&&);
+  ~ExpectedResult();
+
+  static std::optional<ExpectedResult> Parse(std::string_view document);
+
+  // Grades the final state of |world| after a run that ended with |result|.
+  // Returns a one-line description of the first difference, or std::nullopt
+  // if the run matches.
+  std::optional<std::string> Compare(const World& world,
+                                     RunResult result) const;
+
+ private:
+  // The elements of the expected result in document order. Attribute values
+  // and text have their whitespace removed.
+  struct Node {
+    std::string name;
+    size_t depth;
+    std::vector<std::pair<std::string, std::string>> attributes;
+    std::string text;
+  };
+
+  class Comparer;
+
+  ExpectedResult();
+
+  std::vector<Node> nodes_;
+
+  DISALLOW_COPY_AND_ASSIGN(ExpectedResult);
+};
+
+}  // namespace karel
+
+#endif  // EXPECT_H_
@@ -0,0 +1,59 @@
+#include "hash.h"
+
+#include <string.h>
+
+#include "util.h"
+
+namespace hash {
+
+namespace {
+
+constexpr uint64_t kMultiplier = 0xc6a4a7935bd1e995ull;
+constexpr int kShift = 47;
+
+uint64_t Mix(uint64_t value) {
+  value *= kMultiplier;
+  value ^= value >> kShift;
+  return value * kMultiplier;
+}
+
+}  // namespace
+
+uint64_t Hash64(std::string_view data, uint64_t seed) {
+  uint64_t hash = seed ^ (data.size() * kMultiplier);
+
+  const char* ptr = data.data();
+  const char* const end = ptr + (data.size() & ~static_cast<size_t>(7));
+  for (; ptr != end; ptr += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, ptr, sizeof(word));
+    hash ^= Mix(word);
+    hash *= kMultiplier;
+  }
+
+  size_t remaining = data.size() & 7;
+  if (remaining) {
+    uint64_t word = 0;
+    memcpy(&word, ptr, remaining);
+    hash ^= word;
+    hash *= kMultiplier;
+  }
+
+  hash ^= hash >> kShift;
+  hash *= kMultiplier;
+  hash ^= hash >> kShift;
+  return hash;
+}
+
+// static
+Key Key::Of(std::string_view data) {
+  return Key{Hash64(data, 0x6b6172656c6a73ull),
+             Hash64(data, 0x6f6d65676175ull)};
+}
+
+std::string Key::ToString() const {
+  return StringPrintf("%016llx%016llx", static_cast<unsigned long long>(high),
+                      static_cast<unsigned long long>(low));
+}
+
+}  // namespace hash
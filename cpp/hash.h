@@ -0,0 +1,32 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace hash {
+
+// A fast, non-cryptographic 64-bit hash in the style of MurmurHash64A.
+uint64_t Hash64(std::string_view data, uint64_t seed = 0);
+
+// A 128-bit content hash, used to address cached artifacts by the contents
+// they were derived from.
+struct Key {
+  uint64_t high = 0;
+  uint64_t low = 0;
+
+  static Key Of(std::string_view data);
+
+  // Returns the key as 32 lowercase hex digits.
+  std::string ToString() const;
+
+  bool operator==(const Key& other) const {
+    return high == other.high && low == other.low;
+  }
+  bool operator!=(const Key& other) const { return !(*this == other); }
+};
+
+}  // namespace hash
+
+#endif  // HASH_H_
@@ -1,14 +1,17 @@
 #include "karel.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <optional>
 #include <sstream>
-#include <stack>
 #include <string>
+#include <utility>
 
-#include "json.h"
 #include "logging.h"
+#include "macros.h"
 #include "util.h"
 
 namespace karel {
@@ -32,63 +35,37 @@ std::string Stringify(const std::vector<int32_t>& expression_stack) {
   return buffer.str();
 }
 
+// The mnemonics are looked up with a perfect hash of their first and last
+// characters and their length, which is collision-free for kOpcodeNames.
+constexpr size_t kOpcodeHashSize = 64;
+
+constexpr size_t HashMnemonic(std::string_view name) {
+  return (2 * static_cast<uint8_t>(name.front()) +
+          13 * static_cast<uint8_t>(name.back()) + name.size()) %
+         kOpcodeHashSize;
+}
+
+struct OpcodeTable {
+  int8_t opcodes[kOpcodeHashSize];
+};
+
+constexpr OpcodeTable MakeOpcodeTable() {
+  OpcodeTable table{};
+  for (size_t i = 0; i < kOpcodeHashSize; ++i)
+    table.opcodes[i] = -1;
+  for (size_t i = 0; i < array_length(kOpcodeNames); ++i)
+    table.opcodes[HashMnemonic(kOpcodeNames[i])] = i;
+  return table;
+}
+
+constexpr OpcodeTable kOpcodeTable = MakeOpcodeTable();
+
 std::optional<Opcode> ParseOpcode(std::string_view name) {
-  if (name == "HALT")
-    return Opcode::HALT;
-  if (name == "LINE")
-    return Opcode::LINE;
-  if (name == "LEFT")
-    return Opcode::LEFT;
-  if (name == "WORLDWALLS")
-    return Opcode::WORLDWALLS;
-  if (name == "ORIENTATION")
-    return Opcode::ORIENTATION;
-  if (name == "ROTL")
-    return Opcode::ROTL;
-  if (name == "ROTR")
-    return Opcode::ROTR;
-  if (name == "MASK")
-    return Opcode::MASK;
-  if (name == "NOT")
-    return Opcode::NOT;
-  if (name == "AND")
-    return Opcode::AND;
-  if (name == "OR")
-    return Opcode::OR;
-  if (name == "EQ")
-    return Opcode::EQ;
-  if (name == "EZ")
-    return Opcode::EZ;
-  if (name == "JZ")
-    return Opcode::JZ;
-  if (name == "JMP")
-    return Opcode::JMP;
-  if (name == "FORWARD")
-    return Opcode::FORWARD;
-  if (name == "WORLDBUZZERS")
-    return Opcode::WORLDBUZZERS;
-  if (name == "BAGBUZZERS")
-    return Opcode::BAGBUZZERS;
-  if (name == "PICKBUZZER")
-    return Opcode::PICKBUZZER;
-  if (name == "LEAVEBUZZER")
-    return Opcode::LEAVEBUZZER;
-  if (name == "LOAD")
-    return Opcode::LOAD;
-  if (name == "POP")
-    return Opcode::POP;
-  if (name == "DUP")
-    return Opcode::DUP;
-  if (name == "DEC")
-    return Opcode::DEC;
-  if (name == "INC")
-    return Opcode::INC;
-  if (name == "CALL")
-    return Opcode::CALL;
-  if (name == "RET")
-    return Opcode::RET;
-  if (name == "PARAM")
-    return Opcode::PARAM;
+  if (!name.empty()) {
+    int8_t opcode = kOpcodeTable.opcodes[HashMnemonic(name)];
+    if (opcode != -1 && name == kOpcodeNames[opcode])
+      return static_cast<Opcode>(opcode);
+  }
   LOG(ERROR) << "Invalid mnemonic: " << name;
   return std::nullopt;
 }
@@ -110,150 +87,380 @@ std::optional<RunResult> ParseRunResult(std::string_view name) {
   return std::nullopt;
 }
 
-std::optional<Instruction> ParseInstruction(const json::ListValue& value) {
-  if (value.value().size() == 0) {
-    LOG(ERROR) << "Empty instruction " << value;
-    return std::nullopt;
+// Decodes a .kx program straight into Instructions in a single pass, without
+// building an intermediate JSON tree. It accepts exactly the inputs that the
+// previous parser, which built a JSON tree first, accepted, quirks included:
+//
+//  * Whitespace is only allowed before a value, never before a separator or
+//    at the end of the input.
+//  * Anything that does not start a list or a string is an integer made of an
+//    optional '-' and zero or more digits, so an empty list element is 0.
+//  * A backslash in a string skips the next character, but only counts once
+//    towards the length of the string.
+class ProgramDecoder {
+ public:
+  ProgramDecoder(std::string_view program,
+                 std::vector<FunctionName>* functions)
+      : begin_(program.data()),
+        ptr_(program.data()),
+        end_(program.data() + program.size()),
+        functions_(functions) {}
+
+  std::optional<std::vector<Instruction>> Decode() {
+    if (!SkipWhitespace())
+      return Error("Invalid JSON");
+    if (*ptr_ != '[')
+      return Error("Invalid program");
+    ++ptr_;
+
+    std::vector<Instruction> instructions;
+    // The shortest instruction, ["OR"], takes seven bytes plus the comma.
+    instructions.reserve((end_ - ptr_) / 8);
+    while (true) {
+      if (!SkipWhitespace())
+        return Error("Invalid JSON");
+      if (*ptr_ != '[')
+        return Error("Invalid instruction");
+      auto instruction = DecodeInstruction();
+      if (!instruction)
+        return std::nullopt;
+      instructions.emplace_back(instruction.value());
+
+      auto separator = ReadSeparator();
+      if (separator == Separator::INVALID)
+        return Error("Invalid JSON");
+      if (separator == Separator::END)
+        break;
+    }
+
+    if (ptr_ != end_)
+      return Error("Unconsumed state");
+    if (functions_) {
+      std::stable_sort(functions_->begin(), functions_->end(),
+                       [](const FunctionName& a, const FunctionName& b) {
+                         return a.pc < b.pc;
+                       });
+      functions_->erase(
+          std::unique(functions_->begin(), functions_->end(),
+                      [](const FunctionName& a, const FunctionName& b) {
+                        return a.pc == b.pc;
+                      }),
+          functions_->end());
+    }
+    return instructions;
   }
-  if (value.value()[0]->GetType() != json::Type::STRING) {
-    LOG(ERROR) << "Non-string mnemonic " << value;
-    return std::nullopt;
+
+ private:
+  enum class Separator { NEXT, END, INVALID };
+
+  static constexpr bool IsWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
   }
-  std::string_view opcode_name = value.value()[0]->AsString().value();
-  auto opcode = ParseOpcode(opcode_name);
-  if (!opcode) {
-    LOG(ERROR) << "Invalid opcode " << value;
+
+  std::nullopt_t Error(const char* message) const {
+    LOG(ERROR) << message << " at offset " << (ptr_ - begin_);
     return std::nullopt;
   }
 
-  Instruction ins{opcode.value(), 0};
-
-  switch (opcode.value()) {
-    case Opcode::HALT:
-    case Opcode::LEFT:
-    case Opcode::WORLDWALLS:
-    case Opcode::ORIENTATION:
-    case Opcode::ROTL:
-    case Opcode::ROTR:
-    case Opcode::MASK:
-    case Opcode::NOT:
-    case Opcode::AND:
-    case Opcode::OR:
-    case Opcode::EQ:
-    case Opcode::FORWARD:
-    case Opcode::WORLDBUZZERS:
-    case Opcode::BAGBUZZERS:
-    case Opcode::PICKBUZZER:
-    case Opcode::LEAVEBUZZER:
-    case Opcode::POP:
-    case Opcode::DUP:
-    case Opcode::DEC:
-    case Opcode::INC:
-    case Opcode::RET:
-      // nullary
-      if (value.value().size() != 1) {
-        LOG(ERROR) << "Unexpected argument to " << value;
-        return std::nullopt;
-      }
-      return ins;
-
-    case Opcode::PARAM:
-    case Opcode::LINE:
-    case Opcode::LOAD:
-    case Opcode::JZ:
-    case Opcode::JMP:
-      // unary
-      if (value.value().size() != 2) {
-        LOG(ERROR) << "Unexpected arguments to " << value;
-        return std::nullopt;
-      }
-      if (value.value()[1]->GetType() != json::Type::INT) {
-        LOG(ERROR) << "Invalid argument to " << value;
-        return std::nullopt;
-      }
-      ins.arg = value.value()[1]->AsInt().value();
-      return ins;
+  // Skips the whitespace before a value. Returns false if the input ends
+  // before the value starts.
+  bool SkipWhitespace() {
+    while (ptr_ != end_ && IsWhitespace(*ptr_))
+      ++ptr_;
+    return ptr_ != end_;
+  }
 
-    case Opcode::EZ: {
-      // unary, string
-      if (value.value().size() != 2) {
-        LOG(ERROR) << "Unexpected arguments to " << value;
-        return std::nullopt;
-      }
-      if (value.value()[1]->GetType() != json::Type::STRING) {
-        LOG(ERROR) << "Invalid argument to " << value;
-        return std::nullopt;
-      }
-      auto result = ParseRunResult(value.value()[1]->AsString().value());
-      if (!result) {
-        return std::nullopt;
-      }
-      ins.arg = static_cast<int32_t>(result.value());
-      return ins;
+  Separator ReadSeparator() {
+    if (ptr_ == end_)
+      return Separator::INVALID;
+    switch (*ptr_++) {
+      case ',':
+        return Separator::NEXT;
+      case ']':
+        return Separator::END;
+      default:
+        return Separator::INVALID;
     }
+  }
 
-    case Opcode::CALL:
-      // binary
-      if (value.value().size() != 3) {
-        LOG(ERROR) << "Unexpected arguments to " << value;
-        return std::nullopt;
+  int32_t ReadInt() {
+    uint32_t sign = 1;
+    if (*ptr_ == '-') {
+      sign = -1;
+      ++ptr_;
+    }
+    uint32_t value = 0;
+    for (; ptr_ != end_ && '0' <= *ptr_ && *ptr_ <= '9'; ++ptr_)
+      value = 10 * value + (*ptr_ - '0');
+    return static_cast<int32_t>(sign * value);
+  }
+
+  std::optional<std::string_view> ReadString() {
+    const char* string_begin = ++ptr_;
+    for (size_t length = 0; ptr_ != end_; length++, ptr_++) {
+      switch (*ptr_) {
+        case '"':
+          ++ptr_;
+          return std::string_view(string_begin, length);
+        case '\\':
+          if (++ptr_ == end_)
+            return std::nullopt;
+          break;
       }
-      if (value.value()[1]->GetType() != json::Type::INT) {
-        LOG(ERROR) << "Invalid argument to " << value;
-        return std::nullopt;
+    }
+    return std::nullopt;
+  }
+
+  // Skips over a value of any type, which must not be preceded by whitespace.
+  bool SkipValue() {
+    switch (*ptr_) {
+      case '"':
+        return ReadString().has_value();
+      case '[':
+        ++ptr_;
+        while (true) {
+          if (!SkipWhitespace() || !SkipValue())
+            return false;
+          auto separator = ReadSeparator();
+          if (separator == Separator::INVALID)
+            return false;
+          if (separator == Separator::END)
+            return true;
+        }
+      default:
+        ReadInt();
+        return true;
+    }
+  }
+
+  std::optional<Instruction> DecodeInstruction() {
+    ++ptr_;
+    Instruction ins;
+    size_t arguments = 0;
+    size_t size = 0;
+    for (;; ++size) {
+      if (!SkipWhitespace())
+        return Error("Invalid JSON");
+
+      if (size == 0) {
+        if (*ptr_ != '"')
+          return Error("Non-string mnemonic");
+        auto mnemonic = ReadString();
+        if (!mnemonic)
+          return Error("Invalid JSON");
+        auto opcode = ParseOpcode(mnemonic.value());
+        if (!opcode)
+          return Error("Invalid opcode");
+        ins.opcode = opcode.value();
+        arguments = OpcodeArguments(ins.opcode);
+      } else if (size == 1 && arguments >= 1) {
+        if (ins.opcode == Opcode::EZ) {
+          if (*ptr_ != '"')
+            return Error("Invalid argument");
+          auto name = ReadString();
+          if (!name)
+            return Error("Invalid JSON");
+          auto result = ParseRunResult(name.value());
+          if (!result)
+            return Error("Invalid argument");
+          ins.arg = static_cast<int32_t>(result.value());
+        } else {
+          if (*ptr_ == '"' || *ptr_ == '[')
+            return Error("Invalid argument");
+          ins.arg = ReadInt();
+        }
+      } else if (size < arguments + 1) {
+        // The name of the function in CALL, which is only kept on request.
+        const char* name_begin = ptr_;
+        if (!SkipValue())
+          return Error("Invalid JSON");
+        if (functions_ && *name_begin == '"') {
+          functions_->push_back(FunctionName{
+              ins.arg,
+              std::string_view(name_begin + 1, ptr_ - name_begin - 2)});
+        }
+      } else {
+        return Error("Unexpected arguments");
       }
-      ins.arg = value.value()[1]->AsInt().value();
-      return ins;
+
+      auto separator = ReadSeparator();
+      if (separator == Separator::INVALID)
+        return Error("Invalid JSON");
+      if (separator == Separator::END)
+        break;
+    }
+    if (size != arguments)
+      return Error("Unexpected arguments");
+    return ins;
   }
 
-  return ins;
-}
+  static size_t OpcodeArguments(Opcode opcode) {
+    switch (opcode) {
+      case Opcode::PARAM:
+      case Opcode::LINE:
+      case Opcode::LOAD:
+      case Opcode::JZ:
+      case Opcode::JMP:
+      case Opcode::EZ:
+        return 1;
+      case Opcode::CALL:
+        return 2;
+      default:
+        return 0;
+    }
+  }
 
-struct StackFrame {
-  int32_t pc;
-  int32_t param;
-  size_t sp;
+  const char* const begin_;
+  const char* ptr_;
+  const char* const end_;
+  std::vector<FunctionName>* const functions_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProgramDecoder);
 };
 
+// Bands are sized so that a private copy is roughly one page.
+constexpr size_t kBandBytes = 4096;
+
+size_t BandRows(size_t width) {
+  return std::max<size_t>(
+      1, kBandBytes / sizeof(uint32_t) / std::max<size_t>(1, width));
+}
+
 }  // namespace
 
-std::optional<std::vector<Instruction>> ParseInstructions(
-    std::string_view program) {
-  auto parsed_json = json::Parse(program);
-  if (!parsed_json) {
-    LOG(ERROR) << "Invalid JSON";
-    return std::nullopt;
+BuzzerOverlay::BuzzerOverlay(const uint32_t* base, size_t width, size_t height)
+    : base_(base),
+      width_(width),
+      height_(height),
+      band_rows_(BandRows(width)),
+      rows_(height),
+      owned_(height),
+      storage_((height + band_rows_ - 1) / band_rows_) {
+  for (size_t y = 0; y < height_; ++y)
+    rows_[y] = base_ + y * width_;
+}
+
+BuzzerOverlay::~BuzzerOverlay() = default;
+
+void BuzzerOverlay::Reset() {
+  for (size_t band : dirty_) {
+    size_t first_row = band * band_rows_;
+    size_t last_row = std::min(height_, first_row + band_rows_);
+    for (size_t y = first_row; y < last_row; ++y) {
+      rows_[y] = base_ + y * width_;
+      owned_[y] = false;
+    }
   }
-  if ((*parsed_json)->GetType() != json::Type::LIST) {
-    LOG(ERROR) << "Invalid program " << *parsed_json.value();
-    return std::nullopt;
+  dirty_.clear();
+}
+
+void BuzzerOverlay::Reset(const uint32_t* base, size_t width, size_t height) {
+  // Every private copy holds at least |band_rows_| * |width_| cells, so they
+  // can be kept for the new grid unless its bands are larger.
+  const size_t band_size = band_rows_ * width_;
+  base_ = base;
+  width_ = width;
+  height_ = height;
+  band_rows_ = BandRows(width);
+  rows_.resize(height_);
+  for (size_t y = 0; y < height_; ++y)
+    rows_[y] = base_ + y * width_;
+  owned_.assign(height_, false);
+  dirty_.clear();
+  if (band_rows_ * width_ > band_size)
+    storage_.clear();
+  storage_.resize((height_ + band_rows_ - 1) / band_rows_);
+}
+
+std::vector<size_t> BuzzerOverlay::DirtyRows() const {
+  std::vector<size_t> bands(dirty_);
+  std::sort(bands.begin(), bands.end());
+  std::vector<size_t> rows;
+  for (size_t band : bands) {
+    size_t first_row = band * band_rows_;
+    size_t last_row = std::min(height_, first_row + band_rows_);
+    for (size_t y = first_row; y < last_row; ++y)
+      rows.push_back(y);
   }
-  const json::ListValue& list_value = (*parsed_json)->AsList();
+  return rows;
+}
 
-  std::vector<Instruction> instructions;
-  for (const auto& entry : list_value.value()) {
-    if (entry->GetType() != json::Type::LIST) {
-      LOG(ERROR) << "Invalid instruction " << *entry;
-      return std::nullopt;
-    }
-    auto instruction = ParseInstruction(entry->AsList());
-    if (!instruction)
-      return std::nullopt;
-    instructions.emplace_back(std::move(instruction.value()));
+void BuzzerOverlay::CopyBand(size_t band) {
+  size_t first_row = band * band_rows_;
+  size_t last_row = std::min(height_, first_row + band_rows_);
+  if (!storage_[band])
+    storage_[band] = std::make_unique<uint32_t[]>(band_rows_ * width_);
+  uint32_t* copy = storage_[band].get();
+  memcpy(copy, base_ + first_row * width_,
+         (last_row - first_row) * width_ * sizeof(uint32_t));
+  for (size_t y = first_row; y < last_row; ++y) {
+    rows_[y] = copy + (y - first_row) * width_;
+    owned_[y] = true;
   }
+  dirty_.push_back(band);
+}
 
-  return instructions;
+std::optional<std::vector<Instruction>> ParseInstructions(
+    std::string_view program,
+    std::vector<FunctionName>* functions) {
+  return ProgramDecoder(program, functions).Decode();
 }
 
-RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
-  int32_t pc = 0;
-  size_t ic = 0;
-  std::stack<StackFrame> function_stack;
-  std::vector<int32_t> expression_stack;
+namespace {
 
-  while (static_cast<size_t>(pc) < program.size()) {
-    if (ic >= runtime->instruction_limit)
-      return RunResult::INSTRUCTION;
+// Stores the number of executed instructions in the Runtime and in the
+// ExecutionState however the run ends.
+class InstructionCountPublisher {
+ public:
+  InstructionCountPublisher(const size_t* ic,
+                            Runtime* runtime,
+                            ExecutionState* state)
+      : ic_(ic), runtime_(runtime), state_(state) {}
+  ~InstructionCountPublisher() {
+    runtime_->instruction_count = *ic_;
+    state_->instruction_count = *ic_;
+  }
+
+ private:
+  const size_t* const ic_;
+  Runtime* const runtime_;
+  ExecutionState* const state_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstructionCountPublisher);
+};
+
+template <bool kHeatmap, bool kEvents>
+std::optional<RunResult> RunImpl(const Instruction* program,
+                                 size_t size,
+                                 Runtime* runtime,
+                                 ExecutionState* state,
+                                 size_t slice) {
+  int32_t pc = state->pc;
+  size_t ic = state->instruction_count;
+  InstructionCountPublisher publisher(&ic, runtime, state);
+  std::vector<StackFrame>& function_stack = state->stacks.function_stack;
+  std::vector<int32_t>& expression_stack = state->stacks.expression_stack;
+
+  // Both the instruction limit and the end of the slice are checked with a
+  // single comparison.
+  size_t stop = runtime->instruction_limit;
+  if (ic < stop && slice < stop - ic)
+    stop = ic + slice;
+
+  while (static_cast<size_t>(pc) < size) {
+    if (ic >= stop) {
+      if (ic >= runtime->instruction_limit)
+        return RunResult::INSTRUCTION;
+      state->pc = pc;
+      return std::nullopt;
+    }
+    // Every instruction records at most one event.
+    if constexpr (kEvents) {
+      if (runtime->events->full()) {
+        state->pc = pc;
+        return std::nullopt;
+      }
+    }
 
     const auto& curr = program[pc];
     if (kDebug) {
@@ -267,12 +474,18 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         return RunResult::OK;
 
       case Opcode::LINE:
+        if constexpr (kEvents) {
+          if (runtime->line != static_cast<size_t>(curr.arg))
+            runtime->events->Append(MakeEvent(EventType::LINE, curr.arg));
+        }
         runtime->line = curr.arg;
         break;
 
       case Opcode::LEFT:
         ic++;
         runtime->orientation = (runtime->orientation + 3) & 3;
+        if constexpr (kEvents)
+          runtime->events->Append(MakeEvent(EventType::LEFT));
         if (++runtime->left_count > runtime->left_limit)
           return RunResult::INSTRUCTION;
         break;
@@ -286,8 +499,11 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         int32_t param = expression_stack.back();
         expression_stack.pop_back();
 
-        function_stack.emplace(StackFrame{pc, param, expression_stack.size()});
+        function_stack.emplace_back(
+            StackFrame{pc, param, expression_stack.size()});
         pc = curr.arg - 1;
+        if constexpr (kEvents)
+          runtime->events->Append(MakeEvent(EventType::CALL, curr.arg));
 
         if (function_stack.size() >= runtime->stack_limit)
           return RunResult::STACK;
@@ -298,11 +514,13 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
       case Opcode::RET: {
         if (function_stack.empty())
           return RunResult::OK;
-        StackFrame& frame = function_stack.top();
+        StackFrame& frame = function_stack.back();
         pc = frame.pc;
         if (expression_stack.size() > frame.sp)
           expression_stack.resize(frame.sp);
-        function_stack.pop();
+        function_stack.pop_back();
+        if constexpr (kEvents)
+          runtime->events->Append(MakeEvent(EventType::RET));
 
         break;
       }
@@ -380,6 +598,11 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         constexpr int32_t dy[] = {0, 1, 0, -1};
         runtime->x += dx[runtime->orientation];
         runtime->y += dy[runtime->orientation];
+        if constexpr (kHeatmap)
+          runtime->heatmap[runtime->coordinates(runtime->x, runtime->y)]
+              .visits++;
+        if constexpr (kEvents)
+          runtime->events->Append(MakeEvent(EventType::FORWARD));
         if (++runtime->forward_count > runtime->forward_limit)
           return RunResult::INSTRUCTION;
         break;
@@ -397,6 +620,11 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
       case Opcode::PICKBUZZER:
         ic++;
         runtime->inc_buzzers(-1);
+        if constexpr (kHeatmap)
+          runtime->heatmap[runtime->coordinates(runtime->x, runtime->y)]
+              .picks++;
+        if constexpr (kEvents)
+          runtime->events->Append(MakeEvent(EventType::PICKBUZZER));
         if (runtime->bag != kInfinity)
           runtime->bag++;
         if (++runtime->pickbuzzer_count > runtime->pickbuzzer_limit)
@@ -406,6 +634,11 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
       case Opcode::LEAVEBUZZER:
         ic++;
         runtime->inc_buzzers(1);
+        if constexpr (kHeatmap)
+          runtime->heatmap[runtime->coordinates(runtime->x, runtime->y)]
+              .leaves++;
+        if constexpr (kEvents)
+          runtime->events->Append(MakeEvent(EventType::LEAVEBUZZER));
         if (runtime->bag != kInfinity)
           runtime->bag--;
         if (++runtime->leavebuzzer_count > runtime->leavebuzzer_limit)
@@ -436,7 +669,7 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         break;
 
       case Opcode::PARAM:
-        expression_stack.emplace_back(function_stack.top().param);
+        expression_stack.emplace_back(function_stack.back().param);
         break;
     }
 
@@ -457,4 +690,49 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
   return RunResult::OK;
 }
 
+}  // namespace
+
+void ExecutionState::Reset() {
+  pc = 0;
+  instruction_count = 0;
+  stacks.function_stack.clear();
+  stacks.expression_stack.clear();
+}
+
+std::optional<RunResult> RunSlice(const Instruction* program,
+                                  size_t size,
+                                  Runtime* runtime,
+                                  ExecutionState* state,
+                                  size_t slice) {
+  if (runtime->events) {
+    if (runtime->heatmap)
+      return RunImpl<true, true>(program, size, runtime, state, slice);
+    return RunImpl<false, true>(program, size, runtime, state, slice);
+  }
+  if (runtime->heatmap)
+    return RunImpl<true, false>(program, size, runtime, state, slice);
+  return RunImpl<false, false>(program, size, runtime, state, slice);
+}
+
+RunResult Run(const Instruction* program,
+              size_t size,
+              Runtime* runtime,
+              ExecutionStacks* stacks) {
+  ExecutionState state;
+  state.stacks = std::move(*stacks);
+  state.Reset();
+  EventRing* events = runtime->events;
+  runtime->events = nullptr;
+  auto result = RunSlice(program, size, runtime, &state,
+                         std::numeric_limits<size_t>::max());
+  runtime->events = events;
+  *stacks = std::move(state.stacks);
+  return *result;
+}
+
+RunResult Run(const Instruction* program, size_t size, Runtime* runtime) {
+  ExecutionStacks stacks;
+  return Run(program, size, runtime, &stacks);
+}
+
 }  // namespace karel
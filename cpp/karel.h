@@ -1,4 +1,8 @@
+#ifndef KAREL_H_
+#define KAREL_H_
+
 #include <limits>
+#include <memory>
 #include <optional>
 #include <string_view>
 #include <vector>
@@ -60,6 +64,136 @@ enum class RunResult : uint32_t {
   STACK
 };
 
+// A copy-on-write view over an immutable, row-major buzzer grid. The grid is
+// split into bands of whole rows of roughly one page each. A band is copied
+// into private storage the first time it is written, so any number of overlays
+// can share a single grid, and Reset() only revisits the bands that were
+// dirtied.
+class BuzzerOverlay {
+ public:
+  BuzzerOverlay(const uint32_t* base, size_t width, size_t height);
+  BuzzerOverlay(BuzzerOverlay&&) = default;
+  BuzzerOverlay& operator=(BuzzerOverlay&&) = default;
+  ~BuzzerOverlay();
+
+  uint32_t get(size_t x, size_t y) const { return rows_[y][x]; }
+
+  const uint32_t* row(size_t y) const { return rows_[y]; }
+
+  uint32_t* mutable_row(size_t y) {
+    if (!owned_[y])
+      CopyBand(y / band_rows_);
+    // Owned rows always point into |storage_|, which is not const.
+    return const_cast<uint32_t*>(rows_[y]);
+  }
+
+  // Number of bands that currently hold a private copy.
+  size_t dirty_bands() const { return dirty_.size(); }
+
+  // The rows of the bands that hold a private copy, in increasing order. Any
+  // cell that differs from the base grid is in one of them.
+  std::vector<size_t> DirtyRows() const;
+
+  // Drops all private copies, making the overlay equal to the base grid
+  // again. The private storage is kept around for the next run.
+  void Reset();
+
+  // Makes the overlay a view over another grid, keeping as much of the
+  // private storage as fits it.
+  void Reset(const uint32_t* base, size_t width, size_t height);
+
+ private:
+  void CopyBand(size_t band);
+
+  const uint32_t* base_;
+  size_t width_;
+  size_t height_;
+  size_t band_rows_;
+  std::vector<const uint32_t*> rows_;
+  std::vector<uint8_t> owned_;
+  std::vector<size_t> dirty_;
+  std::vector<std::unique_ptr<uint32_t[]>> storage_;
+};
+
+// Per-cell counters collected when a Runtime has a heatmap attached.
+struct CellCounters {
+  uint32_t visits = 0;
+  uint32_t picks = 0;
+  uint32_t leaves = 0;
+};
+
+// A Zobrist-style digest of the buzzers of a set of cells, kept up to date by
+// Runtime::inc_buzzers() when a Runtime has one attached. Every cell with
+// buzzers contributes a key derived from its index and from its count modulo
+// 65536, which is what the XML result prints, so an update is O(1) and grids
+// whose selected cells print the same have the same digest.
+struct BuzzerDigest {
+  // A width * height array that selects the cells of the digest. When unset,
+  // all cells are selected.
+  const bool* mask = nullptr;
+  uint64_t value = 0;
+
+  static uint64_t Key(size_t index, uint32_t buzzers) {
+    if (buzzers == 0)
+      return 0;
+    // The SplitMix64 finalizer.
+    uint64_t z =
+        ((static_cast<uint64_t>(index) << 16) | (buzzers & 0xFFFF)) +
+        0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  void Update(size_t index, uint32_t before, uint32_t after) {
+    if (mask && !mask[index])
+      return;
+    value ^= Key(index, before) ^ Key(index, after);
+  }
+};
+
+// What a recorded run did, one event per move, turn, buzzer picked or left,
+// change of line, call and return, so that a UI can replay it. An event is a
+// single uint32 with its EventType in the low kEventTypeBits bits and its
+// argument in the rest: the new line for LINE, and the entry point of the
+// function for CALL. The other events have no argument, since Karel's state
+// after them follows from the one before. Only the low 28 bits of an
+// argument are kept. That is plenty for the lines and entry points of real
+// programs, but a negative argument, or one of 2^28 or more, is not
+// recovered.
+enum class EventType : uint32_t {
+  FORWARD,
+  LEFT,
+  PICKBUZZER,
+  LEAVEBUZZER,
+  LINE,
+  CALL,
+  RET,
+};
+
+constexpr uint32_t kEventTypeBits = 4;
+
+constexpr uint32_t MakeEvent(EventType type, uint32_t arg = 0) {
+  return static_cast<uint32_t>(type) | arg << kEventTypeBits;
+}
+
+// A ring buffer of events over memory that the caller owns, with a power of
+// two |capacity|. The run appends events at |head| and the reader consumes
+// them from |tail|. Both only grow, and event n is at
+// events[n & (capacity - 1)]. When the ring is full, RunSlice() suspends the
+// run before its next instruction, so it can be resumed once the reader has
+// made room.
+struct EventRing {
+  uint32_t* events = nullptr;
+  size_t capacity = 0;
+  size_t head = 0;
+  size_t tail = 0;
+
+  bool full() const { return head - tail == capacity; }
+
+  void Append(uint32_t event) { events[head++ & (capacity - 1)] = event; }
+};
+
 struct Runtime {
   size_t orientation = 1;
   size_t x = 0;
@@ -80,24 +214,110 @@ struct Runtime {
   size_t width = 100;
   size_t height = 100;
   uint32_t* buzzers = nullptr;
-  uint8_t* walls = nullptr;
+  const uint8_t* walls = nullptr;
+  // When set, buzzers are read and written through this copy-on-write view
+  // and |buzzers| is unused.
+  BuzzerOverlay* overlay = nullptr;
+  // When set, a width * height array that counts how many times each cell was
+  // entered with FORWARD and how many buzzers were picked and left on it.
+  // Leaving it unset selects an uninstrumented copy of the interpreter.
+  CellCounters* heatmap = nullptr;
+  // The number of instructions executed by the last Run().
+  size_t instruction_count = 0;
+  // When set, updated with every change to the buzzers of the grid.
+  BuzzerDigest* digest = nullptr;
+  // When set, RunSlice() records the events of the run in it. Leaving it unset
+  // selects a copy of the interpreter that does not record. Run() cannot be
+  // suspended, so it never records.
+  EventRing* events = nullptr;
 
   size_t coordinates(size_t x, size_t y) const { return y * width + x; }
 
   void inc_buzzers(int32_t count) {
-    if (buzzers[coordinates(x, y)] == kInfinity)
-      return;
-    buzzers[coordinates(x, y)] += count;
+    uint32_t* cell;
+    if (overlay) {
+      if (overlay->get(x, y) == kInfinity)
+        return;
+      cell = overlay->mutable_row(y) + x;
+    } else {
+      cell = &buzzers[coordinates(x, y)];
+      if (*cell == kInfinity)
+        return;
+    }
+    if (digest)
+      digest->Update(coordinates(x, y), *cell, *cell + count);
+    *cell += count;
   }
 
-  uint32_t get_buzzers() const { return buzzers[coordinates(x, y)]; }
+  uint32_t get_buzzers() const {
+    if (overlay)
+      return overlay->get(x, y);
+    return buzzers[coordinates(x, y)];
+  }
 
   uint8_t get_walls() const { return walls[coordinates(x, y)]; }
 };
 
+// The name of the function that a CALL instruction jumps to. The name points
+// into the source the program was parsed from.
+struct FunctionName {
+  int32_t pc;
+  std::string_view name;
+};
+
+// Parses a program in the .kx JSON format. When |functions| is set, it
+// receives the name of every function that is called, once per entry point.
 std::optional<std::vector<Instruction>> ParseInstructions(
-    std::string_view program);
+    std::string_view program,
+    std::vector<FunctionName>* functions = nullptr);
+
+struct StackFrame {
+  int32_t pc;
+  int32_t param;
+  size_t sp;
+};
+
+// The stacks of a run. Run() clears them when it starts, so a caller that
+// makes many runs can pass the same ExecutionStacks to all of them and reuse
+// their allocations.
+struct ExecutionStacks {
+  std::vector<StackFrame> function_stack;
+  std::vector<int32_t> expression_stack;
+};
 
-RunResult Run(const std::vector<Instruction>& program, Runtime* runtime);
+// Where a run stands, so that it can be run in slices by RunSlice(). A
+// default-constructed or Reset() state starts from the beginning of the
+// program.
+struct ExecutionState {
+  int32_t pc = 0;
+  size_t instruction_count = 0;
+  ExecutionStacks stacks;
+
+  void Reset();
+};
+
+// Runs |program| from |state| for at most |slice| more instructions, as
+// counted against Runtime::instruction_limit. Returns the result if the run
+// ended, or std::nullopt if it was suspended, in which case |state| and
+// |runtime| can be passed to RunSlice() again to resume it. Once the run
+// ended, |state| has to be reset before it is used again.
+std::optional<RunResult> RunSlice(const Instruction* program,
+                                  size_t size,
+                                  Runtime* runtime,
+                                  ExecutionState* state,
+                                  size_t slice);
+
+RunResult Run(const Instruction* program,
+              size_t size,
+              Runtime* runtime,
+              ExecutionStacks* stacks);
+RunResult Run(const Instruction* program, size_t size, Runtime* runtime);
+
+inline RunResult Run(const std::vector<Instruction>& program,
+                     Runtime* runtime) {
+  return Run(program.data(), program.size(), runtime);
+}
 
 }  // namespace karel
+
+#endif  // KAREL_H_
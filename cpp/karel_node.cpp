@@ -0,0 +1,394 @@
+// A Node-API addon that runs Karel programs with the native engine, so that
+// cmd/kareljs does not need to step through the JavaScript Runtime. It
+// exports:
+//
+//  * compile(kx): parses a compiled .kx program.
+//  * loadWorld(input): parses a world in either format.
+//  * run(program, world): runs the program over a fresh copy of the world and
+//    returns the name of its result, like the resultadoEjecucion attribute.
+//  * output(world): the XML result of the last run, like World.output() in
+//    js/karel.js.
+//  * state(world): Karel's final state and the command counters.
+//  * row(world, y) and walls(world): views of the grid.
+//
+// Inputs can be strings, Buffers or any typed array. compile() and
+// loadWorld() return null if their input does not parse, and the error is
+// logged to stderr. The grid is never copied into JavaScript: row() returns a
+// Uint32Array over the buzzers of one row, which is only valid until the next
+// run, and walls() a Uint8Array over the walls of the whole world. Both are
+// read-only.
+
+#include <stdint.h>
+
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <node_api.h>
+
+#include "karel.h"
+#include "logging.h"
+#include "program.h"
+#include "util.h"
+#include "world.h"
+#include "xml.h"
+
+namespace {
+
+// Tag the objects that wrap each type, so that passing one where the other is
+// expected throws instead of crashing.
+constexpr napi_type_tag kProgramTag = {0x4b4152454c50524full,
+                                       0x4752414d00000001ull};
+constexpr napi_type_tag kWorldTag = {0x4b4152454c574f52ull,
+                                     0x4c44000000000001ull};
+
+struct NativeWorld {
+  explicit NativeWorld(std::shared_ptr<const karel::WorldImage> image)
+      : world(std::move(image)) {}
+
+  karel::World world;
+  std::optional<karel::RunResult> result;
+};
+
+// Runs |call| and throws a JavaScript error if it fails.
+#define NAPI_CALL(env, call)                                    \
+  do {                                                          \
+    if ((call) != napi_ok) {                                    \
+      napi_throw_error((env), nullptr, "Node-API call failed"); \
+      return nullptr;                                           \
+    }                                                           \
+  } while (0)
+
+// Returns the bytes of a string, Buffer or typed array. Strings are copied
+// into |storage|, everything else is used in place.
+bool GetBytes(napi_env env,
+              napi_value value,
+              std::string* storage,
+              std::string_view* bytes) {
+  napi_valuetype type;
+  if (napi_typeof(env, value, &type) != napi_ok)
+    return false;
+  if (type == napi_string) {
+    size_t length;
+    if (napi_get_value_string_utf8(env, value, nullptr, 0, &length) != napi_ok)
+      return false;
+    storage->resize(length + 1);
+    if (napi_get_value_string_utf8(env, value, storage->data(),
+                                   storage->size(), &length) != napi_ok) {
+      return false;
+    }
+    storage->resize(length);
+    *bytes = *storage;
+    return true;
+  }
+
+  bool is_typedarray;
+  if (napi_is_typedarray(env, value, &is_typedarray) != napi_ok ||
+      !is_typedarray) {
+    napi_throw_type_error(env, nullptr,
+                          "Expected a string, a Buffer or a typed array");
+    return false;
+  }
+  napi_typedarray_type array_type;
+  size_t length;
+  void* data;
+  if (napi_get_typedarray_info(env, value, &array_type, &length, &data,
+                               nullptr, nullptr) != napi_ok) {
+    return false;
+  }
+  size_t element_size = 1;
+  switch (array_type) {
+    case napi_int16_array:
+    case napi_uint16_array:
+      element_size = 2;
+      break;
+    case napi_int32_array:
+    case napi_uint32_array:
+    case napi_float32_array:
+      element_size = 4;
+      break;
+    case napi_float64_array:
+    case napi_bigint64_array:
+    case napi_biguint64_array:
+      element_size = 8;
+      break;
+    default:
+      break;
+  }
+  *bytes = std::string_view(static_cast<const char*>(data),
+                            length * element_size);
+  return true;
+}
+
+// Gets the arguments of a call, which must be at least |count|.
+bool GetArguments(napi_env env,
+                  napi_callback_info info,
+                  size_t count,
+                  napi_value* argv) {
+  size_t argc = count;
+  if (napi_get_cb_info(env, info, &argc, argv, nullptr, nullptr) != napi_ok)
+    return false;
+  if (argc < count) {
+    napi_throw_type_error(env, nullptr, "Not enough arguments");
+    return false;
+  }
+  return true;
+}
+
+template <typename T>
+void Delete(napi_env env, void* data, void* hint) {
+  delete static_cast<T*>(data);
+}
+
+// Wraps |native| in a new JavaScript object that owns it.
+template <typename T>
+napi_value Wrap(napi_env env,
+                const napi_type_tag& tag,
+                std::unique_ptr<T> native) {
+  napi_value object;
+  NAPI_CALL(env, napi_create_object(env, &object));
+  NAPI_CALL(env, napi_type_tag_object(env, object, &tag));
+  NAPI_CALL(env, napi_wrap(env, object, native.get(), Delete<T>, nullptr,
+                           nullptr));
+  native.release();
+  return object;
+}
+
+template <typename T>
+T* Unwrap(napi_env env, const napi_type_tag& tag, napi_value object) {
+  bool tagged = false;
+  void* native;
+  if (napi_check_object_type_tag(env, object, &tag, &tagged) != napi_ok ||
+      !tagged || napi_unwrap(env, object, &native) != napi_ok) {
+    napi_throw_type_error(env, nullptr, "Unexpected argument type");
+    return nullptr;
+  }
+  return static_cast<T*>(native);
+}
+
+napi_value GetNull(napi_env env) {
+  napi_value value;
+  NAPI_CALL(env, napi_get_null(env, &value));
+  return value;
+}
+
+napi_value Compile(napi_env env, napi_callback_info info) {
+  napi_value argv[1];
+  std::string storage;
+  std::string_view kx;
+  if (!GetArguments(env, info, 1, argv) ||
+      !GetBytes(env, argv[0], &storage, &kx)) {
+    return nullptr;
+  }
+  auto program = karel::Program::Parse(FileContents::Copy(kx));
+  if (!program)
+    return GetNull(env);
+  return Wrap(env, kProgramTag,
+              std::make_unique<karel::Program>(std::move(*program)));
+}
+
+napi_value LoadWorld(napi_env env, napi_callback_info info) {
+  napi_value argv[1];
+  std::string storage;
+  std::string_view input;
+  if (!GetArguments(env, info, 1, argv) ||
+      !GetBytes(env, argv[0], &storage, &input)) {
+    return nullptr;
+  }
+  auto image = karel::WorldImage::Parse(input);
+  if (!image)
+    return GetNull(env);
+  return Wrap(env, kWorldTag,
+              std::make_unique<NativeWorld>(std::move(image)));
+}
+
+napi_value Run(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  if (!GetArguments(env, info, 2, argv))
+    return nullptr;
+  auto* program = Unwrap<karel::Program>(env, kProgramTag, argv[0]);
+  auto* native =
+      program ? Unwrap<NativeWorld>(env, kWorldTag, argv[1]) : nullptr;
+  if (!native)
+    return nullptr;
+
+  // Every run starts from the world as it was loaded.
+  if (native->result)
+    native->world.Reset();
+  native->result = karel::Run(program->instructions(), program->size(),
+                              native->world.runtime());
+  std::string_view name =
+      karel::World::ExecutionResultName(native->result.value());
+  napi_value value;
+  NAPI_CALL(env,
+            napi_create_string_utf8(env, name.data(), name.size(), &value));
+  return value;
+}
+
+// Returns the world in |object|, which must have been run.
+NativeWorld* UnwrapRunWorld(napi_env env, napi_value object) {
+  auto* native = Unwrap<NativeWorld>(env, kWorldTag, object);
+  if (native && !native->result) {
+    napi_throw_error(env, nullptr, "The world has not been run");
+    return nullptr;
+  }
+  return native;
+}
+
+napi_value Output(napi_env env, napi_callback_info info) {
+  napi_value argv[1];
+  if (!GetArguments(env, info, 1, argv))
+    return nullptr;
+  NativeWorld* native = UnwrapRunWorld(env, argv[0]);
+  if (!native)
+    return nullptr;
+
+  std::string output;
+  {
+    xml::Buffer buffer(&output);
+    native->world.DumpResult(native->result.value(),
+                             karel::World::ResultFormat::XML, &buffer);
+  }
+  // The result ends with the newline that console.log() adds to it.
+  if (!output.empty() && output.back() == '\n')
+    output.pop_back();
+  napi_value value;
+  NAPI_CALL(env, napi_create_string_utf8(env, output.data(), output.size(),
+                                         &value));
+  return value;
+}
+
+napi_value State(napi_env env, napi_callback_info info) {
+  napi_value argv[1];
+  if (!GetArguments(env, info, 1, argv))
+    return nullptr;
+  NativeWorld* native = UnwrapRunWorld(env, argv[0]);
+  if (!native)
+    return nullptr;
+
+  const karel::Runtime& runtime = *native->world.runtime();
+  // Coordinates are 1-based, like in the world files.
+  const std::pair<const char*, size_t> fields[] = {
+      {"x", runtime.x + 1},
+      {"y", runtime.y + 1},
+      {"orientation", runtime.orientation},
+      {"bag", runtime.bag},
+      {"instructions", runtime.instruction_count},
+      {"forward", runtime.forward_count},
+      {"left", runtime.left_count},
+      {"pickbuzzer", runtime.pickbuzzer_count},
+      {"leavebuzzer", runtime.leavebuzzer_count},
+  };
+  napi_value state;
+  NAPI_CALL(env, napi_create_object(env, &state));
+  for (const auto& [name, field] : fields) {
+    napi_value value;
+    NAPI_CALL(env, napi_create_double(env, static_cast<double>(field), &value));
+    NAPI_CALL(env, napi_set_named_property(env, state, name, value));
+  }
+  // The bag can hold an infinite number of buzzers.
+  if (runtime.bag == karel::kInfinity) {
+    napi_value value;
+    NAPI_CALL(env, napi_create_double(
+                       env, std::numeric_limits<double>::infinity(), &value));
+    NAPI_CALL(env, napi_set_named_property(env, state, "bag", value));
+  }
+  return state;
+}
+
+void DeleteReference(napi_env env, void* data, void* hint) {
+  napi_delete_reference(env, static_cast<napi_ref>(hint));
+}
+
+napi_value Row(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  if (!GetArguments(env, info, 2, argv))
+    return nullptr;
+  auto* native = Unwrap<NativeWorld>(env, kWorldTag, argv[0]);
+  if (!native)
+    return nullptr;
+  uint32_t y;
+  if (napi_get_value_uint32(env, argv[1], &y) != napi_ok ||
+      y >= native->world.image().height()) {
+    napi_throw_range_error(env, nullptr, "Row out of range");
+    return nullptr;
+  }
+
+  // The view keeps the world alive.
+  size_t width = native->world.image().width();
+  napi_ref reference;
+  NAPI_CALL(env, napi_create_reference(env, argv[0], 1, &reference));
+  const uint32_t* row = native->world.buzzer_row(y);
+  napi_value buffer;
+  if (napi_create_external_arraybuffer(
+          env, const_cast<uint32_t*>(row), width * sizeof(uint32_t),
+          DeleteReference, reference, &buffer) != napi_ok) {
+    napi_delete_reference(env, reference);
+    napi_throw_error(env, nullptr, "Failed to create the view");
+    return nullptr;
+  }
+  napi_value array;
+  NAPI_CALL(env, napi_create_typedarray(env, napi_uint32_array, width, buffer,
+                                        0, &array));
+  return array;
+}
+
+void DeleteImage(napi_env env, void* data, void* hint) {
+  delete static_cast<std::shared_ptr<const karel::WorldImage>*>(hint);
+}
+
+napi_value Walls(napi_env env, napi_callback_info info) {
+  napi_value argv[1];
+  if (!GetArguments(env, info, 1, argv))
+    return nullptr;
+  auto* native = Unwrap<NativeWorld>(env, kWorldTag, argv[0]);
+  if (!native)
+    return nullptr;
+
+  // The walls are part of the image, which the view keeps alive.
+  const karel::WorldImage& image = native->world.image();
+  size_t size = image.width() * image.height();
+  auto* hint = new std::shared_ptr<const karel::WorldImage>(
+      native->world.shared_image());
+  napi_value buffer;
+  if (napi_create_external_arraybuffer(
+          env, const_cast<uint8_t*>(image.walls()), size, DeleteImage, hint,
+          &buffer) != napi_ok) {
+    delete hint;
+    napi_throw_error(env, nullptr, "Failed to create the view");
+    return nullptr;
+  }
+  napi_value array;
+  NAPI_CALL(env, napi_create_typedarray(env, napi_uint8_array, size, buffer, 0,
+                                        &array));
+  return array;
+}
+
+}  // namespace
+
+NAPI_MODULE_INIT() {
+  const napi_property_descriptor properties[] = {
+      {"compile", nullptr, Compile, nullptr, nullptr, nullptr,
+       napi_default_jsproperty, nullptr},
+      {"loadWorld", nullptr, LoadWorld, nullptr, nullptr, nullptr,
+       napi_default_jsproperty, nullptr},
+      {"run", nullptr, Run, nullptr, nullptr, nullptr,
+       napi_default_jsproperty, nullptr},
+      {"output", nullptr, Output, nullptr, nullptr, nullptr,
+       napi_default_jsproperty, nullptr},
+      {"state", nullptr, State, nullptr, nullptr, nullptr,
+       napi_default_jsproperty, nullptr},
+      {"row", nullptr, Row, nullptr, nullptr, nullptr,
+       napi_default_jsproperty, nullptr},
+      {"walls", nullptr, Walls, nullptr, nullptr, nullptr,
+       napi_default_jsproperty, nullptr},
+  };
+  if (napi_define_properties(env, exports,
+                             sizeof(properties) / sizeof(properties[0]),
+                             properties) != napi_ok) {
+    return nullptr;
+  }
+  return exports;
+}
@@ -1,8 +1,14 @@
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
-#include <experimental/string_view>
+#include <limits>
 #include <memory>
+#include <new>
+#include <optional>
+#include <string_view>
 #include <type_traits>
+#include <utility>
 
 #include <emscripten.h>
 
@@ -11,6 +17,8 @@
 
 struct GlobalState {
   std::vector<karel::Instruction>* program = nullptr;
+  // Where the recorded run stands, between calls to run_recorded().
+  karel::ExecutionState* recording = nullptr;
 } sGlobalState;
 
 static_assert(std::is_trivially_destructible<GlobalState>::value,
@@ -18,8 +26,7 @@ static_assert(std::is_trivially_destructible<GlobalState>::value,
 
 EMSCRIPTEN_KEEPALIVE
 extern "C" bool compile(const char* c) {
-  auto program =
-      karel::ParseInstructions(std::experimental::string_view(c, strlen(c)));
+  auto program = karel::ParseInstructions(std::string_view(c, strlen(c)));
   if (!program)
     return false;
   if (sGlobalState.program)
@@ -39,3 +46,332 @@ extern "C" uint32_t run(karel::Runtime* runtime) {
 
   return static_cast<uint32_t>(karel::Run(*sGlobalState.program, runtime));
 }
+
+// Worlds whose grids live in the wasm heap. The page keeps typed arrays over
+// them, so running or resetting a world does not copy the grids in or out of
+// wasm memory. Grids are |width| * |height| cells in row-major order, with 0-
+// based coordinates. The views stay valid until the world is resized or freed.
+//
+// The Runtime is the first member, so the pointer returned by world_create()
+// can be passed to run() as is, and the page sets Karel's state and limits
+// through it like before.
+struct WasmWorld {
+  karel::Runtime runtime;
+  // The buzzers the world starts with. world_reset() copies them into the
+  // buzzers of the runtime.
+  uint32_t* initial_buzzers;
+};
+
+static_assert(std::is_standard_layout<WasmWorld>::value,
+              "WasmWorld must be standard layout");
+static_assert(offsetof(WasmWorld, runtime) == 0,
+              "The runtime must be the first member of WasmWorld");
+
+namespace {
+
+WasmWorld* FromRuntime(karel::Runtime* runtime) {
+  return reinterpret_cast<WasmWorld*>(runtime);
+}
+
+struct Grids {
+  std::unique_ptr<uint32_t[]> initial_buzzers;
+  std::unique_ptr<uint32_t[]> buzzers;
+  std::unique_ptr<uint8_t[]> walls;
+};
+
+// Allocates the grids of a |width| * |height| world, filled with zeros.
+std::optional<Grids> AllocateGrids(size_t width, size_t height) {
+  if (width == 0 || height == 0 || width > SIZE_MAX / 4 / height)
+    return std::nullopt;
+  size_t size = width * height;
+  Grids grids;
+  grids.initial_buzzers.reset(new (std::nothrow) uint32_t[size]());
+  grids.buzzers.reset(new (std::nothrow) uint32_t[size]());
+  grids.walls.reset(new (std::nothrow) uint8_t[size]());
+  if (!grids.initial_buzzers || !grids.buzzers || !grids.walls)
+    return std::nullopt;
+  return grids;
+}
+
+void FreeGrids(WasmWorld* world) {
+  delete[] world->initial_buzzers;
+  delete[] world->runtime.buzzers;
+  delete[] world->runtime.walls;
+}
+
+// Makes |grids| the grids of |world|, which must not have any.
+void AdoptGrids(WasmWorld* world, Grids grids, size_t width, size_t height) {
+  world->initial_buzzers = grids.initial_buzzers.release();
+  world->runtime.width = width;
+  world->runtime.height = height;
+  world->runtime.buzzers = grids.buzzers.release();
+  world->runtime.walls = grids.walls.release();
+}
+
+}  // namespace
+
+// Creates an empty |width| * |height| world. Returns nullptr if there is not
+// enough memory.
+EMSCRIPTEN_KEEPALIVE
+extern "C" karel::Runtime* world_create(size_t width, size_t height) {
+  auto grids = AllocateGrids(width, height);
+  if (!grids)
+    return nullptr;
+  WasmWorld* world = new (std::nothrow) WasmWorld();
+  if (!world)
+    return nullptr;
+  AdoptGrids(world, std::move(grids.value()), width, height);
+  return &world->runtime;
+}
+
+// Changes the dimensions of a world, keeping the walls and buzzers of the
+// cells that are in both. Returns false, leaving the world untouched, if
+// there is not enough memory.
+EMSCRIPTEN_KEEPALIVE
+extern "C" bool world_resize(karel::Runtime* runtime,
+                             size_t width,
+                             size_t height) {
+  WasmWorld* world = FromRuntime(runtime);
+  auto grids = AllocateGrids(width, height);
+  if (!grids)
+    return false;
+  size_t columns = std::min(width, runtime->width);
+  size_t rows = std::min(height, runtime->height);
+  for (size_t y = 0; y < rows; ++y) {
+    size_t from = runtime->coordinates(0, y);
+    size_t to = y * width;
+    std::copy_n(world->initial_buzzers + from, columns,
+                grids->initial_buzzers.get() + to);
+    std::copy_n(runtime->buzzers + from, columns, grids->buzzers.get() + to);
+    std::copy_n(runtime->walls + from, columns, grids->walls.get() + to);
+  }
+  FreeGrids(world);
+  AdoptGrids(world, std::move(grids.value()), width, height);
+  return true;
+}
+
+EMSCRIPTEN_KEEPALIVE
+extern "C" void world_free(karel::Runtime* runtime) {
+  WasmWorld* world = FromRuntime(runtime);
+  FreeGrids(world);
+  delete world;
+}
+
+// The grids of a world, to build typed arrays over the wasm heap.
+EMSCRIPTEN_KEEPALIVE
+extern "C" uint32_t* world_initial_buzzers(karel::Runtime* runtime) {
+  return FromRuntime(runtime)->initial_buzzers;
+}
+
+EMSCRIPTEN_KEEPALIVE
+extern "C" uint32_t* world_buzzers(karel::Runtime* runtime) {
+  return runtime->buzzers;
+}
+
+EMSCRIPTEN_KEEPALIVE
+extern "C" uint8_t* world_walls(karel::Runtime* runtime) {
+  // The walls are only read while running, but the page edits them.
+  return const_cast<uint8_t*>(runtime->walls);
+}
+
+// Restores the buzzers the world starts with, and clears the counters of the
+// last run. Karel's position, orientation and bag are left to the page.
+EMSCRIPTEN_KEEPALIVE
+extern "C" void world_reset(karel::Runtime* runtime) {
+  WasmWorld* world = FromRuntime(runtime);
+  std::copy_n(world->initial_buzzers, runtime->width * runtime->height,
+              runtime->buzzers);
+  runtime->line = 0;
+  runtime->forward_count = 0;
+  runtime->left_count = 0;
+  runtime->leavebuzzer_count = 0;
+  runtime->pickbuzzer_count = 0;
+  runtime->instruction_count = 0;
+}
+
+// Batches of worlds, to run one program over a whole case set in a single
+// call. The worlds are packed one after the other in an array of uint32
+// words. Each one starts with a header of kPackedWorldHeaderSize words,
+// indexed by PackedWorldField, followed by its width * height buzzers and
+// then by its width * height walls, one byte per cell and padded to a whole
+// word. Coordinates are 0-based and cells are in row-major order, like in the
+// Runtime. Limits of 0xFFFFFFFF are unlimited, and so are a bag or a cell
+// with 0xFFFFFFFF buzzers, which is what -1 becomes when the page stores it
+// in a Uint32Array.
+enum PackedWorldField : size_t {
+  kPackedWidth,
+  kPackedHeight,
+  kPackedX,
+  kPackedY,
+  kPackedOrientation,
+  kPackedBag,
+  kPackedInstructionLimit,
+  kPackedStackLimit,
+  kPackedForwardLimit,
+  kPackedLeftLimit,
+  kPackedPickBuzzerLimit,
+  kPackedLeaveBuzzerLimit,
+  kPackedWorldHeaderSize,
+};
+
+// The results are kPackedResultSize words per world, indexed by
+// PackedResultField.
+enum PackedResultField : size_t {
+  kPackedResult,
+  kPackedResultX,
+  kPackedResultY,
+  kPackedResultOrientation,
+  kPackedResultBag,
+  kPackedResultInstructions,
+  kPackedResultForward,
+  kPackedResultLeft,
+  kPackedResultPickBuzzer,
+  kPackedResultLeaveBuzzer,
+  kPackedResultSize,
+};
+
+// Runs the program from the last compile() over the |count| worlds packed in
+// the |size| words of |worlds|, and writes their results to |results|. The
+// buzzers of every world are updated in place, so they hold its final state
+// afterwards. Returns false if there is no program or the worlds are
+// malformed, in which case the worlds before the malformed one have already
+// been run.
+EMSCRIPTEN_KEEPALIVE
+extern "C" bool run_batch(uint32_t* worlds,
+                          size_t size,
+                          size_t count,
+                          uint32_t* results) {
+  if (!sGlobalState.program)
+    return false;
+
+  karel::ExecutionStacks stacks;
+  uint32_t* end = worlds + size;
+  for (size_t i = 0; i < count; ++i) {
+    size_t remaining = end - worlds;
+    if (remaining < kPackedWorldHeaderSize)
+      return false;
+    const uint32_t* header = worlds;
+    karel::Runtime runtime;
+    runtime.width = header[kPackedWidth];
+    runtime.height = header[kPackedHeight];
+    if (runtime.width == 0 || runtime.height == 0 ||
+        runtime.width > remaining / runtime.height) {
+      return false;
+    }
+    size_t cells = runtime.width * runtime.height;
+    size_t wall_words = (cells + 3) / 4;
+    if (remaining < kPackedWorldHeaderSize + cells + wall_words)
+      return false;
+    runtime.x = header[kPackedX];
+    runtime.y = header[kPackedY];
+    runtime.orientation = header[kPackedOrientation];
+    if (runtime.x >= runtime.width || runtime.y >= runtime.height ||
+        runtime.orientation >= 4) {
+      return false;
+    }
+    runtime.bag = header[kPackedBag];
+    runtime.instruction_limit = header[kPackedInstructionLimit];
+    runtime.stack_limit = header[kPackedStackLimit];
+    runtime.forward_limit = header[kPackedForwardLimit];
+    runtime.left_limit = header[kPackedLeftLimit];
+    runtime.pickbuzzer_limit = header[kPackedPickBuzzerLimit];
+    runtime.leavebuzzer_limit = header[kPackedLeaveBuzzerLimit];
+    runtime.buzzers = worlds + kPackedWorldHeaderSize;
+    runtime.walls = reinterpret_cast<const uint8_t*>(runtime.buzzers + cells);
+    worlds = runtime.buzzers + cells + wall_words;
+
+    auto result = karel::Run(sGlobalState.program->data(),
+                             sGlobalState.program->size(), &runtime, &stacks);
+    uint32_t* packed = results + i * kPackedResultSize;
+    packed[kPackedResult] = static_cast<uint32_t>(result);
+    packed[kPackedResultX] = runtime.x;
+    packed[kPackedResultY] = runtime.y;
+    packed[kPackedResultOrientation] = runtime.orientation;
+    packed[kPackedResultBag] = runtime.bag;
+    packed[kPackedResultInstructions] = runtime.instruction_count;
+    packed[kPackedResultForward] = runtime.forward_count;
+    packed[kPackedResultLeft] = runtime.left_count;
+    packed[kPackedResultPickBuzzer] = runtime.pickbuzzer_count;
+    packed[kPackedResultLeaveBuzzer] = runtime.leavebuzzer_count;
+  }
+  return true;
+}
+
+// Recorded runs, so the page can run a program at native speed and then
+// animate it from its events. The events are appended to a ring in the wasm
+// heap, which the page reads through a Uint32Array over events_buffer(). At
+// four bytes per event, a million of them take 4MB.
+EMSCRIPTEN_KEEPALIVE
+extern "C" karel::EventRing* events_create(size_t capacity) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    return nullptr;
+  std::unique_ptr<uint32_t[]> events(new (std::nothrow) uint32_t[capacity]);
+  if (!events)
+    return nullptr;
+  karel::EventRing* ring = new (std::nothrow) karel::EventRing();
+  if (!ring)
+    return nullptr;
+  ring->events = events.release();
+  ring->capacity = capacity;
+  return ring;
+}
+
+EMSCRIPTEN_KEEPALIVE
+extern "C" void events_free(karel::EventRing* ring) {
+  delete[] ring->events;
+  delete ring;
+}
+
+EMSCRIPTEN_KEEPALIVE
+extern "C" uint32_t* events_buffer(karel::EventRing* ring) {
+  return ring->events;
+}
+
+// The number of events recorded since the run started. The unread ones go
+// from events_tail() up to here, modulo the capacity.
+EMSCRIPTEN_KEEPALIVE
+extern "C" size_t events_head(karel::EventRing* ring) {
+  return ring->head;
+}
+
+EMSCRIPTEN_KEEPALIVE
+extern "C" size_t events_tail(karel::EventRing* ring) {
+  return ring->tail;
+}
+
+// Marks the next |count| unread events as read, making room for more.
+EMSCRIPTEN_KEEPALIVE
+extern "C" void events_consume(karel::EventRing* ring, size_t count) {
+  ring->tail += std::min(count, ring->head - ring->tail);
+}
+
+// What run_recorded() returns when the ring is full.
+constexpr uint32_t kRunSuspended = 0xFFFFFFFFu;
+
+// Runs the program from the last compile() over |runtime|, recording its
+// events in |ring|. Unless |resume| is set, a new run starts and the ring is
+// emptied. Returns the RunResult once the run ends, or kRunSuspended when the
+// ring fills up, in which case the page reads some events, consumes them, and
+// calls again with |resume| set to continue the run where it stopped.
+EMSCRIPTEN_KEEPALIVE
+extern "C" uint32_t run_recorded(karel::Runtime* runtime,
+                                 karel::EventRing* ring,
+                                 bool resume) {
+  if (!sGlobalState.program)
+    return static_cast<uint32_t>(karel::RunResult::INSTRUCTION);
+
+  if (!sGlobalState.recording)
+    sGlobalState.recording = new karel::ExecutionState();
+  if (!resume) {
+    sGlobalState.recording->Reset();
+    ring->head = ring->tail = 0;
+  }
+  runtime->events = ring;
+  auto result = karel::RunSlice(
+      sGlobalState.program->data(), sGlobalState.program->size(), runtime,
+      sGlobalState.recording, std::numeric_limits<size_t>::max());
+  runtime->events = nullptr;
+  if (!result)
+    return kRunSuspended;
+  return static_cast<uint32_t>(result.value());
+}
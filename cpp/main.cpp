@@ -1,567 +1,147 @@
 #include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <algorithm>
-#include <memory>
+#include <charconv>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "batch.h"
+#include "compiler.h"
+#include "expect.h"
 #include "karel.h"
 #include "logging.h"
+#include "program.h"
+#include "result_cache.h"
+#include "serve.h"
+#include "sweep.h"
 #include "util.h"
+#include "world.h"
 #include "xml.h"
 
 namespace {
 
 constexpr const std::string_view kFlagPrefix("--");
 constexpr const std::string_view kDumpFlagPrefix("dump=");
-
-std::vector<uint8_t> ReadFully(int fd) {
-  constexpr size_t kChunkSize = 4096;
-  std::vector<std::unique_ptr<uint8_t[]>> chunks;
-  size_t total_bytes = 0;
-  while (true) {
-    chunks.emplace_back(std::make_unique<uint8_t[]>(kChunkSize));
-    ssize_t bytes_read = read(fd, chunks.back().get(), kChunkSize);
-    if (bytes_read == -1) {
-      PLOG(ERROR) << "Failed to read file";
-      return {};
-    }
-    if (bytes_read == 0)
-      break;
-    total_bytes += bytes_read;
-  }
-  std::vector<uint8_t> result(total_bytes + 1);
-  uint8_t* ptr = result.data();
-  for (const auto& chunk : chunks) {
-    size_t chunk_bytes = std::min(kChunkSize, total_bytes);
-    memcpy(ptr, chunk.get(), chunk_bytes);
-    total_bytes -= chunk_bytes;
-    ptr += chunk_bytes;
-  }
-  result.pop_back();
-  return result;
+constexpr const std::string_view kHeatmapFlagPrefix("heatmap=");
+constexpr const std::string_view kCacheDirFlagPrefix("cache-dir=");
+constexpr const std::string_view kResultCacheFlagPrefix("result-cache=");
+constexpr const std::string_view kCostHistoryFlagPrefix("cost-history=");
+constexpr const std::string_view kSweepFlagPrefix("sweep=");
+constexpr const std::string_view kSourceFlagPrefix("source=");
+constexpr const std::string_view kCompileFlagPrefix("compile=");
+constexpr const std::string_view kCompileWorldFlagPrefix("compile-world=");
+constexpr const std::string_view kFormatFlagPrefix("format=");
+constexpr const std::string_view kApplyDeltaFlagPrefix("apply-delta=");
+constexpr const std::string_view kMdoFlagPrefix("mdo=");
+constexpr const std::string_view kKecFlagPrefix("kec=");
+constexpr const std::string_view kExpectFlagPrefix("expect=");
+constexpr const std::string_view kDigestFlag("digest");
+constexpr const std::string_view kDigestFlagPrefix("digest=");
+constexpr const std::string_view kCasesFlagPrefix("cases=");
+constexpr const std::string_view kJobsFlagPrefix("jobs=");
+constexpr const std::string_view kServeFlag("serve");
+constexpr const std::string_view kServeFlagPrefix("serve=");
+constexpr const std::string_view kForkServerFlag("fork-server");
+constexpr const std::string_view kForkServerFlagPrefix("fork-server=");
+
+bool EndsWith(std::string_view str, std::string_view suffix) {
+  return str.size() >= suffix.size() &&
+         str.substr(str.size() - suffix.size()) == suffix;
 }
 
-class World {
- public:
-  World(World&& other)
-      : width_(other.width_),
-        height_(other.height_),
-        name_(std::move(other.name_)),
-        program_name_(std::move(other.program_name_)),
-        buzzers_(std::move(other.buzzers_)),
-        walls_(std::move(other.walls_)),
-        buzzer_dump_(std::move(other.buzzer_dump_)),
-        dump_world_(other.dump_world_),
-        dump_universe_(other.dump_universe_),
-        dump_position_(other.dump_position_),
-        dump_orientation_(other.dump_orientation_),
-        dump_bag_(other.dump_bag_),
-        dump_forward_(other.dump_forward_),
-        dump_left_(other.dump_left_),
-        dump_leavebuzzer_(other.dump_leavebuzzer_),
-        dump_pickbuzzer_(other.dump_pickbuzzer_) {
-    runtime_ = other.runtime_;
-    runtime_.buzzers = buzzers_.get();
-    runtime_.walls = walls_.get();
-  }
-
-  size_t coordinates(size_t x, size_t y) const { return y * width_ + x; }
-
-  void set_buzzers(size_t x, size_t y, uint32_t count) {
-    buzzers_[coordinates(x, y)] = count;
-  }
-
-  uint32_t get_buzzers(size_t x, size_t y) const {
-    return buzzers_[coordinates(x, y)];
-  }
-
-  uint8_t get_walls(size_t x, size_t y) const {
-    return walls_[coordinates(x, y)];
-  }
-
-  static std::optional<World> Parse(int fd) {
-    World world;
-    if (!xml::Reader().Parse(fd, [&world](xml::Reader::Element node) -> bool {
-          const std::string_view name = node.GetName();
-          if (name == "mundo") {
-            auto width = ParseString<uint32_t>(node.GetAttribute("ancho")),
-                 height = ParseString<uint32_t>(node.GetAttribute("alto"));
-            if (!width || !height)
-              return false;
-
-            world.Init(width.value(), height.value(),
-                       node.GetAttribute("nombre").value_or("mundo_0"));
-          } else if (name == "condiciones") {
-            auto instruction_limit = ParseString<size_t>(
-                     node.GetAttribute("instruccionesMaximasAEjecutar")),
-                 stack_limit =
-                     ParseString<size_t>(node.GetAttribute("longitudStack"));
-            if (instruction_limit)
-              world.runtime_.instruction_limit = instruction_limit.value();
-            if (stack_limit)
-              world.runtime_.stack_limit = stack_limit.value();
-          } else if (name == "comando") {
-            auto nombre = node.GetAttribute("nombre");
-            auto maximoNumeroDeEjecuciones = ParseString<size_t>(
-                node.GetAttribute("maximoNumeroDeEjecuciones"));
-            if (!maximoNumeroDeEjecuciones)
-              return false;
-            if (nombre.value() == "AVANZA")
-              world.runtime_.forward_limit = maximoNumeroDeEjecuciones.value();
-            else if (nombre.value() == "GIRA_IZQUIERDA")
-              world.runtime_.left_limit = maximoNumeroDeEjecuciones.value();
-            else if (nombre.value() == "COGE_ZUMBADOR")
-              world.runtime_.pickbuzzer_limit =
-                  maximoNumeroDeEjecuciones.value();
-            else if (nombre.value() == "DEJA_ZUMBADOR")
-              world.runtime_.leavebuzzer_limit =
-                  maximoNumeroDeEjecuciones.value();
-            else {
-              LOG(ERROR) << "Invalid limit name " << nombre.value();
-              return false;
-            }
-          } else if (name == "monton") {
-            auto x = ParseString<size_t>(node.GetAttribute("x")),
-                 y = ParseString<size_t>(node.GetAttribute("y"));
-            auto count = ParseString<uint32_t>(node.GetAttribute("zumbadores"));
-            if (!x || !y || !count)
-              return false;
-            (*x)--;
-            (*y)--;
-            if (x.value() >= world.width_ || y.value() >= world.height_)
-              return true;
-            world.set_buzzers(*x, *y, *count);
-          } else if (name == "pared") {
-            auto x1 = ParseString<size_t>(node.GetAttribute("x1", false)),
-                 y1 = ParseString<size_t>(node.GetAttribute("y1", false)),
-                 x2 = ParseString<size_t>(node.GetAttribute("x2", false)),
-                 y2 = ParseString<size_t>(node.GetAttribute("y2", false));
-            if (x1 && x2 && y1 && !y2) {
-              // Horizontal
-              size_t x = std::min(*x1, *x2);
-              size_t y = *y1;
-              if (x >= world.width_ || y >= world.height_)
-                return true;
-              world.walls_[world.coordinates(x, y)] |= 1 << 3;
-              if (y)
-                world.walls_[world.coordinates(x, y - 1)] |= 1 << 1;
-            } else if (y1 && y2 && x1 && !x2) {
-              // Vertical
-              size_t x = *x1;
-              size_t y = std::min(*y1, *y2);
-              if (x >= world.width_ || y >= world.height_)
-                return true;
-              world.walls_[world.coordinates(x, y)] |= 1 << 0;
-              if (x)
-                world.walls_[world.coordinates(x - 1, y)] |= 1 << 2;
-            } else {
-              LOG(ERROR) << "Invalid pared";
-              return false;
-            }
-          } else if (name == "posicionDump") {
-            auto x = ParseString<size_t>(node.GetAttribute("x")),
-                 y = ParseString<size_t>(node.GetAttribute("y"));
-            if (!x || !y)
-              return false;
-            (*x)--;
-            (*y)--;
-            if (x.value() >= world.width_ || y.value() >= world.height_)
-              return true;
-            world.buzzer_dump_[world.coordinates(x.value(), y.value())] = true;
-          } else if (name == "programa") {
-            auto karel_x = ParseString<size_t>(node.GetAttribute("xKarel")),
-                 karel_y = ParseString<size_t>(node.GetAttribute("yKarel"));
-            auto direccion_karel = node.GetAttribute("direccionKarel");
-            auto karel_bag =
-                ParseString<uint32_t>(node.GetAttribute("mochilaKarel"));
-            auto nombre = node.GetAttribute("nombre");
-            if (karel_x)
-              world.runtime_.x = karel_x.value() - 1;
-            if (karel_y)
-              world.runtime_.y = karel_y.value() - 1;
-            if (karel_bag)
-              world.runtime_.bag = karel_bag.value();
-            if (nombre)
-              world.program_name_ = std::string(nombre.value());
-            if (direccion_karel) {
-              if (direccion_karel.value() == "OESTE")
-                world.runtime_.orientation = 0;
-              else if (direccion_karel.value() == "NORTE")
-                world.runtime_.orientation = 1;
-              else if (direccion_karel.value() == "ESTE")
-                world.runtime_.orientation = 2;
-              else if (direccion_karel.value() == "SUR")
-                world.runtime_.orientation = 3;
-              else {
-                LOG(ERROR) << "Invalid orientation " << direccion_karel.value();
-                return false;
-              }
-            }
-          } else if (name == "despliega") {
-            auto tipo = node.GetAttribute("tipo");
-            if (!tipo) {
-              LOG(ERROR) << "Invalid despliega";
-              return false;
-            }
-            if (*tipo == "MUNDO") {
-              world.dump_world_ = true;
-            } else if (*tipo == "UNIVERSO") {
-              world.dump_universe_ = true;
-            } else if (*tipo == "ORIENTACION") {
-              world.dump_orientation_ = true;
-            } else if (*tipo == "POSICION") {
-              world.dump_position_ = true;
-            } else if (*tipo == "MOCHILA") {
-              world.dump_bag_ = true;
-            } else if (*tipo == "AVANZA") {
-              world.dump_forward_ = true;
-            } else if (*tipo == "GIRA_IZQUIERDA") {
-              world.dump_left_ = true;
-            } else if (*tipo == "DEJA_ZUMBADOR") {
-              world.dump_leavebuzzer_ = true;
-            } else if (*tipo == "COGE_ZUMBADOR") {
-              world.dump_pickbuzzer_ = true;
-            } else {
-              LOG(ERROR) << "Invalid dump type " << *tipo;
-              return false;
-            }
-          }
-
-          return true;
-        })) {
-      return std::nullopt;
-    }
-
-    return std::make_optional<World>(std::move(world));
-  }
-
-  void Dump() const {
-    xml::Writer writer(STDOUT_FILENO);
-
-    auto ejecucion = writer.CreateElement("ejecucion");
-    {
-      auto condiciones = ejecucion.CreateElement("condiciones");
-      condiciones.AddAttribute("instruccionesMaximasAEjecutar",
-                               StringPrintf("%zd", runtime_.instruction_limit));
-      condiciones.AddAttribute("longitudStack",
-                               StringPrintf("%zd", runtime_.stack_limit));
-
-      if (runtime_.forward_limit != std::numeric_limits<size_t>::max()) {
-        auto comando = condiciones.CreateElement("comando");
-        comando.AddAttribute("nombre", "AVANZA");
-        comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.forward_limit));
-      }
-      if (runtime_.left_limit != std::numeric_limits<size_t>::max()) {
-        auto comando = condiciones.CreateElement("comando");
-        comando.AddAttribute("nombre", "GIRA_IZQUIERDA");
-        comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.left_limit));
-      }
-      if (runtime_.pickbuzzer_limit != std::numeric_limits<size_t>::max()) {
-        auto comando = condiciones.CreateElement("comando");
-        comando.AddAttribute("nombre", "COGE_ZUMBADOR");
-        comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.pickbuzzer_limit));
-      }
-      if (runtime_.leavebuzzer_limit != std::numeric_limits<size_t>::max()) {
-        auto comando = condiciones.CreateElement("comando");
-        comando.AddAttribute("nombre", "DEJA_ZUMBADOR");
-        comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.leavebuzzer_limit));
-      }
-    }
-    {
-      auto mundos = ejecucion.CreateElement("mundos");
-      auto mundo = mundos.CreateElement("mundo");
-      mundo.AddAttribute("nombre", "mundo_0");
-      mundo.AddAttribute("ancho", StringPrintf("%zd", runtime_.width));
-      mundo.AddAttribute("alto", StringPrintf("%zd", runtime_.height));
-
-      for (size_t x = 0; x < width_; ++x) {
-        for (size_t y = 0; y < height_; ++y) {
-          if (!runtime_.buzzers[coordinates(x, y)])
-            continue;
-          auto monton = mundo.CreateElement("monton");
-          monton.AddAttribute("x", StringPrintf("%zd", x + 1));
-          monton.AddAttribute("y", StringPrintf("%zd", y + 1));
-          if (runtime_.buzzers[coordinates(x, y)] == karel::kInfinity) {
-            monton.AddAttribute("zumbadores", "INFINITO");
-          } else {
-            monton.AddAttribute(
-                "zumbadores",
-                StringPrintf("%u", runtime_.buzzers[coordinates(x, y)]));
-          }
-        }
-      }
-
-      for (size_t x = 0; x < width_; ++x) {
-        for (size_t y = 0; y < height_; ++y) {
-          if (y + 1 < height_ && walls_[coordinates(x, y)] & (1 << 1)) {
-            auto pared = mundo.CreateElement("pared");
-            pared.AddAttribute("x1", StringPrintf("%zu", x));
-            pared.AddAttribute("y1", StringPrintf("%zu", y + 1));
-            pared.AddAttribute("x2", StringPrintf("%zu", x + 1));
-          }
-          if (x + 1 < width_ && walls_[coordinates(x, y)] & (1 << 2)) {
-            auto pared = mundo.CreateElement("pared");
-            pared.AddAttribute("x1", StringPrintf("%zu", x + 1));
-            pared.AddAttribute("y1", StringPrintf("%zu", y));
-            pared.AddAttribute("y2", StringPrintf("%zu", y + 1));
-          }
-        }
-      }
-
-      for (size_t x = 0; x < width_; ++x) {
-        for (size_t y = 0; y < height_; ++y) {
-          if (!buzzer_dump_[coordinates(x, y)])
-            continue;
-          auto posicionDump = mundo.CreateElement("posicionDump");
-          posicionDump.AddAttribute("x", StringPrintf("%zd", x + 1));
-          posicionDump.AddAttribute("y", StringPrintf("%zd", y + 1));
-        }
-      }
-    }
-    {
-      auto programas = ejecucion.CreateElement("programas");
-      programas.AddAttribute("tipoEjecucion", "CONTINUA");
-      programas.AddAttribute("intruccionesCambioContexto", "1");
-      programas.AddAttribute("milisegundosParaPasoAutomatico", "0");
-
-      auto programa = programas.CreateElement("programa");
-      programa.AddAttribute("nombre", "p1");
-      programa.AddAttribute("ruta", "{$2$}");
-      programa.AddAttribute("mundoDeEjecucion", "mundo_0");
-      programa.AddAttribute("xKarel", StringPrintf("%zd", runtime_.x + 1));
-      programa.AddAttribute("yKarel", StringPrintf("%zd", runtime_.y + 1));
-      switch (runtime_.orientation) {
-        case 0:
-          programa.AddAttribute("direccionKarel", "OESTE");
-          break;
-        case 1:
-          programa.AddAttribute("direccionKarel", "NORTE");
-          break;
-        case 2:
-          programa.AddAttribute("direccionKarel", "ESTE");
-          break;
-        case 3:
-          programa.AddAttribute("direccionKarel", "SUR");
-          break;
-      }
-      if (runtime_.bag == karel::kInfinity)
-        programa.AddAttribute("mochilaKarel", "INFINITO");
-      else
-        programa.AddAttribute("mochilaKarel",
-                              StringPrintf("%zu", runtime_.bag));
-
-      if (dump_world_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "MUNDO");
-      }
-      if (dump_universe_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "UNIVERSO");
-      }
-      if (dump_orientation_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "ORIENTACION");
-      }
-      if (dump_position_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "POSICION");
-      }
-      if (dump_bag_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "MOCHILA");
-      }
-      if (dump_forward_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "AVANZA");
-      }
-      if (dump_left_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "GIRA_IZQUIERDA");
-      }
-      if (dump_leavebuzzer_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "DEJA_ZUMBADOR");
-      }
-      if (dump_pickbuzzer_) {
-        auto despliega = programa.CreateElement("despliega");
-        despliega.AddAttribute("tipo", "COGE_ZUMBADOR");
-      }
-    }
+std::optional<FileContents> ReadFile(const std::string& path) {
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return std::nullopt;
   }
+  return FileContents::Read(fd.get());
+}
 
-  void DumpResult(karel::RunResult result) const {
-    {
-      xml::Writer writer(STDOUT_FILENO);
-
-      auto resultados = writer.CreateElement("resultados");
-
-      if (dump_world_ || dump_universe_) {
-        auto mundos = resultados.CreateElement("mundos");
-        auto mundo = mundos.CreateElement("mundo");
-        mundo.AddAttribute("nombre", name_);
-        for (ssize_t y = static_cast<ssize_t>(height_) - 1; y >= 0; y--) {
-          bool printCoordinate = true;
-          std::ostringstream line;
-          for (size_t x = 0; x < width_; x++) {
-            if (!dump_universe_ && !buzzer_dump_[coordinates(x, y)])
-              continue;
-            if (get_buzzers(x, y) != 0) {
-              if (printCoordinate) {
-                line << '(' << (x + 1) << ") ";
-              }
-              line << (get_buzzers(x, y) & 0xFFFF) << ' ';
-            }
-            printCoordinate = get_buzzers(x, y) == 0;
-          }
-
-          if (line.tellp() == 0)
-            continue;
-
-          auto linea =
-              mundo.CreateElement("linea", std::string_view(line.str()));
-          linea.AddAttribute("fila", StringPrintf("%zd", y + 1));
-          linea.AddAttribute("compresionDeCeros", "true");
-        }
-      }
+// Reads the world from stdin, or imports it from a pair of .mdo/.kec files.
+std::shared_ptr<const karel::WorldImage> LoadWorldImage(
+    const std::optional<std::string>& mdo_path,
+    const std::optional<std::string>& kec_path) {
+  if (!mdo_path)
+    return karel::WorldImage::Parse(STDIN_FILENO);
+  auto mdo = ReadFile(mdo_path.value());
+  auto kec = ReadFile(kec_path.value());
+  if (!mdo || !kec)
+    return nullptr;
+  return karel::WorldImage::Import(mdo->view(), kec->view());
+}
 
-      auto programas = resultados.CreateElement("programas");
-      auto programa = programas.CreateElement("programa");
-      programa.AddAttribute("nombre", program_name_);
-      switch (result) {
-        case karel::RunResult::OK:
-          programa.AddAttribute("resultadoEjecucion", "FIN PROGRAMA");
-          break;
-        case karel::RunResult::WALL:
-          programa.AddAttribute("resultadoEjecucion", "MOVIMIENTO INVALIDO");
-          break;
-        case karel::RunResult::WORLDUNDERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "ZUMBADOR INVALIDO");
-          break;
-        case karel::RunResult::BAGUNDERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "ZUMBADOR INVALIDO");
-          break;
-        case karel::RunResult::INSTRUCTION:
-          programa.AddAttribute("resultadoEjecucion",
-                                "LIMITE DE INSTRUCCIONES");
-          break;
-        case karel::RunResult::STACK:
-          programa.AddAttribute("resultadoEjecucion", "STACK OVERFLOW");
-          break;
-      }
-      if (dump_position_ || dump_orientation_ || dump_bag_) {
-        auto karel = programa.CreateElement("karel");
-        if (dump_position_) {
-          karel.AddAttribute("x", StringPrintf("%zu", runtime_.x + 1));
-          karel.AddAttribute("y", StringPrintf("%zu", runtime_.y + 1));
-        }
-        if (dump_orientation_) {
-          switch (runtime_.orientation) {
-            case 0:
-              karel.AddAttribute("direccion", "OESTE");
-              break;
-            case 1:
-              karel.AddAttribute("direccion", "NORTE");
-              break;
-            case 2:
-              karel.AddAttribute("direccion", "ESTE");
-              break;
-            case 3:
-              karel.AddAttribute("direccion", "SUR");
-              break;
-          }
-        }
-        if (dump_bag_) {
-          if (runtime_.bag == karel::kInfinity)
-            karel.AddAttribute("mochila", "INFINITO");
-          else
-            karel.AddAttribute("mochila", StringPrintf("%zu", runtime_.bag));
-        }
-      }
-      if (dump_forward_ || dump_left_ || dump_leavebuzzer_ ||
-          dump_pickbuzzer_) {
-        auto instrucciones = programa.CreateElement("instrucciones");
-        if (dump_forward_) {
-          instrucciones.AddAttribute(
-              "avanza", StringPrintf("%zu", runtime_.forward_count));
-        }
-        if (dump_left_) {
-          instrucciones.AddAttribute("gira_izquierda",
-                                     StringPrintf("%zu", runtime_.left_count));
-        }
-        if (dump_pickbuzzer_) {
-          instrucciones.AddAttribute(
-              "coge_zumbador", StringPrintf("%zu", runtime_.pickbuzzer_count));
-        }
-        if (dump_leavebuzzer_) {
-          instrucciones.AddAttribute(
-              "deja_zumbador", StringPrintf("%zu", runtime_.leavebuzzer_count));
-        }
-      }
-    }
-    ignore_result(write(STDOUT_FILENO, "\n", 1));
+// Appends the paths that match |pattern| to |paths|, in sorted order.
+bool ExpandCases(const std::string& pattern, std::vector<std::string>* paths) {
+  glob_t matches;
+  int ret = glob(pattern.c_str(), 0, nullptr, &matches);
+  if (ret != 0) {
+    LOG(ERROR) << "No cases match " << pattern;
+    globfree(&matches);
+    return false;
   }
+  for (size_t i = 0; i < matches.gl_pathc; ++i)
+    paths->emplace_back(matches.gl_pathv[i]);
+  globfree(&matches);
+  return true;
+}
 
-  karel::Runtime* runtime() { return &runtime_; }
-
- private:
-  World() = default;
-
-  void Init(size_t width, size_t height, std::string_view name) {
-    width_ = width;
-    height_ = height;
-    name_ = std::string(name);
-    program_name_ = "p1";
-    buzzers_ = std::make_unique<uint32_t[]>(width_ * height_);
-    walls_ = std::make_unique<uint8_t[]>(width_ * height_);
-    buzzer_dump_ = std::make_unique<bool[]>(width_ * height_);
-    for (size_t x = 0; x < width_; x++) {
-      walls_[coordinates(x, 0)] |= 1 << 0x3;
-      walls_[coordinates(x, height_ - 1)] |= 1 << 0x1;
-    }
-    for (size_t y = 0; y < height_; y++) {
-      walls_[coordinates(0, y)] |= 1 << 0x0;
-      walls_[coordinates(width_ - 1, y)] |= 1 << 0x2;
-    }
-    runtime_.width = width_;
-    runtime_.height = height_;
-    runtime_.buzzers = buzzers_.get();
-    runtime_.walls = walls_.get();
+// Writes the result to stdout and stores it in |result_cache|.
+void DumpCachedResult(karel::World& world,
+                      karel::RunResult result,
+                      karel::World::ResultFormat format,
+                      const karel::ResultCache& result_cache,
+                      const hash::Key& key) {
+  std::string output;
+  {
+    xml::Buffer buffer(&output);
+    world.DumpResult(result, format, &buffer);
   }
-
-  size_t width_;
-  size_t height_;
-  std::string name_;
-  std::string program_name_;
-  std::unique_ptr<uint32_t[]> buzzers_;
-  std::unique_ptr<uint8_t[]> walls_;
-  std::unique_ptr<bool[]> buzzer_dump_;
-  bool dump_world_ = false;
-  bool dump_universe_ = false;
-  bool dump_position_ = false;
-  bool dump_orientation_ = false;
-  bool dump_bag_ = false;
-  bool dump_forward_ = false;
-  bool dump_left_ = false;
-  bool dump_leavebuzzer_ = false;
-  bool dump_pickbuzzer_ = false;
-
-  karel::Runtime runtime_;
-
-  DISALLOW_COPY_AND_ASSIGN(World);
-};
+  result_cache.Put(key, result, output);
+  if (!WriteFileDescriptor(STDOUT_FILENO, output))
+    PLOG(ERROR) << "Failed to write output";
+}
 
 [[noreturn]] void Usage(const std::string_view program_name) {
   LOG(ERROR) << "Usage: " << program_name
-             << " [--dump={world,result}] program.kx < world.in > world.out";
+             << " [--dump={world,result}] [--format={xml,json,binary,delta}] "
+                "[--heatmap=heatmap.{csv,bin}] [--cache-dir=dir] "
+                "[--result-cache=dir] program.kx < world.in > world.out\n"
+             << "       " << program_name
+             << " [flags] --mdo=world.mdo --kec=world.kec program.kx "
+                "> world.out\n"
+             << "       " << program_name
+             << " --compile=program.kxb program.kx\n"
+             << "       " << program_name
+             << " [flags] --source=sol.txt [< world.in]\n"
+             << "       " << program_name
+             << " [--heatmap=...] [--cache-dir=dir] --expect=world.out "
+                "program.kx < world.in\n"
+             << "       " << program_name
+             << " [--heatmap=...] [--cache-dir=dir] --digest[=expected] "
+                "program.kx < world.in\n"
+             << "       " << program_name
+             << " [--format=...] [--cache-dir=dir] [--result-cache=dir] "
+                "--cases='dir/*.in' [--jobs=N] [--cost-history=file] "
+                "program.kx > results\n"
+             << "       " << program_name
+             << " [--cache-dir=dir] --sweep=spec [--jobs=N] program.kx "
+                "< world.in\n"
+             << "       " << program_name << " --serve[=socket]\n"
+             << "       " << program_name << " --fork-server[=world.in]\n"
+             << "       " << program_name
+             << " [--format={xml,json,binary}] --apply-delta=result.delta "
+                "< world.in > world.out\n"
+             << "       " << program_name
+             << " --compile-world=world.kwb {< world.in | --mdo=... --kec=...}";
   exit(1);
 }
 
@@ -569,6 +149,27 @@ class World {
 
 int main(int argc, char* argv[]) {
   bool dump_result = true;
+  karel::World::ResultFormat result_format = karel::World::ResultFormat::XML;
+  std::optional<std::string_view> heatmap_path;
+  std::optional<std::string> cache_dir;
+  std::optional<std::string> result_cache_dir;
+  std::optional<std::string> cost_history_path;
+  std::optional<std::string> sweep_path;
+  std::optional<std::string> source_path;
+  std::optional<std::string> compile_path;
+  std::optional<std::string> compile_world_path;
+  std::optional<std::string> apply_delta_path;
+  std::optional<std::string> mdo_path;
+  std::optional<std::string> kec_path;
+  std::optional<std::string> expect_path;
+  bool print_digest = false;
+  std::optional<uint64_t> expected_digest;
+  std::vector<std::string> case_patterns;
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+  bool serve = false;
+  std::optional<std::string> socket_path;
+  bool fork_server = false;
+  std::optional<std::string> fork_server_world_path;
 
   for (int i = 1; i < argc; ++i) {
     std::string_view arg = argv[i];
@@ -584,6 +185,87 @@ int main(int argc, char* argv[]) {
         dump_result = true;
       else
         Usage(argv[0]);
+    } else if (arg.find(kFormatFlagPrefix) == 0) {
+      arg.remove_prefix(kFormatFlagPrefix.size());
+      if (arg == "xml")
+        result_format = karel::World::ResultFormat::XML;
+      else if (arg == "json")
+        result_format = karel::World::ResultFormat::JSON;
+      else if (arg == "binary")
+        result_format = karel::World::ResultFormat::BINARY;
+      else if (arg == "delta")
+        result_format = karel::World::ResultFormat::DELTA;
+      else
+        Usage(argv[0]);
+    } else if (arg.find(kHeatmapFlagPrefix) == 0) {
+      arg.remove_prefix(kHeatmapFlagPrefix.size());
+      heatmap_path = arg;
+    } else if (arg.find(kCacheDirFlagPrefix) == 0) {
+      arg.remove_prefix(kCacheDirFlagPrefix.size());
+      cache_dir = std::string(arg);
+    } else if (arg.find(kResultCacheFlagPrefix) == 0) {
+      arg.remove_prefix(kResultCacheFlagPrefix.size());
+      result_cache_dir = std::string(arg);
+    } else if (arg.find(kCostHistoryFlagPrefix) == 0) {
+      arg.remove_prefix(kCostHistoryFlagPrefix.size());
+      cost_history_path = std::string(arg);
+    } else if (arg.find(kSweepFlagPrefix) == 0) {
+      arg.remove_prefix(kSweepFlagPrefix.size());
+      sweep_path = std::string(arg);
+    } else if (arg.find(kCompileWorldFlagPrefix) == 0) {
+      arg.remove_prefix(kCompileWorldFlagPrefix.size());
+      compile_world_path = std::string(arg);
+    } else if (arg.find(kApplyDeltaFlagPrefix) == 0) {
+      arg.remove_prefix(kApplyDeltaFlagPrefix.size());
+      apply_delta_path = std::string(arg);
+    } else if (arg.find(kMdoFlagPrefix) == 0) {
+      arg.remove_prefix(kMdoFlagPrefix.size());
+      mdo_path = std::string(arg);
+    } else if (arg.find(kKecFlagPrefix) == 0) {
+      arg.remove_prefix(kKecFlagPrefix.size());
+      kec_path = std::string(arg);
+    } else if (arg.find(kExpectFlagPrefix) == 0) {
+      arg.remove_prefix(kExpectFlagPrefix.size());
+      expect_path = std::string(arg);
+    } else if (arg == kDigestFlag) {
+      print_digest = true;
+    } else if (arg.find(kDigestFlagPrefix) == 0) {
+      arg.remove_prefix(kDigestFlagPrefix.size());
+      uint64_t digest;
+      auto [ptr, ec] =
+          std::from_chars(arg.data(), arg.data() + arg.size(), digest, 16);
+      if (arg.empty() || ec != std::errc() || ptr != arg.data() + arg.size())
+        Usage(argv[0]);
+      expected_digest = digest;
+    } else if (arg.find(kCasesFlagPrefix) == 0) {
+      arg.remove_prefix(kCasesFlagPrefix.size());
+      case_patterns.emplace_back(arg);
+    } else if (arg.find(kJobsFlagPrefix) == 0) {
+      arg.remove_prefix(kJobsFlagPrefix.size());
+      auto [ptr, ec] =
+          std::from_chars(arg.data(), arg.data() + arg.size(), jobs);
+      if (arg.empty() || ec != std::errc() || ptr != arg.data() + arg.size() ||
+          jobs == 0) {
+        Usage(argv[0]);
+      }
+    } else if (arg == kServeFlag) {
+      serve = true;
+    } else if (arg.find(kServeFlagPrefix) == 0) {
+      arg.remove_prefix(kServeFlagPrefix.size());
+      serve = true;
+      socket_path = std::string(arg);
+    } else if (arg == kForkServerFlag) {
+      fork_server = true;
+    } else if (arg.find(kForkServerFlagPrefix) == 0) {
+      arg.remove_prefix(kForkServerFlagPrefix.size());
+      fork_server = true;
+      fork_server_world_path = std::string(arg);
+    } else if (arg.find(kSourceFlagPrefix) == 0) {
+      arg.remove_prefix(kSourceFlagPrefix.size());
+      source_path = std::string(arg);
+    } else if (arg.find(kCompileFlagPrefix) == 0) {
+      arg.remove_prefix(kCompileFlagPrefix.size());
+      compile_path = std::string(arg);
     } else {
       Usage(argv[0]);
     }
@@ -595,29 +277,219 @@ int main(int argc, char* argv[]) {
     --i;
   }
 
-  if (argc < 2)
+  if (mdo_path.has_value() != kec_path.has_value())
+    Usage(argv[0]);
+  // Worlds can only be dumped as XML.
+  if (!dump_result && result_format != karel::World::ResultFormat::XML)
+    Usage(argv[0]);
+  // Runs are graded against the XML result, either in full or by digest.
+  bool digest = print_digest || expected_digest;
+  if ((expect_path || digest) &&
+      (!dump_result || result_format != karel::World::ResultFormat::XML)) {
+    Usage(argv[0]);
+  }
+  if (expect_path && digest)
+    Usage(argv[0]);
+  // Batches only write results.
+  if (!case_patterns.empty() &&
+      (!dump_result || heatmap_path || expect_path || digest || mdo_path ||
+       compile_path || compile_world_path || apply_delta_path)) {
     Usage(argv[0]);
+  }
+  if (cost_history_path && case_patterns.empty())
+    Usage(argv[0]);
+  // Sweeps only write their report.
+  if (sweep_path &&
+      (!dump_result || result_format != karel::World::ResultFormat::XML ||
+       heatmap_path || expect_path || digest || result_cache_dir ||
+       !case_patterns.empty() || compile_path || compile_world_path ||
+       apply_delta_path)) {
+    Usage(argv[0]);
+  }
+  // Only results are cached.
+  if (result_cache_dir &&
+      (!dump_result || heatmap_path || expect_path || digest || compile_path ||
+       compile_world_path || apply_delta_path)) {
+    Usage(argv[0]);
+  }
 
-  ScopedFD program_fd(open(argv[1], O_RDONLY));
-  if (!program_fd) {
-    PLOG(ERROR) << "Failed to open " << argv[1];
-    return -1;
+  // Sources are compiled in memory, so there is nothing to cache.
+  if (source_path && cache_dir)
+    Usage(argv[0]);
+
+  if (serve)
+    return karel::Serve(socket_path) ? 0 : -1;
+  if (fork_server)
+    return karel::ForkServe(fork_server_world_path) ? 0 : -1;
+
+  if (compile_world_path) {
+    auto image = LoadWorldImage(mdo_path, kec_path);
+    if (!image ||
+        !WriteFileAtomically(compile_world_path.value(), image->ToBinary())) {
+      return -1;
+    }
+    return 0;
+  }
+
+  if (apply_delta_path) {
+    auto image = LoadWorldImage(mdo_path, kec_path);
+    auto delta = ReadFile(apply_delta_path.value());
+    if (!image || !delta)
+      return -1;
+    karel::World world(std::move(image));
+    auto result = world.ApplyDelta(delta->view());
+    if (!result)
+      return -1;
+    world.DumpResult(result.value(), result_format);
+    return static_cast<int32_t>(result.value());
+  }
+
+  std::optional<karel::Program> program;
+  if (source_path) {
+    auto source = ReadFile(source_path.value());
+    if (!source)
+      return -1;
+    program = karel::CompileProgram(source->view());
+  } else {
+    if (argc < 2)
+      Usage(argv[0]);
+    auto program_contents = ReadFile(argv[1]);
+    if (!program_contents)
+      return -1;
+    program =
+        cache_dir
+            ? karel::LoadCachedProgram(cache_dir.value(),
+                                       std::move(program_contents.value()))
+            : karel::Program::Parse(std::move(program_contents.value()));
   }
-  auto program_str = ReadFully(program_fd.get());
-  auto program = karel::ParseInstructions(std::string_view(
-      reinterpret_cast<const char*>(program_str.data()), program_str.size()));
   if (!program)
     return -1;
 
-  auto world = World::Parse(STDIN_FILENO);
-  if (!world)
+  if (compile_path) {
+    if (!WriteFileAtomically(compile_path.value(), program->ToBinary()))
+      return -1;
+    return 0;
+  }
+
+  if (!case_patterns.empty()) {
+    std::vector<std::string> paths;
+    for (const auto& pattern : case_patterns) {
+      if (!ExpandCases(pattern, &paths))
+        return -1;
+    }
+    karel::BatchOptions options;
+    options.jobs = jobs;
+    options.format = result_format;
+    std::optional<karel::ResultCache> result_cache;
+    if (result_cache_dir) {
+      result_cache.emplace(result_cache_dir.value());
+      options.result_cache = &result_cache.value();
+    }
+    karel::CostHistory cost_history;
+    if (cost_history_path) {
+      if (!cost_history.Load(cost_history_path.value()))
+        return -1;
+      options.cost_history = &cost_history;
+    }
+    bool success = karel::RunBatch(program.value(), paths, options);
+    if (cost_history_path && !cost_history.Save(cost_history_path.value()))
+      return -1;
+    return success ? 0 : -1;
+  }
+
+  if (sweep_path) {
+    auto spec_contents = ReadFile(sweep_path.value());
+    auto image = LoadWorldImage(mdo_path, kec_path);
+    if (!spec_contents || !image)
+      return -1;
+    auto spec = karel::SweepSpec::Parse(spec_contents->view(), *image);
+    if (!spec)
+      return -1;
+    karel::SweepOptions options;
+    options.jobs = jobs;
+    karel::RunSweep(program.value(), std::move(image), spec.value(), options);
+    return 0;
+  }
+
+  std::optional<karel::ExpectedResult> expected;
+  if (expect_path) {
+    auto expected_contents = ReadFile(expect_path.value());
+    if (!expected_contents)
+      return -1;
+    expected = karel::ExpectedResult::Parse(expected_contents->view());
+    if (!expected)
+      return -1;
+  }
+
+  auto image = LoadWorldImage(mdo_path, kec_path);
+  if (!image)
     return -1;
+  karel::World world(image);
+
+  std::optional<karel::ResultCache> result_cache;
+  hash::Key result_key;
+  if (result_cache_dir) {
+    result_cache.emplace(result_cache_dir.value());
+    result_key = karel::ResultCache::Key(program->CanonicalKey(), *image,
+                                         *world.runtime(), result_format);
+    if (auto entry = result_cache->Get(result_key)) {
+      if (!WriteFileDescriptor(STDOUT_FILENO, entry->output)) {
+        PLOG(ERROR) << "Failed to write output";
+        return -1;
+      }
+      return static_cast<int32_t>(entry->result);
+    }
+  }
 
-  auto result = karel::Run(program.value(), world->runtime());
-  if (dump_result)
-    world->DumpResult(result);
+  if (heatmap_path)
+    world.EnableHeatmap();
+  if (digest)
+    world.EnableDigest();
+
+  auto result =
+      karel::Run(program->instructions(), program->size(), world.runtime());
+  // When grading, the exit code is the verdict: 0 if the run matches the
+  // expected result, and 1 otherwise, like diff. The same goes for --digest
+  // with an expected digest, and on a mismatch the actual digest is printed.
+  std::optional<std::string> mismatch;
+  std::optional<uint64_t> actual_digest;
+  if (expected)
+    mismatch = expected->Compare(world, result);
+  else if (digest)
+    actual_digest = world.Digest(result);
+  else if (result_cache)
+    DumpCachedResult(world, result, result_format, *result_cache, result_key);
+  else if (dump_result)
+    world.DumpResult(result, result_format);
   else
-    world->Dump();
+    world.Dump();
+
+  if (heatmap_path) {
+    ScopedFD heatmap_fd(open(std::string(heatmap_path.value()).c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (!heatmap_fd) {
+      PLOG(ERROR) << "Failed to open " << heatmap_path.value();
+      return -1;
+    }
+    if (!world.WriteHeatmap(heatmap_fd.get(),
+                            EndsWith(heatmap_path.value(), ".csv")
+                                ? karel::World::HeatmapFormat::CSV
+                                : karel::World::HeatmapFormat::BINARY)) {
+      return -1;
+    }
+  }
 
+  if (actual_digest) {
+    if (expected_digest == actual_digest)
+      return 0;
+    printf("%016" PRIx64 "\n", actual_digest.value());
+    return expected_digest ? 1 : static_cast<int32_t>(result);
+  }
+  if (expected) {
+    if (!mismatch)
+      return 0;
+    printf("%s\n", mismatch->c_str());
+    return 1;
+  }
   return static_cast<int32_t>(result);
 }
@@ -0,0 +1,368 @@
+#include "program.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#include "logging.h"
+
+namespace karel {
+
+namespace {
+
+constexpr size_t kAlignment = 8;
+
+size_t Align(size_t offset) {
+  return (offset + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+size_t EntrySize(Program::SectionType type) {
+  switch (type) {
+    case Program::SectionType::INSTRUCTIONS:
+      return sizeof(Instruction);
+    case Program::SectionType::FUNCTIONS:
+      return sizeof(Program::BinaryFunction);
+    case Program::SectionType::STRINGS:
+      return 1;
+    case Program::SectionType::LINES:
+      return sizeof(Program::BinaryLine);
+  }
+  return 0;
+}
+
+void Append(std::string* output, const void* data, size_t size) {
+  output->append(static_cast<const char*>(data), size);
+}
+
+// Binary programs come straight from disk (and from a cache directory anyone
+// may have written to), so check everything the interpreter and the result
+// dumpers trust: that every opcode and EZ result exists, and that every jump
+// and call lands inside the program.
+bool ValidateInstructions(const Instruction* instructions, size_t size) {
+  for (size_t pc = 0; pc < size; ++pc) {
+    const Instruction& curr = instructions[pc];
+    bool valid = true;
+    switch (curr.opcode) {
+      case Opcode::EZ:
+        valid = static_cast<uint32_t>(curr.arg) <=
+                static_cast<uint32_t>(RunResult::STACK);
+        break;
+      case Opcode::JZ:
+      case Opcode::JMP: {
+        int64_t target = static_cast<int64_t>(pc) + curr.arg + 1;
+        valid = target >= 0 && target <= static_cast<int64_t>(size);
+        break;
+      }
+      case Opcode::CALL:
+        valid = curr.arg >= 0 && static_cast<size_t>(curr.arg) < size;
+        break;
+      default:
+        valid = static_cast<uint32_t>(curr.opcode) < array_length(kOpcodeNames);
+        break;
+    }
+    if (!valid) {
+      LOG(ERROR) << "Invalid binary program instruction at " << pc;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+Program::Program(std::vector<Instruction> instructions)
+    : decoded_(std::move(instructions)),
+      instructions_(decoded_.data()),
+      size_(decoded_.size()) {}
+
+Program::Program(std::vector<Instruction> instructions,
+                 FileContents names,
+                 std::vector<FunctionName> functions)
+    : contents_(std::move(names)),
+      decoded_(std::move(instructions)),
+      instructions_(decoded_.data()),
+      size_(decoded_.size()),
+      functions_(std::move(functions)) {}
+
+Program::Program(Program&&) = default;
+Program& Program::operator=(Program&&) = default;
+Program::~Program() = default;
+
+// static
+std::optional<Program> Program::Parse(FileContents contents) {
+  Program program;
+  program.contents_ = std::move(contents);
+  std::string_view source = program.contents_.view();
+
+  if (IsBinary(source)) {
+    if (!program.ParseBinary())
+      return std::nullopt;
+    return std::make_optional<Program>(std::move(program));
+  }
+
+  auto instructions = ParseInstructions(source, &program.functions_);
+  if (!instructions)
+    return std::nullopt;
+  program.decoded_ = std::move(instructions.value());
+  program.instructions_ = program.decoded_.data();
+  program.size_ = program.decoded_.size();
+  program.source_key_ = hash::Key::Of(source);
+  return std::make_optional<Program>(std::move(program));
+}
+
+// static
+bool Program::IsBinary(std::string_view contents) {
+  uint32_t magic;
+  if (contents.size() < sizeof(magic))
+    return false;
+  memcpy(&magic, contents.data(), sizeof(magic));
+  return magic == kBinaryMagic;
+}
+
+bool Program::ParseBinary() {
+  std::string_view data = contents_.view();
+  if (data.size() < sizeof(BinaryHeader)) {
+    LOG(ERROR) << "Truncated binary program header";
+    return false;
+  }
+  const auto* header = reinterpret_cast<const BinaryHeader*>(data.data());
+  if (header->version != kBinaryVersion) {
+    LOG(ERROR) << "Unsupported binary program version " << header->version;
+    return false;
+  }
+  source_key_ = hash::Key{header->source_high, header->source_low};
+
+  if (header->section_count >
+      (data.size() - sizeof(BinaryHeader)) / sizeof(BinarySection)) {
+    LOG(ERROR) << "Truncated binary program section table";
+    return false;
+  }
+  const auto* sections =
+      reinterpret_cast<const BinarySection*>(data.data() + sizeof(*header));
+
+  const BinaryFunction* functions = nullptr;
+  size_t function_count = 0;
+  std::string_view strings;
+  bool has_instructions = false;
+  for (size_t i = 0; i < header->section_count; ++i) {
+    const BinarySection& section = sections[i];
+    size_t entry_size = EntrySize(section.type);
+    if (entry_size == 0)
+      continue;
+    if (section.offset % kAlignment != 0 || section.offset > data.size() ||
+        section.count > (data.size() - section.offset) / entry_size) {
+      LOG(ERROR) << "Invalid binary program section "
+                 << static_cast<uint32_t>(section.type);
+      return false;
+    }
+    const char* begin = data.data() + section.offset;
+    switch (section.type) {
+      case SectionType::INSTRUCTIONS:
+        instructions_ = reinterpret_cast<const Instruction*>(begin);
+        size_ = section.count;
+        has_instructions = true;
+        break;
+      case SectionType::FUNCTIONS:
+        functions = reinterpret_cast<const BinaryFunction*>(begin);
+        function_count = section.count;
+        break;
+      case SectionType::STRINGS:
+        strings = std::string_view(begin, section.count);
+        break;
+      case SectionType::LINES:
+        break;
+    }
+  }
+  if (!has_instructions) {
+    LOG(ERROR) << "Binary program without instructions";
+    return false;
+  }
+  if (!ValidateInstructions(instructions_, size_))
+    return false;
+
+  functions_.reserve(function_count);
+  for (size_t i = 0; i < function_count; ++i) {
+    const BinaryFunction& function = functions[i];
+    if (function.name_offset > strings.size() ||
+        function.name_size > strings.size() - function.name_offset) {
+      LOG(ERROR) << "Invalid binary program function name";
+      return false;
+    }
+    functions_.push_back(
+        FunctionName{function.pc, strings.substr(function.name_offset,
+                                                 function.name_size)});
+  }
+  return true;
+}
+
+std::vector<Program::BinaryLine> Program::line_map() const {
+  std::vector<BinaryLine> lines;
+  for (size_t pc = 0; pc < size_; ++pc) {
+    if (instructions_[pc].opcode == Opcode::LINE)
+      lines.push_back(BinaryLine{static_cast<uint32_t>(pc),
+                                 instructions_[pc].arg});
+  }
+  return lines;
+}
+
+hash::Key Program::CanonicalKey() const {
+  // Functions span from their entry point to the next one.
+  std::vector<int32_t> entries{0};
+  for (size_t pc = 0; pc < size_; ++pc) {
+    if (instructions_[pc].opcode == Opcode::CALL)
+      entries.push_back(instructions_[pc].arg);
+  }
+  std::sort(entries.begin(), entries.end());
+  entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+  auto function_end = [this, &entries](int32_t entry) {
+    auto next = std::upper_bound(entries.begin(), entries.end(), entry);
+    return next == entries.end() ? static_cast<int32_t>(size_) : *next;
+  };
+
+  // Functions are renumbered in the order in which they are first called,
+  // starting from the main program. Jumps are relative, so bodies can be
+  // moved as long as they neither jump nor fall through out of their
+  // function. Every body is preceded by its length, since the same
+  // instructions can be split into functions in more than one way.
+  std::vector<Instruction> canonical;
+  std::vector<int32_t> order{0};
+  std::unordered_map<int32_t, int32_t> numbers{{0, 0}};
+  bool relocatable = true;
+  for (size_t i = 0; i < order.size() && relocatable; ++i) {
+    int32_t entry = order[i];
+    int32_t end = function_end(entry);
+    if (entry < 0 || end <= entry) {
+      relocatable = false;
+      break;
+    }
+    canonical.push_back(Instruction{Opcode::HALT, end - entry});
+    for (int32_t pc = entry; pc < end; ++pc) {
+      Instruction instruction = instructions_[pc];
+      switch (instruction.opcode) {
+        case Opcode::LINE:
+          instruction.arg = 0;
+          break;
+        case Opcode::JZ:
+        case Opcode::JMP: {
+          int64_t target = static_cast<int64_t>(pc) + instruction.arg + 1;
+          if (target < entry || target >= end)
+            relocatable = false;
+          break;
+        }
+        case Opcode::CALL: {
+          auto [it, inserted] = numbers.emplace(
+              instruction.arg, static_cast<int32_t>(order.size()));
+          if (inserted)
+            order.push_back(instruction.arg);
+          instruction.arg = it->second;
+          break;
+        }
+        default:
+          break;
+      }
+      canonical.push_back(instruction);
+    }
+    Opcode last = instructions_[end - 1].opcode;
+    if (last != Opcode::RET && last != Opcode::HALT)
+      relocatable = false;
+  }
+
+  if (!relocatable) {
+    canonical.assign(instructions_, instructions_ + size_);
+    for (auto& instruction : canonical) {
+      if (instruction.opcode == Opcode::LINE)
+        instruction.arg = 0;
+    }
+  }
+  // Tell both layouts apart, in case one happens to look like the other.
+  canonical.push_back(Instruction{Opcode::HALT, relocatable ? 1 : 0});
+  return hash::Key::Of(
+      std::string_view(reinterpret_cast<const char*>(canonical.data()),
+                       canonical.size() * sizeof(Instruction)));
+}
+
+std::string Program::ToBinary() const {
+  static_assert(sizeof(Instruction) == 8, "Instruction should be packed");
+
+  std::vector<BinaryFunction> functions;
+  std::string strings;
+  for (const auto& function : functions_) {
+    functions.push_back(BinaryFunction{
+        function.pc, static_cast<uint32_t>(strings.size()),
+        static_cast<uint32_t>(function.name.size()), 0});
+    strings.append(function.name);
+  }
+  std::vector<BinaryLine> lines = line_map();
+
+  struct Table {
+    SectionType type;
+    size_t count;
+    const void* data;
+  };
+  const Table tables[] = {
+      {SectionType::INSTRUCTIONS, size_, instructions_},
+      {SectionType::FUNCTIONS, functions.size(), functions.data()},
+      {SectionType::STRINGS, strings.size(), strings.data()},
+      {SectionType::LINES, lines.size(), lines.data()},
+  };
+
+  BinaryHeader header{kBinaryMagic,
+                      kBinaryVersion,
+                      source_key_.high,
+                      source_key_.low,
+                      static_cast<uint32_t>(array_length(tables)),
+                      0};
+  std::string output;
+  Append(&output, &header, sizeof(header));
+
+  size_t offset =
+      Align(sizeof(header) + array_length(tables) * sizeof(BinarySection));
+  for (const auto& table : tables) {
+    BinarySection section{table.type, static_cast<uint32_t>(table.count),
+                          offset};
+    Append(&output, &section, sizeof(section));
+    offset = Align(offset + table.count * EntrySize(table.type));
+  }
+  for (const auto& table : tables) {
+    output.resize(Align(output.size()));
+    Append(&output, table.data, table.count * EntrySize(table.type));
+  }
+  return output;
+}
+
+std::optional<Program> LoadCachedProgram(const std::string& cache_dir,
+                                         FileContents source) {
+  if (Program::IsBinary(source.view()))
+    return Program::Parse(std::move(source));
+
+  hash::Key key = hash::Key::Of(source.view());
+  std::string path = cache_dir + "/" + key.ToString() + ".kxb";
+
+  ScopedFD cached_fd(open(path.c_str(), O_RDONLY));
+  if (cached_fd) {
+    auto contents = FileContents::Read(cached_fd.get());
+    if (contents && Program::IsBinary(contents->view())) {
+      auto program = Program::Parse(std::move(contents.value()));
+      if (program && program->source_key() == key)
+        return program;
+    }
+    LOG(WARN) << "Ignoring invalid cached program " << path;
+  }
+
+  auto program = Program::Parse(std::move(source));
+  if (!program)
+    return std::nullopt;
+
+  if (mkdir(cache_dir.c_str(), 0755) == -1 && errno != EEXIST)
+    PLOG(WARN) << "Failed to create " << cache_dir;
+  else
+    WriteFileAtomically(path, program->ToBinary());
+  return program;
+}
+
+}  // namespace karel
@@ -0,0 +1,130 @@
+#ifndef PROGRAM_H_
+#define PROGRAM_H_
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hash.h"
+#include "karel.h"
+#include "macros.h"
+#include "util.h"
+
+namespace karel {
+
+// A compiled program, either decoded from the .kx JSON format or loaded from
+// the binary format. Binary programs are used in place from the mapped file,
+// so loading one does not copy its instructions, which are only validated.
+//
+// The binary format is little-endian. It starts with a BinaryHeader, followed
+// by |section_count| BinarySections that point to 8-byte aligned tables:
+//
+//  * INSTRUCTIONS: the Instruction records themselves.
+//  * FUNCTIONS: one BinaryFunction per function entry point, whose names are
+//    stored in the STRINGS table.
+//  * LINES: one BinaryLine per LINE instruction.
+//
+// Readers must ignore sections they don't know about, and must reject files
+// with a different |version|.
+class Program {
+ public:
+  static constexpr uint32_t kBinaryMagic = 0x3142584bu;  // "KXB1"
+  static constexpr uint32_t kBinaryVersion = 1;
+
+  enum class SectionType : uint32_t { INSTRUCTIONS, FUNCTIONS, STRINGS, LINES };
+
+  struct BinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    // The hash::Key of the .kx source the program was converted from.
+    uint64_t source_high;
+    uint64_t source_low;
+    uint32_t section_count;
+    uint32_t reserved;
+  };
+
+  struct BinarySection {
+    SectionType type;
+    uint32_t count;
+    uint64_t offset;
+  };
+
+  struct BinaryFunction {
+    int32_t pc;
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint32_t reserved;
+  };
+
+  struct BinaryLine {
+    uint32_t pc;
+    int32_t line;
+  };
+
+  explicit Program(std::vector<Instruction> instructions);
+  // A program built in memory, like by the compiler. The names in
+  // |functions| point into |names|.
+  Program(std::vector<Instruction> instructions,
+          FileContents names,
+          std::vector<FunctionName> functions);
+  Program(Program&&);
+  Program& operator=(Program&&);
+  ~Program();
+
+  // Parses a program in either format.
+  static std::optional<Program> Parse(FileContents contents);
+
+  static bool IsBinary(std::string_view contents);
+
+  const Instruction* instructions() const { return instructions_; }
+  size_t size() const { return size_; }
+
+  // The names of the functions, sorted by their entry point. They are only
+  // available if the source had them.
+  const std::vector<FunctionName>& functions() const { return functions_; }
+
+  // The line that each LINE instruction sets, in program order.
+  std::vector<BinaryLine> line_map() const;
+
+  const hash::Key& source_key() const { return source_key_; }
+  void set_source_key(const hash::Key& source_key) {
+    source_key_ = source_key;
+  }
+
+  // A key that only depends on what the program does, so that programs that
+  // only differ in their LINE arguments, their function names or the order
+  // of their functions share it. Functions that are never called are left
+  // out.
+  hash::Key CanonicalKey() const;
+
+  // Serializes the program and its side tables in the binary format.
+  std::string ToBinary() const;
+
+ private:
+  Program() = default;
+
+  bool ParseBinary();
+
+  // The file the program was read from. Instructions and function names of
+  // binary programs, and function names of JSON programs, point into it.
+  FileContents contents_;
+  std::vector<Instruction> decoded_;
+  const Instruction* instructions_ = nullptr;
+  size_t size_ = 0;
+  std::vector<FunctionName> functions_;
+  hash::Key source_key_;
+
+  DISALLOW_COPY_AND_ASSIGN(Program);
+};
+
+// Loads the program in |source| through a cache of binary programs stored in
+// |cache_dir|, keyed by the hash of |source|. On a hit, the cached program is
+// mapped without copying, and only its instructions are validated. On a miss,
+// |source| is parsed and the result is added to the cache.
+std::optional<Program> LoadCachedProgram(const std::string& cache_dir,
+                                         FileContents source);
+
+}  // namespace karel
+
+#endif  // PROGRAM_H_
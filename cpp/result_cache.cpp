@@ -0,0 +1,98 @@
+#include "result_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <utility>
+
+#include "logging.h"
+#include "util.h"
+
+namespace karel {
+
+namespace {
+
+template <typename T>
+void Append(std::string* output, const T& value) {
+  output->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+}  // namespace
+
+ResultCache::ResultCache(std::string dir) : dir_(std::move(dir)) {
+  if (mkdir(dir_.c_str(), 0755) == -1 && errno != EEXIST)
+    PLOG(WARN) << "Failed to create " << dir_;
+}
+
+ResultCache::~ResultCache() = default;
+
+// static
+hash::Key ResultCache::Key(const hash::Key& program_key,
+                           const WorldImage& image,
+                           const Runtime& runtime,
+                           World::ResultFormat format) {
+  hash::Key world_key = hash::Key::Of(image.ToBinary());
+
+  std::string data;
+  Append(&data, program_key);
+  Append(&data, world_key);
+  Append(&data, static_cast<uint32_t>(format));
+  for (size_t limit :
+       {runtime.instruction_limit, runtime.stack_limit, runtime.forward_limit,
+        runtime.left_limit, runtime.pickbuzzer_limit,
+        runtime.leavebuzzer_limit}) {
+    Append(&data, static_cast<uint64_t>(limit));
+  }
+  return hash::Key::Of(data);
+}
+
+std::optional<ResultCache::Entry> ResultCache::Get(
+    const hash::Key& key) const {
+  std::string path = Path(key);
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd)
+    return std::nullopt;
+  auto contents = FileContents::Read(fd.get());
+  if (!contents)
+    return std::nullopt;
+
+  std::string_view data = contents->view();
+  BinaryHeader header;
+  if (data.size() >= sizeof(header))
+    memcpy(&header, data.data(), sizeof(header));
+  if (data.size() < sizeof(header) || header.magic != kBinaryMagic ||
+      header.version != kBinaryVersion || header.key_high != key.high ||
+      header.key_low != key.low ||
+      header.result > static_cast<uint32_t>(RunResult::STACK) ||
+      header.size != data.size() - sizeof(header)) {
+    LOG(WARN) << "Ignoring invalid cached result " << path;
+    return std::nullopt;
+  }
+  return Entry{static_cast<RunResult>(header.result),
+               std::string(data.substr(sizeof(header)))};
+}
+
+bool ResultCache::Put(const hash::Key& key,
+                      RunResult result,
+                      std::string_view output) const {
+  BinaryHeader header{kBinaryMagic,
+                      kBinaryVersion,
+                      key.high,
+                      key.low,
+                      static_cast<uint32_t>(result),
+                      0,
+                      output.size()};
+  std::string contents;
+  contents.reserve(sizeof(header) + output.size());
+  Append(&contents, header);
+  contents.append(output);
+  return WriteFileAtomically(Path(key), contents);
+}
+
+std::string ResultCache::Path(const hash::Key& key) const {
+  return dir_ + "/" + key.ToString() + ".krc";
+}
+
+}  // namespace karel
@@ -0,0 +1,71 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "hash.h"
+#include "karel.h"
+#include "macros.h"
+#include "world.h"
+
+namespace karel {
+
+// Remembers the results of runs in a directory, so that programs that were
+// already run against a world, like identical submissions, don't need to be
+// run again.
+//
+// Entries are keyed by the canonical key of the program, the contents of the
+// world, its limits, which might have been overridden, and the format of the
+// result. Each one is a file named after its key, that holds a BinaryHeader
+// followed by the result. Entries are written atomically, so any number of
+// processes and threads can share a directory.
+class ResultCache {
+ public:
+  static constexpr uint32_t kBinaryMagic = 0x3143524bu;  // "KRC1"
+  static constexpr uint32_t kBinaryVersion = 1;
+
+  struct BinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key_high;
+    uint64_t key_low;
+    uint32_t result;
+    uint32_t reserved;
+    uint64_t size;
+  };
+
+  struct Entry {
+    RunResult result;
+    std::string output;
+  };
+
+  explicit ResultCache(std::string dir);
+  ~ResultCache();
+
+  // Computes the key of running the program with |program_key|, its
+  // Program::CanonicalKey(), against |image| with the limits of |runtime|.
+  static hash::Key Key(const hash::Key& program_key,
+                       const WorldImage& image,
+                       const Runtime& runtime,
+                       World::ResultFormat format);
+
+  std::optional<Entry> Get(const hash::Key& key) const;
+  // Returns false if the entry could not be stored. The cache keeps working
+  // either way.
+  bool Put(const hash::Key& key,
+           RunResult result,
+           std::string_view output) const;
+
+ private:
+  std::string Path(const hash::Key& key) const;
+
+  const std::string dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResultCache);
+};
+
+}  // namespace karel
+
+#endif  // RESULT_CACHE_H_
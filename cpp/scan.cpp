@@ -0,0 +1,181 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace scan {
+
+namespace {
+
+// Appends the positions of the set bits of |bits| (relative to |base|).
+inline size_t EmitBits(uint32_t bits, uint32_t base, uint32_t* indices) {
+  size_t count = 0;
+  while (bits) {
+    indices[count++] = base + __builtin_ctz(bits);
+    bits &= bits - 1;
+  }
+  return count;
+}
+
+// Each kernel scans the longest prefix of |data| that fills whole vectors and
+// stores its length in |scanned|; the tail is left for the scalar loop.
+using Kernel32 = size_t (*)(const uint32_t* data,
+                            size_t size,
+                            uint32_t* indices,
+                            size_t* scanned);
+using Kernel8 = size_t (*)(const uint8_t* data,
+                           size_t size,
+                           uint8_t mask,
+                           uint32_t* indices,
+                           size_t* scanned);
+
+size_t FindNonZero32Scalar(const uint32_t* data,
+                           size_t size,
+                           uint32_t* indices,
+                           size_t* scanned) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i])
+      indices[count++] = i;
+  }
+  *scanned = size;
+  return count;
+}
+
+size_t FindNonZero8Scalar(const uint8_t* data,
+                          size_t size,
+                          uint8_t mask,
+                          uint32_t* indices,
+                          size_t* scanned) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i] & mask)
+      indices[count++] = i;
+  }
+  *scanned = size;
+  return count;
+}
+
+#if defined(SCAN_X86)
+
+__attribute__((target("sse2"))) size_t FindNonZero32SSE2(const uint32_t* data,
+                                                         size_t size,
+                                                         uint32_t* indices,
+                                                         size_t* scanned) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    uint32_t zeros =
+        _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero)));
+    count += EmitBits(~zeros & 0xFu, i, indices + count);
+  }
+  *scanned = i;
+  return count;
+}
+
+__attribute__((target("sse2"))) size_t FindNonZero8SSE2(const uint8_t* data,
+                                                        size_t size,
+                                                        uint8_t mask,
+                                                        uint32_t* indices,
+                                                        size_t* scanned) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bits = _mm_set1_epi8(static_cast<char>(mask));
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    uint32_t zeros =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, bits), zero));
+    count += EmitBits(~zeros & 0xFFFFu, i, indices + count);
+  }
+  *scanned = i;
+  return count;
+}
+
+__attribute__((target("avx2"))) size_t FindNonZero32AVX2(const uint32_t* data,
+                                                         size_t size,
+                                                         uint32_t* indices,
+                                                         size_t* scanned) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    uint32_t zeros =
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero)));
+    count += EmitBits(~zeros & 0xFFu, i, indices + count);
+  }
+  *scanned = i;
+  return count;
+}
+
+__attribute__((target("avx2"))) size_t FindNonZero8AVX2(const uint8_t* data,
+                                                        size_t size,
+                                                        uint8_t mask,
+                                                        uint32_t* indices,
+                                                        size_t* scanned) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i bits = _mm256_set1_epi8(static_cast<char>(mask));
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    uint32_t zeros = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), zero));
+    count += EmitBits(~zeros, i, indices + count);
+  }
+  *scanned = i;
+  return count;
+}
+
+#endif  // defined(SCAN_X86)
+
+struct Kernels {
+  Kernel32 find32;
+  Kernel8 find8;
+};
+
+const Kernels& GetKernels() {
+  static const Kernels kernels = []() -> Kernels {
+#if defined(SCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return {&FindNonZero32AVX2, &FindNonZero8AVX2};
+    if (__builtin_cpu_supports("sse2"))
+      return {&FindNonZero32SSE2, &FindNonZero8SSE2};
+#endif
+    return {&FindNonZero32Scalar, &FindNonZero8Scalar};
+  }();
+  return kernels;
+}
+
+}  // namespace
+
+size_t FindNonZero(const uint32_t* data, size_t size, uint32_t* indices) {
+  size_t scanned = 0;
+  size_t count = GetKernels().find32(data, size, indices, &scanned);
+  for (size_t i = scanned; i < size; ++i) {
+    if (data[i])
+      indices[count++] = i;
+  }
+  return count;
+}
+
+size_t FindNonZero(const uint8_t* data,
+                   size_t size,
+                   uint8_t mask,
+                   uint32_t* indices) {
+  size_t scanned = 0;
+  size_t count = GetKernels().find8(data, size, mask, indices, &scanned);
+  for (size_t i = scanned; i < size; ++i) {
+    if (data[i] & mask)
+      indices[count++] = i;
+  }
+  return count;
+}
+
+}  // namespace scan
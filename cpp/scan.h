@@ -0,0 +1,23 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace scan {
+
+// Writes the index of every non-zero element of |data| into |indices| in
+// increasing order, and returns how many were found. |indices| must have room
+// for |size| entries.
+size_t FindNonZero(const uint32_t* data, size_t size, uint32_t* indices);
+
+// Same as above, but for the elements of |data| that have any of the bits in
+// |mask| set.
+size_t FindNonZero(const uint8_t* data,
+                   size_t size,
+                   uint8_t mask,
+                   uint32_t* indices);
+
+}  // namespace scan
+
+#endif  // SCAN_H_
@@ -0,0 +1,204 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "logging.h"
+#include "util.h"
+
+namespace karel {
+
+Scheduler::Scheduler(size_t workers, size_t slice) : slice_(slice) {
+  workers = std::max<size_t>(workers, 1);
+  for (size_t i = 0; i < workers; ++i)
+    queues_.emplace_back(std::make_unique<Queue>());
+  for (size_t i = 0; i < workers; ++i)
+    workers_.emplace_back(&Scheduler::Work, this, i);
+}
+
+Scheduler::~Scheduler() {
+  Wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_available_.notify_all();
+  for (auto& worker : workers_)
+    worker.join();
+}
+
+void Scheduler::Submit(std::vector<Task> tasks) {
+  if (tasks.empty())
+    return;
+  std::stable_sort(
+      tasks.begin(), tasks.end(),
+      [](const Task& a, const Task& b) { return a.cost > b.cost; });
+  pending_ += tasks.size();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& task : tasks) {
+    Queue& queue = *queues_[next_queue_];
+    next_queue_ = (next_queue_ + 1) % queues_.size();
+    std::lock_guard<std::mutex> queue_lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+  }
+  queued_ += tasks.size();
+  work_available_.notify_all();
+}
+
+void Scheduler::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return pending_ == 0; });
+}
+
+void Scheduler::Work(size_t index) {
+  Task task;
+  while (true) {
+    if (!Pop(index, &task)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ++sleeping_;
+      work_available_.wait(lock,
+                           [this]() { return queued_ > 0 || stopping_; });
+      --sleeping_;
+      if (queued_ == 0 && stopping_)
+        return;
+      continue;
+    }
+
+    if (!task.run(slice_)) {
+      Push(index, std::move(task));
+      continue;
+    }
+    task = Task();
+    if (--pending_ == 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_.notify_all();
+    }
+  }
+}
+
+bool Scheduler::Pop(size_t index, Task* task) {
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    Queue& queue = *queues_[(index + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      continue;
+    // Steal from the back, which holds the cheapest of the tasks that were
+    // submitted to that worker.
+    if (i == 0) {
+      *task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    } else {
+      *task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+    --queued_;
+    return true;
+  }
+  return false;
+}
+
+void Scheduler::Push(size_t index, Task task) {
+  {
+    Queue& queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+  }
+  ++queued_;
+  // Idle workers can steal the task while this one moves on to the next.
+  if (sleeping_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    work_available_.notify_one();
+  }
+}
+
+CostHistory::CostHistory() = default;
+CostHistory::~CostHistory() = default;
+
+bool CostHistory::Load(const std::string& path) {
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd) {
+    if (errno == ENOENT)
+      return true;
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  auto contents = FileContents::Read(fd.get());
+  if (!contents)
+    return false;
+
+  std::string_view data = contents->view();
+  BinaryHeader header;
+  if (data.size() < sizeof(header)) {
+    LOG(ERROR) << "Truncated cost history " << path;
+    return false;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (header.magic != kBinaryMagic || header.version != kBinaryVersion ||
+      header.count !=
+          (data.size() - sizeof(header)) / sizeof(BinaryRecord) ||
+      (data.size() - sizeof(header)) % sizeof(BinaryRecord) != 0) {
+    LOG(ERROR) << "Invalid cost history " << path;
+    return false;
+  }
+
+  for (size_t i = 0; i < header.count; ++i) {
+    BinaryRecord record;
+    memcpy(&record, data.data() + sizeof(header) + i * sizeof(record),
+           sizeof(record));
+    Record(hash::Key{record.program_high, record.program_low},
+           hash::Key{record.world_high, record.world_low},
+           record.instructions);
+  }
+  return true;
+}
+
+bool CostHistory::Save(const std::string& path) const {
+  std::string output(sizeof(BinaryHeader), '\0');
+  uint64_t count = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [program, runs] : programs_) {
+      for (const auto& [world, instructions] : runs.instructions) {
+        BinaryRecord record{program.high, program.low, world.high, world.low,
+                            instructions};
+        output.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        ++count;
+      }
+    }
+  }
+  BinaryHeader header{kBinaryMagic, kBinaryVersion, count};
+  memcpy(output.data(), &header, sizeof(header));
+  return WriteFileAtomically(path, output);
+}
+
+size_t CostHistory::Estimate(const hash::Key& program,
+                             const hash::Key& world) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = programs_.find(program);
+  if (it == programs_.end())
+    return 0;
+  const Runs& runs = it->second;
+  auto run = runs.instructions.find(world);
+  if (run != runs.instructions.end())
+    return run->second;
+  return runs.total / runs.instructions.size();
+}
+
+void CostHistory::Record(const hash::Key& program,
+                         const hash::Key& world,
+                         size_t instructions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Runs& runs = programs_[program];
+  auto [it, inserted] = runs.instructions.emplace(world, instructions);
+  if (!inserted) {
+    runs.total -= it->second;
+    it->second = instructions;
+  }
+  runs.total += instructions;
+}
+
+}  // namespace karel
@@ -0,0 +1,137 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "hash.h"
+#include "macros.h"
+
+namespace karel {
+
+// How many instructions a task runs before it yields its worker. At about 10ns
+// per instruction, a slice takes around a tenth of a millisecond.
+constexpr size_t kDefaultSlice = 10000;
+
+// Runs tasks on a pool of workers in slices of a fixed number of instructions,
+// so that a few runs that hit the instruction limit cannot hold every worker
+// while short runs wait behind them.
+//
+// Each worker owns a deque. It takes tasks from the front of its own deque,
+// runs them for one slice and, if they are not done, puts them back at the
+// end. Workers whose deque is empty steal from the back of the others'.
+class Scheduler {
+ public:
+  struct Task {
+    // The estimated number of instructions that the task will run.
+    size_t cost = 0;
+    // Runs the task for about |slice| instructions. Returns true once the task
+    // is done, or false if it has to be resumed.
+    std::function<bool(size_t slice)> run;
+  };
+
+  Scheduler(size_t workers, size_t slice);
+  // Waits for all the tasks to be done.
+  ~Scheduler();
+
+  // Adds |tasks| to the workers' deques, most expensive first, so that the
+  // heaviest runs are started early instead of becoming the tail of a batch.
+  void Submit(std::vector<Task> tasks);
+
+  // Waits until all the submitted tasks are done.
+  void Wait();
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void Work(size_t index);
+  bool Pop(size_t index, Task* task);
+  void Push(size_t index, Task task);
+
+  const size_t slice_;
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  size_t next_queue_ = 0;
+
+  // How many tasks are sitting in the deques, and how many have not finished.
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> pending_{0};
+  std::atomic<size_t> sleeping_{0};
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable done_;
+  bool stopping_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(Scheduler);
+};
+
+// Remembers how many instructions runs took, keyed by the canonical key of
+// the program and the key of the world, so that they can be scheduled by
+// their expected cost. The history can be kept in a file between processes.
+//
+// The file is little-endian. It starts with a BinaryHeader, followed by
+// |count| BinaryRecords.
+class CostHistory {
+ public:
+  static constexpr uint32_t kBinaryMagic = 0x3148434bu;  // "KCH1"
+  static constexpr uint32_t kBinaryVersion = 1;
+
+  struct BinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+  };
+
+  struct BinaryRecord {
+    uint64_t program_high;
+    uint64_t program_low;
+    uint64_t world_high;
+    uint64_t world_low;
+    uint64_t instructions;
+  };
+
+  CostHistory();
+  ~CostHistory();
+
+  // Adds the records in |path| to the history. A missing file is an empty
+  // history.
+  bool Load(const std::string& path);
+  bool Save(const std::string& path) const;
+
+  // Returns the cost of the last run of |program| on |world|. Runs that were
+  // never seen are estimated as the average of the runs of the program.
+  size_t Estimate(const hash::Key& program, const hash::Key& world) const;
+  void Record(const hash::Key& program,
+              const hash::Key& world,
+              size_t instructions);
+
+ private:
+  struct KeyHash {
+    size_t operator()(const hash::Key& key) const { return key.low; }
+  };
+  struct Runs {
+    std::unordered_map<hash::Key, size_t, KeyHash> instructions;
+    size_t total = 0;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<hash::Key, Runs, KeyHash> programs_;
+
+  DISALLOW_COPY_AND_ASSIGN(CostHistory);
+};
+
+}  // namespace karel
+
+#endif  // SCHEDULER_H_
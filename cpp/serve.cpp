@@ -0,0 +1,640 @@
+#include "serve.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+#include "karel.h"
+#include "logging.h"
+#include "macros.h"
+#include "program.h"
+#include "util.h"
+#include "world.h"
+#include "xml.h"
+
+namespace karel {
+
+namespace {
+
+// Frames larger than this are rejected.
+constexpr uint32_t kMaxFrameSize = 256 * 1024 * 1024;
+// How many programs and how many worlds are kept resident.
+constexpr size_t kCacheCapacity = 256;
+// How many results each connection keeps before it starts dropping the oldest
+// ones that were never fetched.
+constexpr size_t kMaxPendingResults = 4096;
+// How long to wait for a descriptor to be freed before accepting again.
+constexpr std::chrono::milliseconds kAcceptBackoff(100);
+
+// Keeps the |capacity| most recently used values.
+template <typename T>
+class LruCache {
+ public:
+  explicit LruCache(size_t capacity) : capacity_(capacity) {}
+
+  std::shared_ptr<const T> Get(const std::string& key) {
+    auto it = index_.find(key);
+    if (it == index_.end())
+      return nullptr;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+  }
+
+  void Put(const std::string& key, std::shared_ptr<const T> value) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      it->second->second = std::move(value);
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return;
+    }
+    entries_.emplace_front(key, std::move(value));
+    index_.emplace(key, entries_.begin());
+    if (entries_.size() > capacity_) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+  }
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const T>>;
+
+  const size_t capacity_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, typename std::list<Entry>::iterator> index_;
+
+  DISALLOW_COPY_AND_ASSIGN(LruCache);
+};
+
+// The state shared by all connections.
+class Server {
+ public:
+  Server() : programs_(kCacheCapacity), worlds_(kCacheCapacity) {}
+
+  std::optional<std::string> LoadProgram(std::string_view contents) {
+    std::string key = hash::Key::Of(contents).ToString();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (programs_.Get(key))
+        return key;
+    }
+    auto program = Program::Parse(FileContents::Copy(contents));
+    if (!program)
+      return std::nullopt;
+    auto shared = std::make_shared<const Program>(std::move(program.value()));
+    std::lock_guard<std::mutex> lock(mutex_);
+    programs_.Put(key, std::move(shared));
+    return key;
+  }
+
+  std::optional<std::string> LoadWorld(std::string_view contents) {
+    std::string key = hash::Key::Of(contents).ToString();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (worlds_.Get(key))
+        return key;
+    }
+    // Binary worlds are read in place, so they need the alignment of a buffer
+    // of their own rather than their offset within the request.
+    auto image = WorldImage::Parse(FileContents::Copy(contents).view());
+    if (!image)
+      return std::nullopt;
+    std::lock_guard<std::mutex> lock(mutex_);
+    worlds_.Put(key, std::move(image));
+    return key;
+  }
+
+  std::shared_ptr<const Program> GetProgram(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return programs_.Get(key);
+  }
+
+  std::shared_ptr<const WorldImage> GetWorld(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return worlds_.Get(key);
+  }
+
+ private:
+  std::mutex mutex_;
+  LruCache<Program> programs_;
+  LruCache<WorldImage> worlds_;
+
+  DISALLOW_COPY_AND_ASSIGN(Server);
+};
+
+// Reads up to |size| bytes, stopping early only at the end of the input.
+// Returns how many were read, or -1 on errors.
+ssize_t ReadFully(int fd, char* data, size_t size) {
+  size_t total = 0;
+  while (total < size) {
+    ssize_t bytes_read = HANDLE_EINTR(read(fd, data + total, size - total));
+    if (bytes_read == -1)
+      return -1;
+    if (bytes_read == 0)
+      break;
+    total += bytes_read;
+  }
+  return total;
+}
+
+std::vector<std::string_view> Split(std::string_view str) {
+  std::vector<std::string_view> tokens;
+  while (!str.empty()) {
+    size_t end = str.find(' ');
+    if (end != 0)
+      tokens.push_back(str.substr(0, end));
+    if (end == std::string_view::npos)
+      break;
+    str.remove_prefix(end + 1);
+  }
+  return tokens;
+}
+
+std::optional<World::ResultFormat> ParseFormat(std::string_view format) {
+  if (format == "xml")
+    return World::ResultFormat::XML;
+  if (format == "json")
+    return World::ResultFormat::JSON;
+  if (format == "binary")
+    return World::ResultFormat::BINARY;
+  if (format == "delta")
+    return World::ResultFormat::DELTA;
+  return std::nullopt;
+}
+
+template <typename T>
+bool ParseNumber(std::string_view str, T* value) {
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), *value);
+  return !str.empty() && ec == std::errc() && ptr == str.data() + str.size();
+}
+
+// Splits a "name=value" option of a request.
+std::pair<std::string_view, std::string_view> SplitOption(
+    std::string_view option) {
+  size_t equals = option.find('=');
+  if (equals == std::string_view::npos)
+    return {option, std::string_view()};
+  return {option.substr(0, equals), option.substr(equals + 1)};
+}
+
+// The limits that a run request can override.
+size_t Runtime::*GetLimit(std::string_view name) {
+  if (name == "instruction_limit")
+    return &Runtime::instruction_limit;
+  if (name == "stack_limit")
+    return &Runtime::stack_limit;
+  if (name == "forward_limit")
+    return &Runtime::forward_limit;
+  if (name == "left_limit")
+    return &Runtime::left_limit;
+  if (name == "pickbuzzer_limit")
+    return &Runtime::pickbuzzer_limit;
+  if (name == "leavebuzzer_limit")
+    return &Runtime::leavebuzzer_limit;
+  return nullptr;
+}
+
+// The format and the limit overrides of a run request.
+struct RunOptions {
+  World::ResultFormat format = World::ResultFormat::XML;
+  std::vector<std::pair<size_t Runtime::*, size_t>> limits;
+
+  // Parses one option. Returns an error message if it is not valid.
+  std::optional<std::string_view> Parse(std::string_view option) {
+    auto [name, value] = SplitOption(option);
+    if (name == "format") {
+      auto parsed_format = ParseFormat(value);
+      if (!parsed_format)
+        return "invalid format";
+      format = parsed_format.value();
+      return std::nullopt;
+    }
+    size_t Runtime::*limit = GetLimit(name);
+    size_t limit_value;
+    if (!limit || !ParseNumber(value, &limit_value))
+      return "invalid override";
+    limits.emplace_back(limit, limit_value);
+    return std::nullopt;
+  }
+
+  void Apply(Runtime* runtime) const {
+    for (const auto& [limit, value] : limits)
+      runtime->*limit = value;
+  }
+};
+
+// Prepares |frame| to hold a message, leaving room for its length.
+void BeginFrame(std::string* frame) {
+  frame->assign(sizeof(uint32_t), '\0');
+}
+
+// Fills in the length of a message started with BeginFrame() and sends it.
+bool WriteFrame(int fd, std::string* frame) {
+  uint32_t size = frame->size() - sizeof(uint32_t);
+  memcpy(frame->data(), &size, sizeof(size));
+  if (!WriteFileDescriptor(fd, *frame)) {
+    PLOG(ERROR) << "Failed to write response";
+    return false;
+  }
+  return true;
+}
+
+using RequestHandler =
+    std::function<void(std::string_view request, std::string* response)>;
+
+// Answers the requests read from |input_fd| with |handler| until the client
+// hangs up. Returns false if the connection broke.
+bool ServeRequests(int input_fd, int output_fd, RequestHandler handler) {
+  std::string request;
+  std::string response;
+  while (true) {
+    uint32_t size;
+    ssize_t bytes_read =
+        ReadFully(input_fd, reinterpret_cast<char*>(&size), sizeof(size));
+    if (bytes_read == 0)
+      return true;
+    if (bytes_read != sizeof(size)) {
+      PLOG(ERROR) << "Failed to read request";
+      return false;
+    }
+    if (size > kMaxFrameSize) {
+      LOG(ERROR) << "Request of " << size << " bytes is too large";
+      return false;
+    }
+    request.resize(size);
+    if (ReadFully(input_fd, request.data(), size) !=
+        static_cast<ssize_t>(size)) {
+      PLOG(ERROR) << "Failed to read request";
+      return false;
+    }
+
+    BeginFrame(&response);
+    handler(request, &response);
+    if (!WriteFrame(output_fd, &response))
+      return false;
+  }
+}
+
+// Splits a request into the words of its command line and its data.
+std::pair<std::vector<std::string_view>, std::string_view> ParseRequest(
+    std::string_view request) {
+  size_t newline = request.find('\n');
+  if (newline == std::string_view::npos)
+    return {};
+  return {Split(request.substr(0, newline)), request.substr(newline + 1)};
+}
+
+class Connection {
+ public:
+  Connection(Server* server, int input_fd, int output_fd)
+      : server_(server), input_fd_(input_fd), output_fd_(output_fd) {}
+
+  // Serves requests until the client hangs up. Returns false if the
+  // connection broke.
+  bool Serve() {
+    return ServeRequests(
+        input_fd_, output_fd_,
+        [this](std::string_view request, std::string* response) {
+          Handle(request, response);
+        });
+  }
+
+ private:
+  void Handle(std::string_view request, std::string* response) {
+    auto [command, data] = ParseRequest(request);
+    if (command.empty()) {
+      response->append("error missing command\n");
+      return;
+    }
+
+    if (command[0] == "program" || command[0] == "world") {
+      bool program = command[0] == "program";
+      auto key =
+          program ? server_->LoadProgram(data) : server_->LoadWorld(data);
+      if (!key) {
+        response->append(program ? "error invalid program\n"
+                                 : "error invalid world\n");
+        return;
+      }
+      response->append("ok ").append(key.value()).append("\n");
+    } else if (command[0] == "run") {
+      HandleRun(command, response);
+    } else if (command[0] == "fetch") {
+      uint64_t id;
+      auto it = results_.end();
+      if (command.size() == 2 && ParseNumber(command[1], &id))
+        it = results_.find(id);
+      if (it == results_.end()) {
+        response->append("error unknown result\n");
+        return;
+      }
+      response->append("ok\n").append(it->second);
+      results_.erase(it);
+    } else {
+      response->append("error unknown command\n");
+    }
+  }
+
+  void HandleRun(const std::vector<std::string_view>& command,
+                 std::string* response) {
+    if (command.size() < 3) {
+      response->append("error missing keys\n");
+      return;
+    }
+    auto program = server_->GetProgram(std::string(command[1]));
+    if (!program) {
+      response->append("error unknown program\n");
+      return;
+    }
+    auto image = server_->GetWorld(std::string(command[2]));
+    if (!image) {
+      response->append("error unknown world\n");
+      return;
+    }
+
+    RunOptions options;
+    for (size_t i = 3; i < command.size(); ++i) {
+      if (auto error = options.Parse(command[i])) {
+        response->append("error ").append(error.value()).append("\n");
+        return;
+      }
+    }
+
+    World world(std::move(image));
+    options.Apply(world.runtime());
+    RunResult result = karel::Run(program->instructions(), program->size(),
+                                  world.runtime(), &stacks_);
+    std::string output;
+    {
+      xml::Buffer buffer(&output);
+      world.DumpResult(result, options.format, &buffer);
+    }
+
+    uint64_t id = next_id_++;
+    results_.emplace(id, std::move(output));
+    if (results_.size() > kMaxPendingResults)
+      results_.erase(results_.begin());
+    response->append(StringPrintf("ok %" PRIu64 " %u\n", id,
+                                  static_cast<uint32_t>(result)));
+  }
+
+  Server* const server_;
+  const int input_fd_;
+  const int output_fd_;
+  ExecutionStacks stacks_;
+  uint64_t next_id_ = 0;
+  std::map<uint64_t, std::string> results_;
+
+  DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+// Loads the world at |path|, in either format.
+std::unique_ptr<World> LoadWorld(const std::string& path) {
+  std::shared_ptr<const WorldImage> image;
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd)
+    PLOG(ERROR) << "Failed to open " << path;
+  else
+    image = WorldImage::Parse(fd.get());
+  if (!image) {
+    LOG(ERROR) << "Failed to load " << path;
+    return nullptr;
+  }
+  return std::make_unique<World>(std::move(image));
+}
+
+// Serves run requests by forking a child for each of them, from a parent
+// that already holds an initialized world.
+class ForkServer {
+ public:
+  explicit ForkServer(std::unique_ptr<World> world)
+      : world_(std::move(world)) {}
+
+  bool Serve() {
+    return ServeRequests(
+        STDIN_FILENO, STDOUT_FILENO,
+        [this](std::string_view request, std::string* response) {
+          Handle(request, response);
+        });
+  }
+
+ private:
+  void Handle(std::string_view request, std::string* response) {
+    auto [command, data] = ParseRequest(request);
+    if (command.empty() || command[0] != "run") {
+      response->append("error unknown command\n");
+      return;
+    }
+    if (command.size() < 2) {
+      response->append("error missing program\n");
+      return;
+    }
+
+    std::string program_path(command[1]);
+    std::optional<std::string> world_path;
+    RunOptions options;
+    for (size_t i = 2; i < command.size(); ++i) {
+      auto [name, value] = SplitOption(command[i]);
+      if (name == "world") {
+        world_path = std::string(value);
+      } else if (auto error = options.Parse(command[i])) {
+        response->append("error ").append(error.value()).append("\n");
+        return;
+      }
+    }
+    if (!world_path && !world_) {
+      response->append("error missing world\n");
+      return;
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+      PLOG(ERROR) << "Failed to create pipe";
+      response->append("error internal\n");
+      return;
+    }
+    ScopedFD read_fd(pipe_fds[0]);
+    ScopedFD write_fd(pipe_fds[1]);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+      PLOG(ERROR) << "Failed to fork";
+      response->append("error internal\n");
+      return;
+    }
+    if (pid == 0) {
+      read_fd.reset();
+      _exit(RunChild(program_path, world_path, options, write_fd.get()));
+    }
+    write_fd.reset();
+
+    std::string output;
+    char buffer[4096];
+    while (true) {
+      ssize_t bytes_read =
+          HANDLE_EINTR(read(read_fd.get(), buffer, sizeof(buffer)));
+      if (bytes_read <= 0) {
+        if (bytes_read == -1)
+          PLOG(ERROR) << "Failed to read the result";
+        break;
+      }
+      output.append(buffer, bytes_read);
+    }
+
+    int status;
+    rusage usage;
+    if (HANDLE_EINTR(wait4(pid, &status, 0, &usage)) == -1) {
+      PLOG(ERROR) << "Failed to wait for " << pid;
+      response->append("error internal\n");
+      return;
+    }
+    response->append(StringPrintf(
+        "ok %s %d %" PRId64 " %" PRId64 " %ld\n",
+        WIFSIGNALED(status) ? "signal" : "exit",
+        WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+        Microseconds(usage.ru_utime), Microseconds(usage.ru_stime),
+        usage.ru_maxrss));
+    response->append(output);
+  }
+
+  // Runs in the child. Returns its exit code.
+  int RunChild(const std::string& program_path,
+               const std::optional<std::string>& world_path,
+               const RunOptions& options,
+               int output_fd) {
+    std::optional<Program> program;
+    ScopedFD program_fd(open(program_path.c_str(), O_RDONLY));
+    if (!program_fd) {
+      PLOG(ERROR) << "Failed to open " << program_path;
+      return -1;
+    }
+    auto program_contents = FileContents::Read(program_fd.get());
+    if (program_contents)
+      program = Program::Parse(std::move(program_contents.value()));
+    if (!program) {
+      LOG(ERROR) << "Failed to load " << program_path;
+      return -1;
+    }
+
+    // The pre-loaded world is a copy-on-write copy of the parent's, so it can
+    // be run on directly.
+    std::unique_ptr<World> world;
+    World* target = world_.get();
+    if (world_path) {
+      world = LoadWorld(world_path.value());
+      if (!world)
+        return -1;
+      target = world.get();
+    }
+
+    options.Apply(target->runtime());
+    RunResult result = karel::Run(program->instructions(), program->size(),
+                                  target->runtime());
+    {
+      xml::Buffer buffer(output_fd);
+      target->DumpResult(result, options.format, &buffer);
+    }
+    return static_cast<int>(result);
+  }
+
+  static int64_t Microseconds(const timeval& time) {
+    return static_cast<int64_t>(time.tv_sec) * 1000000 + time.tv_usec;
+  }
+
+  std::unique_ptr<World> world_;
+
+  DISALLOW_COPY_AND_ASSIGN(ForkServer);
+};
+
+bool ServeSocket(std::shared_ptr<Server> server, const std::string& path) {
+  // Clients that hang up should only end their own connection.
+  signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    LOG(ERROR) << "Socket path is too long: " << path;
+    return false;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  ScopedFD listener(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (!listener) {
+    PLOG(ERROR) << "Failed to create socket";
+    return false;
+  }
+  if (unlink(path.c_str()) == -1 && errno != ENOENT)
+    PLOG(WARN) << "Failed to remove " << path;
+  if (bind(listener.get(), reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address)) == -1) {
+    PLOG(ERROR) << "Failed to bind " << path;
+    return false;
+  }
+  if (listen(listener.get(), SOMAXCONN) == -1) {
+    PLOG(ERROR) << "Failed to listen on " << path;
+    return false;
+  }
+
+  while (true) {
+    int fd = HANDLE_EINTR(accept4(listener.get(), nullptr, nullptr,
+                                  SOCK_CLOEXEC));
+    if (fd == -1) {
+      PLOG(ERROR) << "Failed to accept a connection";
+      if (errno == ECONNABORTED)
+        continue;
+      if (errno == EMFILE || errno == ENFILE) {
+        // The connection stays in the backlog, so accepting again right away
+        // would fail the same way until a descriptor is freed.
+        std::this_thread::sleep_for(kAcceptBackoff);
+        continue;
+      }
+      return false;
+    }
+    // The connection keeps the server alive for as long as it runs.
+    std::thread([server, fd]() {
+      ScopedFD connection_fd(fd);
+      Connection(server.get(), fd, fd).Serve();
+    }).detach();
+  }
+}
+
+}  // namespace
+
+bool Serve(const std::optional<std::string>& socket_path) {
+  auto server = std::make_shared<Server>();
+  if (socket_path)
+    return ServeSocket(std::move(server), socket_path.value());
+  return Connection(server.get(), STDIN_FILENO, STDOUT_FILENO).Serve();
+}
+
+bool ForkServe(const std::optional<std::string>& world_path) {
+  std::unique_ptr<World> world;
+  if (world_path) {
+    world = LoadWorld(world_path.value());
+    if (!world)
+      return false;
+  }
+  return ForkServer(std::move(world)).Serve();
+}
+
+}  // namespace karel
@@ -0,0 +1,58 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <optional>
+#include <string>
+
+namespace karel {
+
+// Runs a judge daemon that keeps parsed programs and worlds resident, in LRU
+// caches keyed by the hash of their contents, so that clients only pay for
+// parsing once.
+//
+// Every message, in both directions, is a frame: a little-endian uint32 length
+// followed by that many bytes. A request starts with a command line ended by
+// '\n', followed by the data of the command. A response starts with either
+// "ok" or "error <message>", ended by '\n', followed by its data:
+//
+//  * "program\n<.kx or .kxb>" loads a program and answers "ok <key>\n".
+//  * "world\n<world>" loads a world, in either format, and answers
+//    "ok <key>\n".
+//  * "run <program key> <world key> [format=xml|json|binary|delta]
+//    [<limit>=<value>...]\n" runs a loaded program on a fresh copy of a loaded
+//    world, overriding any of its instruction_limit, stack_limit,
+//    forward_limit, left_limit, pickbuzzer_limit and leavebuzzer_limit. It
+//    answers "ok <id> <exit code>\n", with the exit code that karel would
+//    have.
+//  * "fetch <id>\n" answers "ok\n" followed by the result of run <id>, which
+//    is then forgotten.
+//
+// Keys that were evicted from the caches are answered with an error, and the
+// client is expected to load them again.
+//
+// With |socket_path|, connections are accepted on a Unix socket and served
+// concurrently, sharing the caches. Otherwise, a single client is served
+// over stdin and stdout. Returns false if the server could not be started
+// or a connection failed.
+bool Serve(const std::optional<std::string>& socket_path);
+
+// Runs a fork server over stdin and stdout, using the same framing as Serve().
+// The parent initializes itself once, pre-loading the world at |world_path| if
+// there is one, and forks a child for each request, which loads the program,
+// runs it, writes the result and exits. Since the child runs on its own
+// copy-on-write view of the parent, crashes and leaks cannot outlive a run.
+//
+// The only request is "run <program path> [world=<path>]
+// [format=xml|json|binary|delta] [<limit>=<value>...]\n", where the world
+// defaults to the pre-loaded one and the limits are the ones of Serve(). Paths
+// cannot contain whitespace. It answers "ok exit|signal <status> <user us>
+// <system us> <max rss kB>\n", with how the child ended and the resources it
+// used, followed by the result that it wrote. An exit status of 255 means that
+// the program or the world could not be loaded.
+//
+// Returns false if the world could not be loaded or the connection failed.
+bool ForkServe(const std::optional<std::string>& world_path);
+
+}  // namespace karel
+
+#endif  // SERVE_H_
@@ -0,0 +1,304 @@
+#include "sweep.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "karel.h"
+#include "logging.h"
+#include "util.h"
+
+namespace karel {
+
+namespace {
+
+// How many consecutive seeds a worker takes at a time.
+constexpr uint64_t kChunkSize = 256;
+constexpr size_t kResultCount = static_cast<size_t>(RunResult::STACK) + 1;
+
+constexpr std::string_view kOrientations[] = {"OESTE", "NORTE", "ESTE",
+                                              "SUR"};
+
+// SplitMix64, which is cheap to seed, so that every variant can have its own
+// generator.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed) {}
+
+  uint64_t Next() {
+    uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  // Returns a number in [min, max].
+  uint64_t Uniform(uint64_t min, uint64_t max) {
+    uint64_t range = max - min + 1;
+    return range == 0 ? Next() : min + Next() % range;
+  }
+
+  bool Chance(double probability) {
+    return static_cast<double>(Next() >> 11) * 0x1.0p-53 < probability;
+  }
+
+ private:
+  uint64_t state_;
+};
+
+std::vector<std::string_view> Tokenize(std::string_view line) {
+  std::vector<std::string_view> tokens;
+  while (true) {
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos)
+      break;
+    line.remove_prefix(begin);
+    size_t end = std::min(line.find_first_of(" \t\r"), line.size());
+    tokens.push_back(line.substr(0, end));
+    line.remove_prefix(end);
+  }
+  return tokens;
+}
+
+// What the workers of a sweep have seen so far.
+struct Tally {
+  uint64_t counts[kResultCount] = {};
+  uint64_t first_seeds[kResultCount];
+  std::vector<uint64_t> instructions;
+
+  Tally() {
+    std::fill(std::begin(first_seeds), std::end(first_seeds),
+              std::numeric_limits<uint64_t>::max());
+  }
+
+  void Merge(Tally* other) {
+    for (size_t i = 0; i < kResultCount; ++i) {
+      counts[i] += other->counts[i];
+      first_seeds[i] = std::min(first_seeds[i], other->first_seeds[i]);
+    }
+    instructions.insert(instructions.end(), other->instructions.begin(),
+                        other->instructions.end());
+  }
+};
+
+}  // namespace
+
+SweepSpec::SweepSpec() = default;
+SweepSpec::SweepSpec(SweepSpec&&) = default;
+SweepSpec::~SweepSpec() = default;
+
+// static
+std::optional<SweepSpec> SweepSpec::Parse(std::string_view spec,
+                                          const WorldImage& base) {
+  SweepSpec result;
+  size_t line_number = 0;
+  while (!spec.empty()) {
+    size_t newline = std::min(spec.find('\n'), spec.size());
+    std::string_view line = spec.substr(0, newline);
+    spec.remove_prefix(std::min(newline + 1, spec.size()));
+    ++line_number;
+    line = line.substr(0, line.find('#'));
+    std::vector<std::string_view> tokens = Tokenize(line);
+    if (tokens.empty())
+      continue;
+
+    // Reads the rectangle in tokens[1..4], converted to 0-based coordinates.
+    auto parse_area = [&tokens, &base](Rectangle* area) {
+      auto x1 = ParseString<size_t>(tokens[1]),
+           y1 = ParseString<size_t>(tokens[2]),
+           x2 = ParseString<size_t>(tokens[3]),
+           y2 = ParseString<size_t>(tokens[4]);
+      if (!x1 || !y1 || !x2 || !y2 || *x1 == 0 || *y1 == 0 || *x1 > *x2 ||
+          *y1 > *y2 || *x2 > base.width() || *y2 > base.height()) {
+        return false;
+      }
+      *area = Rectangle{*x1 - 1, *y1 - 1, *x2 - 1, *y2 - 1};
+      return true;
+    };
+    auto parse_range = [](std::string_view min_token,
+                          std::string_view max_token, Directive* directive) {
+      auto min = ParseString<uint32_t>(min_token),
+           max = ParseString<uint32_t>(max_token);
+      if (!min || !max || *min > *max)
+        return false;
+      directive->min = *min;
+      directive->max = *max;
+      return true;
+    };
+
+    Directive directive{};
+    bool valid = false;
+    std::string_view name = tokens[0];
+    if (name == "seeds" && tokens.size() == 3) {
+      auto first = ParseString<uint64_t>(tokens[1]),
+           count = ParseString<uint64_t>(tokens[2]);
+      if (first && count && *count > 0) {
+        result.first_seed_ = *first;
+        result.count_ = *count;
+        continue;
+      }
+    } else if (name == "buzzers" && tokens.size() == 7) {
+      directive.type = Directive::Type::BUZZERS;
+      valid = parse_area(&directive.area) &&
+              parse_range(tokens[5], tokens[6], &directive);
+    } else if (name == "walls" && tokens.size() == 6) {
+      directive.type = Directive::Type::WALLS;
+      auto density = ParseString<double>(tokens[5]);
+      valid = parse_area(&directive.area) && density && *density >= 0 &&
+              *density <= 1;
+      if (valid)
+        directive.density = *density;
+    } else if (name == "start" && tokens.size() == 5) {
+      directive.type = Directive::Type::START;
+      valid = parse_area(&directive.area);
+    } else if (name == "orientation" && tokens.size() >= 2) {
+      directive.type = Directive::Type::ORIENTATION;
+      valid = true;
+      for (size_t i = 1; i < tokens.size(); ++i) {
+        auto it = std::find(std::begin(kOrientations), std::end(kOrientations),
+                            tokens[i]);
+        if (it == std::end(kOrientations))
+          valid = false;
+        else
+          directive.orientations.push_back(it - std::begin(kOrientations));
+      }
+    } else if (name == "bag" && tokens.size() == 3) {
+      directive.type = Directive::Type::BAG;
+      valid = parse_range(tokens[1], tokens[2], &directive);
+    }
+    if (!valid) {
+      LOG(ERROR) << "Invalid sweep directive in line " << line_number << ": "
+                 << line;
+      return std::nullopt;
+    }
+    result.directives_.emplace_back(std::move(directive));
+  }
+  return std::make_optional<SweepSpec>(std::move(result));
+}
+
+void SweepSpec::Generate(uint64_t seed, WorldImage* variant) const {
+  Random random(seed);
+  Runtime* runtime = variant->mutable_runtime();
+  for (const auto& directive : directives_) {
+    const Rectangle& area = directive.area;
+    switch (directive.type) {
+      case Directive::Type::BUZZERS:
+        for (size_t y = area.y1; y <= area.y2; ++y) {
+          for (size_t x = area.x1; x <= area.x2; ++x) {
+            variant->set_buzzers(
+                x, y, random.Uniform(directive.min, directive.max));
+          }
+        }
+        break;
+
+      case Directive::Type::WALLS:
+        for (size_t y = area.y1; y <= area.y2; ++y) {
+          for (size_t x = area.x1; x <= area.x2; ++x) {
+            // The walls to the east and to the north of each cell.
+            if (x < area.x2 && random.Chance(directive.density))
+              variant->AddWall(x, y, 2);
+            if (y < area.y2 && random.Chance(directive.density))
+              variant->AddWall(x, y, 1);
+          }
+        }
+        break;
+
+      case Directive::Type::START:
+        runtime->x = random.Uniform(area.x1, area.x2);
+        runtime->y = random.Uniform(area.y1, area.y2);
+        break;
+
+      case Directive::Type::ORIENTATION:
+        runtime->orientation = directive.orientations[random.Uniform(
+            0, directive.orientations.size() - 1)];
+        break;
+
+      case Directive::Type::BAG:
+        runtime->bag = random.Uniform(directive.min, directive.max);
+        break;
+    }
+  }
+}
+
+void RunSweep(const Program& program,
+              std::shared_ptr<const WorldImage> base,
+              const SweepSpec& spec,
+              const SweepOptions& options) {
+  std::atomic<uint64_t> next_chunk{0};
+  const uint64_t chunk_count = (spec.count() + kChunkSize - 1) / kChunkSize;
+  std::mutex mutex;
+  Tally total;
+  total.instructions.reserve(spec.count());
+
+  auto work = [&]() {
+    Tally tally;
+    std::shared_ptr<WorldImage> variant = base->Clone();
+    ExecutionStacks stacks;
+    for (uint64_t chunk = next_chunk++; chunk < chunk_count;
+         chunk = next_chunk++) {
+      uint64_t begin = chunk * kChunkSize;
+      uint64_t end = std::min(spec.count(), begin + kChunkSize);
+      for (uint64_t i = begin; i < end; ++i) {
+        uint64_t seed = spec.first_seed() + i;
+        variant->CopyFrom(*base);
+        spec.Generate(seed, variant.get());
+        World world(variant);
+        RunResult result = karel::Run(program.instructions(), program.size(),
+                                      world.runtime(), &stacks);
+        size_t index = static_cast<size_t>(result);
+        tally.counts[index]++;
+        tally.first_seeds[index] = std::min(tally.first_seeds[index], seed);
+        tally.instructions.push_back(world.runtime()->instruction_count);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    total.Merge(&tally);
+  };
+
+  std::vector<std::thread> workers;
+  size_t jobs = std::clamp<uint64_t>(options.jobs, 1, chunk_count);
+  for (size_t i = 1; i < jobs; ++i)
+    workers.emplace_back(work);
+  work();
+  for (auto& worker : workers)
+    worker.join();
+
+  printf("variants %" PRIu64 "\n", spec.count());
+  for (size_t i = 0; i < kResultCount; ++i) {
+    if (total.counts[i] == 0)
+      continue;
+    std::string_view name =
+        World::ExecutionResultName(static_cast<RunResult>(i));
+    printf("result \"%.*s\" %" PRIu64 " %.3f%% first seed %" PRIu64 "\n",
+           static_cast<int>(name.size()), name.data(), total.counts[i],
+           100.0 * total.counts[i] / spec.count(), total.first_seeds[i]);
+  }
+
+  std::vector<uint64_t>& instructions = total.instructions;
+  if (instructions.empty())
+    return;
+  std::sort(instructions.begin(), instructions.end());
+  // Nearest-rank percentiles.
+  auto percentile = [&instructions](double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100 * instructions.size()));
+    return instructions[std::clamp<size_t>(rank, 1, instructions.size()) - 1];
+  };
+  uint64_t sum = 0;
+  for (uint64_t count : instructions)
+    sum += count;
+  printf("instructions min %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64
+         " p99 %" PRIu64 " max %" PRIu64 " mean %.1f\n",
+         instructions.front(), percentile(50), percentile(90), percentile(99),
+         instructions.back(),
+         static_cast<double>(sum) / instructions.size());
+}
+
+}  // namespace karel
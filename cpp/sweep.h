@@ -0,0 +1,90 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "macros.h"
+#include "program.h"
+#include "world.h"
+
+namespace karel {
+
+// Describes how to derive variants from a base world, one per seed. A spec
+// has one directive per line, and '#' starts a comment. Coordinates are
+// 1-based and rectangles are inclusive, like in world files:
+//
+//  * "seeds <first> <count>": the seeds of the variants, at least one.
+//    Defaults to 1000 seeds starting at 0.
+//  * "buzzers <x1> <y1> <x2> <y2> <min> <max>": every cell of the rectangle
+//    gets between min and max buzzers, or INFINITO.
+//  * "walls <x1> <y1> <x2> <y2> <density>": every wall between two cells of
+//    the rectangle is added with probability density.
+//  * "start <x1> <y1> <x2> <y2>": Karel starts anywhere in the rectangle.
+//  * "orientation <direction>...": Karel starts facing any of OESTE, NORTE,
+//    ESTE and SUR.
+//  * "bag <min> <max>": Karel starts with between min and max buzzers, or
+//    INFINITO.
+//
+// Directives are applied in order over the base world, so later ones win.
+// A variant only depends on the spec, the base world and its seed.
+class SweepSpec {
+ public:
+  SweepSpec(SweepSpec&&);
+  ~SweepSpec();
+
+  static std::optional<SweepSpec> Parse(std::string_view spec,
+                                        const WorldImage& base);
+
+  uint64_t first_seed() const { return first_seed_; }
+  uint64_t count() const { return count_; }
+
+  // Turns |variant|, a copy of the base world, into the variant of |seed|.
+  void Generate(uint64_t seed, WorldImage* variant) const;
+
+ private:
+  struct Rectangle {
+    size_t x1;
+    size_t y1;
+    size_t x2;
+    size_t y2;
+  };
+
+  struct Directive {
+    enum class Type { BUZZERS, WALLS, START, ORIENTATION, BAG };
+    Type type;
+    Rectangle area;
+    uint64_t min;
+    uint64_t max;
+    double density;
+    std::vector<size_t> orientations;
+  };
+
+  SweepSpec();
+
+  uint64_t first_seed_ = 0;
+  uint64_t count_ = 1000;
+  std::vector<Directive> directives_;
+
+  DISALLOW_COPY_AND_ASSIGN(SweepSpec);
+};
+
+struct SweepOptions {
+  // How many variants are run at the same time.
+  size_t jobs = 1;
+};
+
+// Runs |program| against every variant of |base| described by |spec|,
+// generating them in memory, and writes a report to stdout: how many runs
+// ended with each result, with the first seed that did, and the
+// percentiles of the number of executed instructions.
+void RunSweep(const Program& program,
+              std::shared_ptr<const WorldImage> base,
+              const SweepSpec& spec,
+              const SweepOptions& options);
+
+}  // namespace karel
+
+#endif  // SWEEP_H_
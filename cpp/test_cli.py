@@ -0,0 +1,689 @@
+#!/usr/bin/python3
+# -*- coding: utf-8 -*-
+
+'''Run end-to-end tests of the modes of the karel binary.'''
+
+import csv
+import glob
+import json
+import os
+import os.path
+import socket
+import struct
+import subprocess
+import time
+
+import pytest
+
+_CPP = os.path.abspath(os.path.dirname(__file__))
+_ROOT = os.path.dirname(_CPP)
+_KAREL = os.path.join(_CPP, 'karel')
+_PROBLEMS = os.path.join(_ROOT, 'test', 'problems')
+_MDOKEC = os.path.join(_ROOT, 'test', 'mdokec')
+_TIMEOUT = 60  # seconds
+
+# Problems whose solutions touch walls, buzzers and the bag.
+_CASES = ('baches', 'charcos', 'pintor')
+_FORMATS = ('xml', 'json', 'binary')
+
+# Programs that end with a given RunResult, to cover more than OK.
+_WALL_SOURCE = '''class program {
+  program() {
+    iterate (1000) move();
+    turnoff();
+  }
+}
+'''
+_FOREVER_SOURCE = '''class program {
+  program() {
+    while (facingNorth || notFacingNorth) turnleft();
+  }
+}
+'''
+_PICK_SOURCE = '''class program {
+  program() {
+    pickbeeper();
+    turnoff();
+  }
+}
+'''
+
+# The layout of the KXB1 and KWB1 headers, from program.h and world.h.
+_KXB_SECTIONS_OFFSET = 0x20
+_KWB_ORIENTATION_OFFSET = 16
+_KWB_X_OFFSET = 24
+
+
+def _run(*args, stdin=b'', cwd=None):
+    '''Runs karel and returns its exit code and its output.'''
+    process = subprocess.run([_KAREL, *args],
+                             input=stdin,
+                             stdout=subprocess.PIPE,
+                             stderr=subprocess.DEVNULL,
+                             cwd=cwd,
+                             timeout=_TIMEOUT,
+                             check=False)
+    return process.returncode, process.stdout
+
+
+def _read(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def _write(path, contents):
+    with open(path, 'wb') as f:
+        f.write(contents)
+    return path
+
+
+def _case_inputs(problem, limit=3):
+    return sorted(glob.glob(os.path.join(_PROBLEMS, problem, 'cases',
+                                         '*.in')))[:limit]
+
+
+@pytest.fixture(scope='module', name='programs')
+def _programs(tmp_path_factory):
+    '''Compiles the solutions and the inline programs to KXB1.'''
+    directory = tmp_path_factory.mktemp('programs')
+    sources = {
+        problem: os.path.join(_PROBLEMS, problem, 'sol.txt')
+        for problem in _CASES
+    }
+    for name, source in (('wall', _WALL_SOURCE), ('forever', _FOREVER_SOURCE),
+                         ('pick', _PICK_SOURCE)):
+        sources[name] = _write(str(directory / f'{name}.txt'),
+                               source.encode())
+    programs = {}
+    for name, source in sources.items():
+        programs[name] = str(directory / f'{name}.kxb')
+        assert _run(f'--source={source}',
+                    f'--compile={programs[name]}')[0] == 0
+    return programs
+
+
+def test_heatmap(programs, tmp_path):
+    '''The heatmap adds up to the counters of the result.'''
+    for problem in _CASES:
+        for path in _case_inputs(problem):
+            world = _read(path)
+            csv_path = str(tmp_path / 'heatmap.csv')
+            bin_path = str(tmp_path / 'heatmap.bin')
+            code, output = _run('--format=json', f'--heatmap={csv_path}',
+                                programs[problem], stdin=world)
+            assert code == 0
+            assert _run('--format=json', f'--heatmap={bin_path}',
+                        programs[problem], stdin=world) == (code, output)
+            counters = json.loads(output)['instructions']
+
+            with open(csv_path, encoding='utf-8') as f:
+                rows = list(csv.DictReader(f))
+            for column, counter in (('visits', 'forward'),
+                                    ('picks', 'pickbuzzer'),
+                                    ('leaves', 'leavebuzzer')):
+                assert sum(int(row[column])
+                           for row in rows) == counters[counter]
+
+            heatmap = _read(bin_path)
+            assert heatmap[:4] == b'KHM1'
+            width, height = struct.unpack_from('<II', heatmap, 4)
+            assert len(heatmap) == 12 + 12 * width * height
+            cells = struct.unpack_from(f'<{3 * width * height}I', heatmap, 12)
+            # The CSV only lists the cells that were touched.
+            touched = {}
+            for row in rows:
+                cell = (int(row['y']) - 1) * width + int(row['x']) - 1
+                touched[cell] = (int(row['visits']), int(row['picks']),
+                                 int(row['leaves']))
+            for cell in range(width * height):
+                assert cells[3 * cell:3 * cell + 3] == touched.get(
+                    cell, (0, 0, 0))
+
+
+def test_kxb_round_trip(programs, tmp_path):
+    '''Compiled programs run like their sources.'''
+    for problem in _CASES:
+        source = os.path.join(_PROBLEMS, problem, 'sol.txt')
+        for path in _case_inputs(problem):
+            world = _read(path)
+            assert (_run(programs[problem], stdin=world) == _run(
+                f'--source={source}', stdin=world))
+            expected = _read(path[:-len('.in')] + '.out')
+            assert (_run(programs[problem], stdin=world)[1].rstrip() ==
+                    expected.replace(b'\r', b'').rstrip())
+
+    # A .kx program is compiled into the cache directory the first time and
+    # read back from it later, and a corrupt cache entry is ignored.
+    kx = _write(str(tmp_path / 'program.kx'),
+                b'[["LINE",1],["LEFT"],["LINE",2],["LEFT"],["HALT"]]')
+    cache = tmp_path / 'cache'
+    cache.mkdir()
+    world = _read(_case_inputs('baches')[0])
+    expected = _run(kx, stdin=world)
+    assert expected[0] == 0
+    assert _run(f'--cache-dir={cache}', kx, stdin=world) == expected
+    entries = list(cache.iterdir())
+    assert len(entries) == 1
+    assert _run(f'--cache-dir={cache}', kx, stdin=world) == expected
+    _write(str(entries[0]), b'KXB1 truncated')
+    assert _run(f'--cache-dir={cache}', kx, stdin=world) == expected
+
+
+def _patch_instruction(program, index, opcode, arg):
+    '''Overwrites one instruction of a KXB1 program.'''
+    (_, _, offset) = struct.unpack_from('<IIQ', program, _KXB_SECTIONS_OFFSET)
+    patched = bytearray(program)
+    struct.pack_into('<Ii', patched, offset + 8 * index, opcode, arg)
+    return bytes(patched)
+
+
+def test_kxb_validation(programs, tmp_path):
+    '''Binary programs with invalid instructions are rejected.'''
+    program = _read(programs['baches'])
+    world = _read(_case_inputs('baches')[0])
+    for name, (opcode, arg) in {
+            'opcode': (0xffff, 0),
+            'ez': (12, 99),
+            'jump': (14, 1 << 30),
+            'call': (25, -5),
+    }.items():
+        path = _write(str(tmp_path / f'{name}.kxb'),
+                      _patch_instruction(program, 0, opcode, arg))
+        assert _run(path, stdin=world)[0] == 255, name
+    assert _run(_write(str(tmp_path / 'short.kxb'), program[:40]),
+                stdin=world)[0] == 255
+
+
+def test_kwb_round_trip(programs, tmp_path):
+    '''Compiled worlds run and dump like their sources.'''
+    for problem in _CASES:
+        for path in _case_inputs(problem):
+            kwb = str(tmp_path / 'world.kwb')
+            assert _run(f'--compile-world={kwb}', stdin=_read(path))[0] == 0
+            for args in ([f'--format={f}'] for f in _FORMATS):
+                assert (_run(*args, programs[problem],
+                             stdin=_read(kwb)) == _run(*args,
+                                                       programs[problem],
+                                                       stdin=_read(path)))
+            assert (_run('--dump=world', programs[problem],
+                         stdin=_read(kwb)) == _run('--dump=world',
+                                                   programs[problem],
+                                                   stdin=_read(path)))
+
+
+def test_kwb_validation(programs, tmp_path):
+    '''Binary worlds with an invalid header are rejected.'''
+    kwb = str(tmp_path / 'world.kwb')
+    assert _run(f'--compile-world={kwb}',
+                stdin=_read(_case_inputs('baches')[0]))[0] == 0
+    world = _read(kwb)
+    for offset, value in ((_KWB_ORIENTATION_OFFSET, 4), (_KWB_X_OFFSET,
+                                                         1 << 20)):
+        patched = bytearray(world)
+        struct.pack_into('<Q', patched, offset, value)
+        assert _run(programs['baches'], stdin=bytes(patched))[0] == 255
+    assert _run(programs['baches'], stdin=world[:12])[0] == 255
+
+
+def test_mdo_kec(programs, tmp_path):
+    '''Worlds from .mdo and .kec files match their .in counterparts.'''
+    mdo = os.path.join(_MDOKEC, 'apagón.mdo')
+    kec = os.path.join(_MDOKEC, 'apagón.kec')
+    world = _read(os.path.join(_MDOKEC, 'apagón.in'))
+    for name in ('baches', 'wall', 'forever'):
+        for args in (['--dump=world'], *([f'--format={f}'] for f in _FORMATS)):
+            assert (_run(*args, f'--mdo={mdo}', f'--kec={kec}',
+                         programs[name]) == _run(*args, programs[name],
+                                                 stdin=world))
+    from_mdo = str(tmp_path / 'mdo.kwb')
+    from_in = str(tmp_path / 'in.kwb')
+    assert _run(f'--compile-world={from_mdo}', f'--mdo={mdo}',
+                f'--kec={kec}')[0] == 0
+    assert _run(f'--compile-world={from_in}', stdin=world)[0] == 0
+    assert _read(from_mdo) == _read(from_in)
+
+
+def test_delta(programs, tmp_path):
+    '''Applying a delta to its world gives the full result.'''
+    for name in (*_CASES, 'wall', 'pick'):
+        problem = name if name in _CASES else 'baches'
+        for path in _case_inputs(problem):
+            world = _read(path)
+            code, delta = _run('--format=delta', programs[name], stdin=world)
+            delta_path = _write(str(tmp_path / 'result.delta'), delta)
+            for result_format in _FORMATS:
+                expected = _run(f'--format={result_format}', programs[name],
+                                stdin=world)
+                assert expected[0] == code
+                assert _run(f'--format={result_format}',
+                            f'--apply-delta={delta_path}',
+                            stdin=world)[1] == expected[1]
+
+
+def test_digest(programs):
+    '''Digests match exactly when the results match.'''
+    digests = {}
+    for problem in _CASES:
+        for path in _case_inputs(problem, limit=10):
+            world = _read(path)
+            code, output = _run('--digest', programs[problem], stdin=world)
+            assert code == 0
+            digest = output.decode().strip()
+            assert len(digest) == 16
+            int(digest, 16)
+            assert _run(f'--digest={digest}', programs[problem],
+                        stdin=world)[0] == 0
+            wrong = f'{int(digest, 16) ^ 1:016x}'
+            assert _run(f'--digest={wrong}', programs[problem],
+                        stdin=world) == (1, output)
+            xml = _run(programs[problem], stdin=world)[1]
+            assert digests.setdefault(digest, xml) == xml
+    assert len(set(digests.values())) == len(digests)
+
+
+def _frame(payload):
+    return struct.pack('<I', len(payload)) + payload
+
+
+def _unframe(stream):
+    '''Splits the framed responses of a server.'''
+    responses = []
+    while stream:
+        assert len(stream) >= 4
+        (size, ) = struct.unpack_from('<I', stream)
+        responses.append(stream[4:4 + size])
+        assert len(responses[-1]) == size
+        stream = stream[4 + size:]
+    return responses
+
+
+def _serve(*requests, args=('--serve', )):
+    '''Sends |requests| to a server over stdin and returns its responses.'''
+    code, output = _run(*args, stdin=b''.join(_frame(r) for r in requests))
+    assert code == 0
+    return _unframe(output)
+
+
+def _header(response):
+    return response.split(b'\n', 1)[0].decode()
+
+
+def test_serve(programs, tmp_path):
+    '''The server caches programs and worlds and runs them.'''
+    program = _read(programs['baches'])
+    world = _read(_case_inputs('baches')[0])
+    responses = _serve(
+        b'program\n' + program,
+        b'world\n' + world,
+        b'program\n' + program,
+    )
+    assert len(responses) == 3
+    assert responses[0].startswith(b'ok ')
+    assert responses[1].startswith(b'ok ')
+    assert responses[0] == responses[2]
+    program_key = responses[0][3:].strip()
+    world_key = responses[1][3:].strip()
+    run = b'run ' + program_key + b' ' + world_key
+
+    responses = _serve(
+        b'program\n' + program,
+        b'world\n' + world,
+        run + b'\n',
+        b'fetch 0\n',
+        b'fetch 0\n',
+        run + b' format=json\n',
+        run + b' format=delta instruction_limit=1\n',
+        b'fetch 1\n',
+        b'fetch 2\n',
+        b'fetch 7\n',
+    )
+    assert responses[2] == b'ok 0 0\n'
+    assert responses[3] == b'ok\n' + _run(programs['baches'], stdin=world)[1]
+    assert responses[4] == b'error unknown result\n'
+    assert responses[5] == b'ok 1 0\n'
+    assert responses[6] == b'ok 2 1\n'
+    assert responses[7] == b'ok\n' + _run(
+        '--format=json', programs['baches'], stdin=world)[1]
+    delta = responses[8].split(b'\n', 1)[1]
+    assert delta.startswith(b'KRD1')
+    assert responses[9] == b'error unknown result\n'
+
+    responses = _serve(
+        b'program\n' + program,
+        b'world\n' + world,
+        b'program\nnot a program',
+        b'world\nKWB1',
+        b'run 0 ' + world_key + b'\n',
+        b'run ' + program_key + b' 0\n',
+        b'run ' + program_key + b'\n',
+        run + b' format=yaml\n',
+        run + b' instruction_limit=x\n',
+        b'launch\n',
+        b'run',
+    )
+    assert [_header(r) for r in responses[2:]] == [
+        'error invalid program',
+        'error invalid world',
+        'error unknown program',
+        'error unknown world',
+        'error missing keys',
+        'error invalid format',
+        'error invalid override',
+        'error unknown command',
+        'error missing command',
+    ]
+
+    # Binary worlds start in the middle of their request, at an offset that
+    # keeps nothing aligned.
+    kwb = str(tmp_path / 'world.kwb')
+    assert _run(f'--compile-world={kwb}', stdin=world)[0] == 0
+    responses = _serve(b'program\n' + program, b'world\n' + _read(kwb))
+    assert responses[0].startswith(b'ok ')
+    assert responses[1].startswith(b'ok ')
+    responses = _serve(
+        b'program\n' + program,
+        b'world\n' + _read(kwb),
+        b'run ' + responses[0][3:].strip() + b' ' + responses[1][3:].strip() +
+        b'\n',
+        b'fetch 0\n',
+    )
+    assert responses[2:] == [
+        b'ok 0 0\n',
+        b'ok\n' + _run(programs['baches'], stdin=world)[1],
+    ]
+
+
+def test_serve_eviction(programs):
+    '''The server forgets the least recently used worlds first.'''
+    program = _read(programs['baches'])
+    world = _read(_case_inputs('baches')[0]).decode()
+    assert 'mochilaKarel="INFINITO"' in world
+    worlds = [
+        world.replace('mochilaKarel="INFINITO"',
+                      f'mochilaKarel="{1000 + i}"').encode()
+        for i in range(258)
+    ]
+    # The cache holds 256 worlds. Running the first one makes the second the
+    # least recently used, so it is the one that the 257th world evicts.
+    responses = _serve(b'program\n' + program,
+                       *(b'world\n' + w for w in worlds[:256]))
+    keys = [r[3:].strip() for r in responses]
+    assert all(r.startswith(b'ok ') for r in responses)
+    program_key, world_keys = keys[0], keys[1:]
+    assert len(set(world_keys)) == 256
+
+    def run(key):
+        return b'run ' + program_key + b' ' + key + b'\n'
+
+    responses = _serve(
+        b'program\n' + program,
+        *(b'world\n' + w for w in worlds[:256]),
+        run(world_keys[0]),
+        b'world\n' + worlds[256],
+        run(world_keys[0]),
+        run(world_keys[1]),
+        run(world_keys[2]),
+    )
+    responses = responses[257:]
+    assert [_header(r) for r in responses[:1] + responses[2:]] == [
+        'ok 0 0',
+        'ok 1 0',
+        'error unknown world',
+        'ok 2 0',
+    ]
+
+
+def _send(connection, request):
+    connection.sendall(_frame(request))
+    header = b''
+    while len(header) < 4:
+        chunk = connection.recv(4 - len(header))
+        assert chunk
+        header += chunk
+    (size, ) = struct.unpack('<I', header)
+    response = b''
+    while len(response) < size:
+        chunk = connection.recv(size - len(response))
+        assert chunk
+        response += chunk
+    return response
+
+
+def test_serve_socket(programs, tmp_path):
+    '''Connections to a socket share the caches but not the results.'''
+    path = str(tmp_path / 'karel.sock')
+    server = subprocess.Popen([_KAREL, f'--serve={path}'],
+                              stderr=subprocess.DEVNULL)
+    try:
+        deadline = time.monotonic() + _TIMEOUT
+        while not os.path.exists(path):
+            assert server.poll() is None
+            assert time.monotonic() < deadline
+            time.sleep(0.01)
+
+        world = _read(_case_inputs('baches')[0])
+        with socket.socket(socket.AF_UNIX) as first, socket.socket(
+                socket.AF_UNIX) as second:
+            first.connect(path)
+            second.connect(path)
+            program_key = _send(first, b'program\n' +
+                                _read(programs['baches']))[3:].strip()
+            world_key = _send(first, b'world\n' + world)[3:].strip()
+            run = b'run ' + program_key + b' ' + world_key + b'\n'
+            assert _send(second, run) == b'ok 0 0\n'
+            assert _send(first, run) == b'ok 0 0\n'
+            assert _send(first, b'fetch 0\n') == b'ok\n' + _run(
+                programs['baches'], stdin=world)[1]
+            assert _send(first, b'fetch 0\n') == b'error unknown result\n'
+            assert _send(second, b'fetch 0\n').startswith(b'ok\n')
+    finally:
+        server.terminate()
+        server.wait(timeout=_TIMEOUT)
+
+
+def _parse_fork_response(response):
+    '''Returns the exit status and the output of a fork server response.'''
+    header, output = response.split(b'\n', 1)
+    fields = header.decode().split()
+    assert fields[0] == 'ok'
+    assert fields[1] == 'exit'
+    assert len(fields) == 6
+    assert all(int(field) >= 0 for field in fields[3:])
+    return int(fields[2]), output
+
+
+def test_fork_server(programs, tmp_path):
+    '''The fork server runs each program in a child of its own.'''
+    preloaded = _case_inputs('baches')[0]
+    world = _write(str(tmp_path / 'world.in'), _read(_case_inputs('pintor')[0]))
+    missing = str(tmp_path / 'missing.kxb')
+    responses = _serve(
+        f'run {programs["baches"]}\n'.encode(),
+        f'run {programs["pintor"]} world={world} format=json\n'.encode(),
+        f'run {programs["forever"]} instruction_limit=100\n'.encode(),
+        f'run {missing}\n'.encode(),
+        b'run\n',
+        b'fork\n',
+        f'run {programs["baches"]} format=yaml\n'.encode(),
+        args=(f'--fork-server={preloaded}', ),
+    )
+    assert _parse_fork_response(responses[0]) == _run(programs['baches'],
+                                                      stdin=_read(preloaded))
+    assert _parse_fork_response(responses[1]) == _run('--format=json',
+                                                      programs['pintor'],
+                                                      stdin=_read(world))
+    assert _parse_fork_response(responses[2])[0] == 1
+    assert _parse_fork_response(responses[3]) == (255, b'')
+    assert [_header(r) for r in responses[4:]] == [
+        'error missing program',
+        'error unknown command',
+        'error invalid format',
+    ]
+
+    responses = _serve(f'run {programs["baches"]}\n'.encode(),
+                       args=('--fork-server', ))
+    assert responses == [b'error missing world\n']
+
+
+def test_result_cache(programs, tmp_path):
+    '''Results are cached by program, world and format.'''
+    cache = tmp_path / 'results'
+    cache.mkdir()
+    world = _read(_case_inputs('baches')[0])
+    flag = f'--result-cache={cache}'
+    expected = _run(programs['baches'], stdin=world)
+    assert _run(flag, programs['baches'], stdin=world) == expected
+    entries = list(cache.iterdir())
+    assert len(entries) == 1
+
+    # Tampering with the output without changing its size shows that the
+    # second run is served from the cache.
+    entry = bytearray(_read(str(entries[0])))
+    assert entry.endswith(expected[1])
+    entry[-len(expected[1])] = ord('#')
+    _write(str(entries[0]), bytes(entry))
+    code, output = _run(flag, programs['baches'], stdin=world)
+    assert code == expected[0]
+    assert output == b'#' + expected[1][1:]
+
+    # Other formats and programs are misses.
+    assert _run(flag, '--format=json', programs['baches'],
+                stdin=world) == _run('--format=json', programs['baches'],
+                                     stdin=world)
+    assert _run(flag, programs['wall'],
+                stdin=world) == _run(programs['wall'], stdin=world)
+    assert len(list(cache.iterdir())) == 3
+
+    # Batches share the cache, and give the same output from it.
+    batch = tmp_path / 'batch'
+    batch.mkdir()
+    pattern = os.path.join(_PROBLEMS, 'pintor', 'cases', '*.in')
+    expected = _run(f'--cases={pattern}', programs['pintor'])
+    assert _run(f'--result-cache={batch}', f'--cases={pattern}',
+                programs['pintor']) == expected
+    assert len(list(batch.iterdir())) == len(glob.glob(pattern))
+    assert _run(f'--result-cache={batch}', f'--cases={pattern}',
+                programs['pintor']) == expected
+
+    # Programs with the same instructions split into functions in different
+    # places run differently, so they must not share results.
+    split = tmp_path / 'split'
+    split.mkdir()
+    first = _write(
+        str(tmp_path / 'first.kx'), b'[["LOAD",0],["CALL",3,"f"],["HALT"],'
+        b'["FORWARD"],["RET"],["LEFT"],["RET"]]')
+    second = _write(str(tmp_path / 'second.kx'),
+                    _read(first).replace(b'["CALL",3', b'["CALL",5'))
+    flag = '--format=json'
+    assert _run(flag, first, stdin=world) != _run(flag, second, stdin=world)
+    for program in (first, second):
+        assert _run(f'--result-cache={split}', flag, program,
+                    stdin=world) == _run(flag, program, stdin=world)
+    assert len(list(split.iterdir())) == 2
+
+
+def test_batch(programs, tmp_path):
+    '''Batches give the results of single runs in order, with any number of
+    jobs.'''
+    history = str(tmp_path / 'costs')
+    for name, problem in (('pintor', 'pintor'), ('forever', 'baches')):
+        pattern = os.path.join(_PROBLEMS, problem, 'cases', '*.in')
+        paths = sorted(glob.glob(pattern))
+        outputs = set()
+        for jobs in (1, 4):
+            # The second run starts the cases in the order of their costs.
+            for _ in range(2):
+                code, output = _run('--format=json', f'--jobs={jobs}',
+                                    f'--cost-history={history}',
+                                    f'--cases={pattern}', programs[name])
+                assert code == 0
+                outputs.add(output)
+        assert len(outputs) == 1
+        lines = [json.loads(line) for line in outputs.pop().splitlines()]
+        assert [line['case'] for line in lines] == paths
+        for line, path in zip(lines, paths):
+            assert line['result'] == json.loads(
+                _run('--format=json', programs[name], stdin=_read(path))[1])
+
+
+def _parse_sweep(report):
+    '''Returns the variant count and the count of every result.'''
+    lines = report.decode().splitlines()
+    assert lines[0].startswith('variants ')
+    counts = {}
+    for line in lines[1:]:
+        if line.startswith('result '):
+            name = line.split('"')[1]
+            counts[name] = int(line.split('"')[2].split()[0])
+    return int(lines[0].split()[1]), counts
+
+
+def test_sweep(programs, tmp_path):
+    '''Sweeps are deterministic and count every variant.'''
+    world = _read(_case_inputs('baches')[0])
+    spec = _write(
+        str(tmp_path / 'spec.txt'), b'# A random mix of worlds.\n'
+        b'seeds 7 200\n'
+        b'buzzers 1 1 5 5 0 1\n'
+        b'orientation NORTE ESTE\n'
+        b'bag 0 3\n')
+    reports = set()
+    for jobs in (1, 3):
+        code, report = _run(f'--sweep={spec}', f'--jobs={jobs}',
+                            programs['pick'], stdin=world)
+        assert code == 0
+        reports.add(report)
+    assert len(reports) == 1
+    variants, counts = _parse_sweep(reports.pop())
+    assert variants == 200
+    assert sum(counts.values()) == variants
+    assert counts.get('FIN PROGRAMA', 0) > 0
+    assert counts.get('ZUMBADOR INVALIDO', 0) > 0
+
+    # Without directives, every variant is the base world.
+    base = _write(str(tmp_path / 'base.txt'), b'seeds 0 1\n')
+    code, report = _run(f'--sweep={base}', programs['baches'], stdin=world)
+    assert code == 0
+    assert _parse_sweep(report) == (1, {'FIN PROGRAMA': 1})
+    total = json.loads(
+        _run('--format=json', programs['baches'],
+             stdin=world)[1])['instructions']['total']
+    assert f'min {total} ' in report.decode()
+
+    invalid = _write(str(tmp_path / 'invalid.txt'), b'buzzers 0 0 9 9 0 1\n')
+    assert _run(f'--sweep={invalid}', programs['baches'],
+                stdin=world)[0] != 0
+
+
+def test_nesting(tmp_path):
+    '''Deeply nested sources fail to compile instead of crashing.'''
+    world = _read(_case_inputs('baches')[0])
+    depth = 300000
+    for name, source in {
+            'statements':
+            'class program { program() { ' + 'if (frontIsClear) ' * depth +
+            'turnoff(); } }',
+            'clauses':
+            'class program { program() { if (' + '(' * depth +
+            'frontIsClear' + ')' * depth + ') turnoff(); } }',
+            'succ':
+            'class program { program() { iterate (' + 'succ(' * depth + '1' +
+            ')' * depth + ') turnleft(); } }',
+            'precede':
+            'iniciar-programa inicia-ejecucion repetir ' +
+            'precede(' * depth + '1' + ')' * depth +
+            ' veces gira-izquierda; apagate; termina-ejecucion '
+            'finalizar-programa',
+    }.items():
+        path = _write(str(tmp_path / f'{name}.txt'), source.encode())
+        assert _run(f'--source={path}', stdin=world)[0] == 255, name
+
+    # Nesting that real programs could use still compiles.
+    path = _write(
+        str(tmp_path / 'sucede.txt'),
+        ('iniciar-programa inicia-ejecucion repetir ' + 'sucede(' * 500 +
+         '0' + ')' * 500 + ' veces gira-izquierda; apagate; '
+         'termina-ejecucion finalizar-programa').encode())
+    code, output = _run('--format=json', f'--source={path}', stdin=world)
+    assert code == 0
+    assert json.loads(output)['instructions']['left'] == 500
@@ -0,0 +1,402 @@
+// Runs the cases in test/problems in process and grades them against their
+// expected results, both by comparing the final state and by comparing the
+// bytes of the XML result with the .out file, up to line endings and trailing
+// newlines. Each problem is compiled once with the native compiler.
+// With --compiler, the solutions are also compiled with the JavaScript
+// compiler and a problem fails unless both produce the same program. Those
+// are kept in a cache keyed by the hash of their source, so that only the
+// problems whose solution changed pay for node.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "compiler.h"
+#include "expect.h"
+#include "hash.h"
+#include "karel.h"
+#include "logging.h"
+#include "program.h"
+#include "scheduler.h"
+#include "util.h"
+#include "world.h"
+#include "xml.h"
+
+extern char** environ;
+
+namespace {
+
+constexpr const std::string_view kFlagPrefix("--");
+constexpr const std::string_view kCacheDirFlagPrefix("cache-dir=");
+constexpr const std::string_view kCompilerFlagPrefix("compiler=");
+constexpr const std::string_view kJobsFlagPrefix("jobs=");
+
+using Clock = std::chrono::steady_clock;
+
+struct Problem {
+  std::string name;
+  std::string path;
+  std::optional<karel::Program> program;
+  std::string message;
+};
+
+struct Case {
+  Problem* problem;
+  std::string name;
+  std::string path;
+
+  std::unique_ptr<karel::World> world;
+  std::optional<FileContents> expected_output;
+  std::optional<karel::ExpectedResult> expected;
+  karel::ExecutionState state;
+  Clock::duration elapsed{};
+
+  // The outcome of the case.
+  bool passed = false;
+  std::string message;
+  size_t instructions = 0;
+};
+
+std::optional<FileContents> ReadFile(const std::string& path) {
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return std::nullopt;
+  }
+  return FileContents::Read(fd.get());
+}
+
+std::vector<std::string> Glob(const std::string& pattern) {
+  std::vector<std::string> paths;
+  glob_t matches;
+  if (glob(pattern.c_str(), 0, nullptr, &matches) != 0)
+    return paths;
+  for (size_t i = 0; i < matches.gl_pathc; ++i)
+    paths.emplace_back(matches.gl_pathv[i]);
+  globfree(&matches);
+  return paths;
+}
+
+std::string Basename(std::string_view path) {
+  size_t slash = path.rfind('/');
+  return std::string(slash == std::string_view::npos ? path
+                                                     : path.substr(slash + 1));
+}
+
+std::string Dirname(std::string_view path) {
+  size_t slash = path.rfind('/');
+  return std::string(slash == std::string_view::npos ? "."
+                                                     : path.substr(0, slash));
+}
+
+// Runs |compiler| on |source| and waits for it.
+bool RunCompiler(const std::string& compiler,
+                 const std::string& source,
+                 const std::string& output) {
+  const char* argv[] = {compiler.c_str(), "compile", source.c_str(), "-o",
+                        output.c_str(),   nullptr};
+  pid_t pid;
+  int error = posix_spawn(&pid, compiler.c_str(), nullptr, nullptr,
+                          const_cast<char* const*>(argv), environ);
+  if (error != 0) {
+    errno = error;
+    PLOG(ERROR) << "Failed to run " << compiler;
+    return false;
+  }
+  int status;
+  if (HANDLE_EINTR(waitpid(pid, &status, 0)) == -1) {
+    PLOG(ERROR) << "Failed to wait for " << compiler;
+    return false;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG(ERROR) << "Failed to compile " << source;
+    return false;
+  }
+  return true;
+}
+
+// Compiles |source_path| with the JavaScript |compiler| unless it is already
+// in |cache_dir|.
+std::optional<karel::Program> CompileWithNode(const std::string& source_path,
+                                              const FileContents& source,
+                                              const std::string& compiler,
+                                              const std::string& cache_dir) {
+  std::string kx_path =
+      cache_dir + "/" + hash::Key::Of(source.view()).ToString() + ".kx";
+
+  std::optional<FileContents> compiled;
+  ScopedFD cached_fd(open(kx_path.c_str(), O_RDONLY));
+  if (cached_fd)
+    compiled = FileContents::Read(cached_fd.get());
+  if (!compiled) {
+    // Problems with the same solution might be compiled at the same time.
+    std::string temp_path =
+        StringPrintf("%s.tmp.%d.%p", kx_path.c_str(), getpid(), &source);
+    if (!RunCompiler(compiler, source_path, temp_path))
+      return std::nullopt;
+    if (rename(temp_path.c_str(), kx_path.c_str()) == -1) {
+      PLOG(ERROR) << "Failed to rename " << temp_path << " to " << kx_path;
+      unlink(temp_path.c_str());
+      return std::nullopt;
+    }
+    compiled = ReadFile(kx_path);
+    if (!compiled)
+      return std::nullopt;
+  }
+  return karel::LoadCachedProgram(cache_dir, std::move(compiled.value()));
+}
+
+bool SameProgram(const karel::Program& a, const karel::Program& b) {
+  if (a.size() != b.size() || a.functions().size() != b.functions().size())
+    return false;
+  for (size_t pc = 0; pc < a.size(); ++pc) {
+    if (a.instructions()[pc].opcode != b.instructions()[pc].opcode ||
+        a.instructions()[pc].arg != b.instructions()[pc].arg) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < a.functions().size(); ++i) {
+    if (a.functions()[i].pc != b.functions()[i].pc ||
+        a.functions()[i].name != b.functions()[i].name) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Compiles the solution of |problem|, and checks it against the JavaScript
+// |compiler| if there is one.
+void Compile(Problem* problem,
+             const std::optional<std::string>& compiler,
+             const std::string& cache_dir) {
+  std::string source_path = problem->path + "/sol.txt";
+  auto source = ReadFile(source_path);
+  if (!source) {
+    problem->message = "failed to read the solution";
+    return;
+  }
+  problem->program = karel::CompileProgram(source->view());
+  if (!problem->program) {
+    problem->message = "failed to compile";
+    return;
+  }
+  if (!compiler)
+    return;
+
+  auto expected =
+      CompileWithNode(source_path, source.value(), compiler.value(), cache_dir);
+  if (!expected) {
+    problem->message = "failed to compile with " + compiler.value();
+  } else if (!SameProgram(problem->program.value(), expected.value())) {
+    problem->message =
+        "the program differs from the one by " + compiler.value();
+  } else {
+    return;
+  }
+  problem->program.reset();
+}
+
+// The .out files were written on different systems, so the XML results are
+// compared without carriage returns and without the newlines at the end.
+std::string NormalizeOutput(std::string_view output) {
+  std::string normalized;
+  normalized.reserve(output.size());
+  for (char c : output) {
+    if (c != '\r')
+      normalized.push_back(c);
+  }
+  while (!normalized.empty() && normalized.back() == '\n')
+    normalized.pop_back();
+  return normalized;
+}
+
+// Runs one slice of |test|. Returns true once it is graded.
+bool Step(Case* test, size_t slice) {
+  Clock::time_point start = Clock::now();
+  if (!test->world) {
+    auto world = ReadFile(test->path);
+    auto image = world ? karel::WorldImage::Parse(world->view()) : nullptr;
+    // Cases are named *.in, and their expected results *.out.
+    test->expected_output =
+        ReadFile(test->path.substr(0, test->path.size() - 3) + ".out");
+    if (test->expected_output) {
+      test->expected =
+          karel::ExpectedResult::Parse(test->expected_output->view());
+    }
+    if (!image || !test->expected) {
+      test->message = "failed to load the case";
+      return true;
+    }
+    test->world = std::make_unique<karel::World>(std::move(image));
+  }
+
+  const karel::Program& program = test->problem->program.value();
+  auto result = karel::RunSlice(program.instructions(), program.size(),
+                                test->world->runtime(), &test->state, slice);
+  test->elapsed += Clock::now() - start;
+  if (!result)
+    return false;
+
+  test->instructions = test->state.instruction_count;
+  auto mismatch = test->expected->Compare(*test->world, result.value());
+  if (!mismatch) {
+    std::string output;
+    {
+      xml::Buffer buffer(&output);
+      test->world->DumpResult(result.value(), karel::World::ResultFormat::XML,
+                              &buffer);
+    }
+    if (NormalizeOutput(output) !=
+        NormalizeOutput(test->expected_output->view())) {
+      mismatch = "the XML result differs from the .out file";
+    }
+  }
+  test->passed = !mismatch;
+  if (mismatch)
+    test->message = std::move(mismatch.value());
+  test->world.reset();
+  test->expected_output.reset();
+  test->expected.reset();
+  test->state = karel::ExecutionState();
+  return true;
+}
+
+[[noreturn]] void Usage(const std::string_view program_name) {
+  LOG(ERROR) << "Usage: " << program_name
+             << " [--cache-dir=dir] [--compiler=cmd/kareljs] [--jobs=N] "
+                "test/problems";
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string cache_dir = ".test_cache";
+  std::optional<std::string> compiler;
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg.find(kFlagPrefix) != 0)
+      continue;
+    arg.remove_prefix(kFlagPrefix.size());
+
+    if (arg.find(kCacheDirFlagPrefix) == 0) {
+      arg.remove_prefix(kCacheDirFlagPrefix.size());
+      cache_dir = std::string(arg);
+    } else if (arg.find(kCompilerFlagPrefix) == 0) {
+      arg.remove_prefix(kCompilerFlagPrefix.size());
+      compiler = std::string(arg);
+    } else if (arg.find(kJobsFlagPrefix) == 0) {
+      arg.remove_prefix(kJobsFlagPrefix.size());
+      auto [ptr, ec] =
+          std::from_chars(arg.data(), arg.data() + arg.size(), jobs);
+      if (arg.empty() || ec != std::errc() || ptr != arg.data() + arg.size() ||
+          jobs == 0) {
+        Usage(argv[0]);
+      }
+    } else {
+      Usage(argv[0]);
+    }
+
+    // Shift all arguments by one.
+    --argc;
+    for (int j = i; j < argc; ++j)
+      argv[j] = argv[j + 1];
+    --i;
+  }
+
+  if (argc != 2)
+    Usage(argv[0]);
+  std::string problems_dir = argv[1];
+  if (compiler && mkdir(cache_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+    PLOG(ERROR) << "Failed to create " << cache_dir;
+    return -1;
+  }
+
+  Clock::time_point start = Clock::now();
+  std::vector<std::unique_ptr<Problem>> problems;
+  for (const auto& sol_path : Glob(problems_dir + "/*/sol.txt")) {
+    auto problem = std::make_unique<Problem>();
+    problem->path = Dirname(sol_path);
+    problem->name = Basename(problem->path);
+    problems.emplace_back(std::move(problem));
+  }
+  if (problems.empty()) {
+    LOG(ERROR) << "No problems found in " << problems_dir;
+    return -1;
+  }
+
+  karel::Scheduler scheduler(jobs, karel::kDefaultSlice);
+  std::vector<karel::Scheduler::Task> tasks;
+  for (auto& problem : problems) {
+    karel::Scheduler::Task task;
+    task.run = [problem = problem.get(), &compiler, &cache_dir](size_t) {
+      Compile(problem, compiler, cache_dir);
+      return true;
+    };
+    tasks.emplace_back(std::move(task));
+  }
+  scheduler.Submit(std::move(tasks));
+  scheduler.Wait();
+
+  std::vector<Case> cases;
+  size_t failed = 0;
+  for (auto& problem : problems) {
+    if (!problem->program) {
+      printf("FAIL %s: %s\n", problem->name.c_str(),
+             problem->message.c_str());
+      ++failed;
+      continue;
+    }
+    for (auto& path : Glob(problem->path + "/cases/*.in")) {
+      Case test;
+      test.problem = problem.get();
+      test.name = Basename(path);
+      test.path = std::move(path);
+      cases.emplace_back(std::move(test));
+    }
+  }
+  tasks.clear();
+  for (auto& test : cases) {
+    karel::Scheduler::Task task;
+    task.run = [test = &test](size_t slice) { return Step(test, slice); };
+    tasks.emplace_back(std::move(task));
+  }
+  scheduler.Submit(std::move(tasks));
+  scheduler.Wait();
+
+  size_t passed = 0;
+  for (const auto& test : cases) {
+    double milliseconds =
+        std::chrono::duration<double, std::milli>(test.elapsed).count();
+    printf("%s %s/%s %.3fms %zu instructions%s%s\n",
+           test.passed ? "PASS" : "FAIL", test.problem->name.c_str(),
+           test.name.c_str(), milliseconds, test.instructions,
+           test.passed ? "" : ": ", test.message.c_str());
+    if (test.passed)
+      ++passed;
+    else
+      ++failed;
+  }
+  double total =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  printf("%zu passed, %zu failed in %.3fms\n", passed, failed, total);
+  return failed == 0 ? 0 : 1;
+}
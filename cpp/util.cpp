@@ -1,8 +1,13 @@
 #include "util.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <fstream>
 #include <utility>
 
@@ -48,6 +53,18 @@ ScopedMmap::~ScopedMmap() {
   reset();
 }
 
+ScopedMmap::ScopedMmap(ScopedMmap&& mmap) : ptr_(MAP_FAILED), size_(0) {
+  std::swap(ptr_, mmap.ptr_);
+  std::swap(size_, mmap.size_);
+}
+
+ScopedMmap& ScopedMmap::operator=(ScopedMmap&& mmap) {
+  reset();
+  std::swap(ptr_, mmap.ptr_);
+  std::swap(size_, mmap.size_);
+  return *this;
+}
+
 void* ScopedMmap::get() {
   return ptr_;
 }
@@ -65,6 +82,49 @@ void ScopedMmap::reset(void* ptr, size_t size) {
     PLOG(ERROR) << "Failed to unmap memory";
 }
 
+// static
+std::optional<FileContents> FileContents::Read(int fd) {
+  FileContents contents;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    PLOG(ERROR) << "Failed to stat file";
+    return std::nullopt;
+  }
+  if (S_ISREG(st.st_mode)) {
+    if (st.st_size == 0)
+      return contents;
+    contents.mapping_.reset(
+        mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0), st.st_size);
+    if (contents.mapping_) {
+      contents.view_ =
+          std::string_view(static_cast<const char*>(contents.mapping_.get()),
+                           contents.mapping_.size());
+      return contents;
+    }
+    // Some files can be read but not mapped. Fall back to reading them.
+  }
+
+  constexpr size_t kChunkSize = 65536;
+  size_t total_bytes = 0;
+  while (true) {
+    contents.buffer_.resize(total_bytes + kChunkSize);
+    ssize_t bytes_read =
+        HANDLE_EINTR(read(fd, contents.buffer_.data() + total_bytes,
+                          kChunkSize));
+    if (bytes_read == -1) {
+      PLOG(ERROR) << "Failed to read file";
+      return std::nullopt;
+    }
+    if (bytes_read == 0)
+      break;
+    total_bytes += bytes_read;
+  }
+  contents.buffer_.resize(total_bytes);
+  contents.view_ = std::string_view(contents.buffer_.data(), total_bytes);
+  return contents;
+}
+
 std::string StringPrintf(const char* format, ...) {
   char path[4096];
 
@@ -76,6 +136,14 @@ std::string StringPrintf(const char* format, ...) {
   return std::string(path, ret);
 }
 
+// static
+FileContents FileContents::Copy(std::string_view data) {
+  FileContents contents;
+  contents.buffer_.assign(data.begin(), data.end());
+  contents.view_ = std::string_view(contents.buffer_.data(), data.size());
+  return contents;
+}
+
 bool WriteFileDescriptor(int fd, std::string_view str) {
   const char* ptr = str.data();
   size_t remaining = str.size();
@@ -89,6 +157,30 @@ bool WriteFileDescriptor(int fd, std::string_view str) {
   return remaining == 0;
 }
 
+bool WriteFileAtomically(const std::string& path, std::string_view contents) {
+  // Several threads of the same process might be writing the same file.
+  static std::atomic<uint32_t> sequence_number{0};
+  std::string temp_path = StringPrintf("%s.tmp.%d.%u", path.c_str(), getpid(),
+                                       sequence_number++);
+  ScopedFD fd(open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to open " << temp_path;
+    return false;
+  }
+  if (!WriteFileDescriptor(fd.get(), contents)) {
+    PLOG(ERROR) << "Failed to write " << temp_path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  fd.reset();
+  if (rename(temp_path.c_str(), path.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
 template <>
 std::optional<uint32_t> ParseString(std::string_view str) {
   if (str == "INFINITO")
@@ -8,6 +8,7 @@
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "macros.h"
 
@@ -35,10 +36,13 @@ class ScopedMmap {
  public:
   ScopedMmap(void* ptr = MAP_FAILED, size_t size = 0);
   ~ScopedMmap();
+  ScopedMmap(ScopedMmap&& mmap);
+  ScopedMmap& operator=(ScopedMmap&& mmap);
 
   operator bool() const { return ptr_ != MAP_FAILED; }
   void* get();
   const void* get() const;
+  size_t size() const { return size_; }
   void reset(void* ptr = MAP_FAILED, size_t size = 0);
 
  private:
@@ -48,10 +52,36 @@ class ScopedMmap {
   DISALLOW_COPY_AND_ASSIGN(ScopedMmap);
 };
 
+// The whole contents of a file. Regular files are mapped into memory, and
+// anything else (like a pipe) is read into a buffer in one go.
+class FileContents {
+ public:
+  FileContents() = default;
+  FileContents(FileContents&&) = default;
+  FileContents& operator=(FileContents&&) = default;
+
+  static std::optional<FileContents> Read(int fd);
+  // Holds a copy of |data|, for contents that did not come from a file.
+  static FileContents Copy(std::string_view data);
+
+  std::string_view view() const { return view_; }
+
+ private:
+  ScopedMmap mapping_;
+  std::vector<char> buffer_;
+  std::string_view view_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileContents);
+};
+
 std::string StringPrintf(const char* format, ...);
 
 bool WriteFileDescriptor(int fd, std::string_view str);
 
+// Writes |contents| to a temporary file next to |path| and renames it into
+// place, so that concurrent readers never observe a partial file.
+bool WriteFileAtomically(const std::string& path, std::string_view contents);
+
 template <typename T>
 std::optional<T> ParseString(std::string_view str) {
   T value;
@@ -0,0 +1,1413 @@
+#include "world.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+#include "logging.h"
+#include "scan.h"
+#include "util.h"
+#include "xml.h"
+
+namespace karel {
+
+namespace {
+
+struct Cell {
+  uint32_t x;
+  uint32_t y;
+};
+
+// Finds the cells of a |width| by |height| grid that |find_row| reports, in
+// the column-major order in which Dump() writes them. |find_row| stores the
+// columns of the matching cells of row y in increasing order and returns how
+// many there were. Rows are scanned in memory order and then put in
+// column-major order with a counting sort on x, which keeps each column
+// sorted by y.
+template <typename FindRow>
+std::vector<Cell> CollectColumnMajor(size_t width,
+                                     size_t height,
+                                     FindRow find_row) {
+  std::vector<uint32_t> columns(width);
+  std::vector<Cell> cells;
+  std::vector<size_t> offsets(width + 1);
+  for (size_t y = 0; y < height; ++y) {
+    size_t count = find_row(y, columns.data());
+    for (size_t i = 0; i < count; ++i) {
+      cells.push_back({columns[i], static_cast<uint32_t>(y)});
+      offsets[columns[i] + 1]++;
+    }
+  }
+  for (size_t x = 0; x < width; ++x)
+    offsets[x + 1] += offsets[x];
+  std::vector<Cell> sorted(cells.size());
+  for (const auto& cell : cells)
+    sorted[offsets[cell.x]++] = cell;
+  return sorted;
+}
+
+// Adapts xml::Reader::Element to the interface that
+// WorldImage::HandleElement() expects.
+class ReaderElement {
+ public:
+  explicit ReaderElement(xml::Reader::Element* node) : node_(node) {}
+
+  std::string_view GetName() { return node_->GetName(); }
+  std::optional<std::string_view> GetAttribute(std::string_view name) {
+    return node_->GetAttribute(name);
+  }
+  template <typename T>
+  std::optional<T> GetNumber(std::string_view name) {
+    return ParseString<T>(node_->GetAttribute(name));
+  }
+
+ private:
+  xml::Reader::Element* node_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReaderElement);
+};
+
+// Same as above, for the current element of an xml::Tokenizer. Numbers are
+// only parsed if they are plain decimals that fit in the type (or INFINITO),
+// which std::from_chars() reads exactly like ParseString() does. For anything
+// else, the element is marked as unsupported.
+class TokenizerElement {
+ public:
+  explicit TokenizerElement(const xml::Tokenizer* tokenizer)
+      : tokenizer_(tokenizer) {}
+
+  std::string_view GetName() { return tokenizer_->name(); }
+  std::optional<std::string_view> GetAttribute(std::string_view name) {
+    return tokenizer_->GetAttribute(name);
+  }
+  template <typename T>
+  std::optional<T> GetNumber(std::string_view name) {
+    auto value = tokenizer_->GetAttribute(name);
+    if (!value)
+      return std::nullopt;
+    if constexpr (std::is_same_v<T, uint32_t>) {
+      if (value.value() == "INFINITO")
+        return karel::kInfinity;
+    }
+    T number;
+    const char* end = value->data() + value->size();
+    auto result = std::from_chars(value->data(), end, number);
+    if (value->empty() || value->front() < '0' || value->front() > '9' ||
+        result.ec != std::errc() || result.ptr != end) {
+      supported_ = false;
+      return std::nullopt;
+    }
+    return number;
+  }
+
+  bool supported() const { return supported_; }
+
+ private:
+  const xml::Tokenizer* tokenizer_;
+  bool supported_ = true;
+
+  DISALLOW_COPY_AND_ASSIGN(TokenizerElement);
+};
+
+constexpr std::string_view kOrientationNames[] = {"OESTE", "NORTE", "ESTE",
+                                                  "SUR"};
+
+// Dump() and DumpResult() write the XML by hand, with the same layout that
+// xml::Writer would use: one tab of indentation per level, and elements
+// without children closed with "/>".
+void AddAttribute(xml::Buffer* out,
+                  std::string_view name,
+                  std::string_view value) {
+  out->Add(' ');
+  out->Add(name);
+  out->Add("=\"");
+  out->Add(value);
+  out->Add('"');
+}
+
+template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+void AddAttribute(xml::Buffer* out, std::string_view name, T value) {
+  out->Add(' ');
+  out->Add(name);
+  out->Add("=\"");
+  out->AddNumber(value);
+  out->Add('"');
+}
+
+// Tracks whether the start tag of an element at |depth| that was left open
+// needs to be finished with "/>" or with ">" and an end tag.
+class Element {
+ public:
+  Element(xml::Buffer* out, size_t depth) : out_(out), depth_(depth) {}
+
+  // Must be called before writing each child element.
+  void AddChild() {
+    if (empty_)
+      out_->Add(">\n");
+    empty_ = false;
+  }
+
+  void Close(std::string_view name) {
+    if (empty_) {
+      out_->Add("/>\n");
+      return;
+    }
+    for (size_t i = 0; i < depth_; ++i)
+      out_->Add('\t');
+    out_->Add("</");
+    out_->Add(name);
+    out_->Add(">\n");
+  }
+
+ private:
+  xml::Buffer* const out_;
+  const size_t depth_;
+  bool empty_ = true;
+
+  DISALLOW_COPY_AND_ASSIGN(Element);
+};
+
+constexpr size_t kAlignment = 8;
+
+size_t Align(size_t offset) {
+  return (offset + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+size_t EntrySize(WorldImage::SectionType type) {
+  switch (type) {
+    case WorldImage::SectionType::NAME:
+    case WorldImage::SectionType::PROGRAM_NAME:
+      return 1;
+    case WorldImage::SectionType::WALLS:
+    case WorldImage::SectionType::BUZZERS:
+      return sizeof(WorldImage::BinaryCell);
+    case WorldImage::SectionType::BUZZER_DUMP:
+      return sizeof(uint32_t);
+  }
+  return 0;
+}
+
+}  // namespace
+
+// static
+std::shared_ptr<const WorldImage> WorldImage::Parse(int fd) {
+  auto contents = FileContents::Read(fd);
+  if (!contents)
+    return nullptr;
+  return Parse(contents->view());
+}
+
+// static
+std::shared_ptr<const WorldImage> WorldImage::Parse(std::string_view document) {
+  if (IsBinary(document)) {
+    std::shared_ptr<WorldImage> world(new WorldImage());
+    if (!world->ParseBinary(document))
+      return nullptr;
+    return world;
+  }
+
+  // Worlds are almost always written by the same few tools, so they are first
+  // read with the tokenizer. Anything it cannot vouch for, including worlds
+  // that would be rejected or only partially read, is parsed again from
+  // scratch with expat so that the result is exactly what it always was.
+  {
+    std::shared_ptr<WorldImage> world(new WorldImage());
+    xml::Tokenizer tokenizer(document);
+    TokenizerElement element(&tokenizer);
+    while (true) {
+      xml::Tokenizer::Result result = tokenizer.Next();
+      if (result == xml::Tokenizer::Result::END)
+        return world;
+      if (result == xml::Tokenizer::Result::UNSUPPORTED ||
+          !world->HandleElement(&element) || !element.supported()) {
+        break;
+      }
+    }
+  }
+
+  std::shared_ptr<WorldImage> world(new WorldImage());
+  if (!xml::Reader().Parse(document,
+                           [&world](xml::Reader::Element node) -> bool {
+                             ReaderElement element(&node);
+                             return world->HandleElement(&element);
+                           })) {
+    return nullptr;
+  }
+
+  return world;
+}
+
+template <typename Element>
+bool WorldImage::HandleElement(Element* node) {
+  const std::string_view name = node->GetName();
+  if (name == "mundo") {
+    auto width = node->template GetNumber<uint32_t>("ancho"),
+         height = node->template GetNumber<uint32_t>("alto");
+    if (!width || !height)
+      return false;
+
+    Init(width.value(), height.value(),
+         node->GetAttribute("nombre").value_or("mundo_0"));
+  } else if (name == "condiciones") {
+    auto instruction_limit = node->template GetNumber<size_t>(
+             "instruccionesMaximasAEjecutar"),
+         stack_limit = node->template GetNumber<size_t>("longitudStack");
+    if (instruction_limit)
+      runtime_.instruction_limit = instruction_limit.value();
+    if (stack_limit)
+      runtime_.stack_limit = stack_limit.value();
+  } else if (name == "comando") {
+    auto nombre = node->GetAttribute("nombre");
+    auto maximoNumeroDeEjecuciones =
+        node->template GetNumber<size_t>("maximoNumeroDeEjecuciones");
+    if (!maximoNumeroDeEjecuciones)
+      return false;
+    if (nombre.value() == "AVANZA")
+      runtime_.forward_limit = maximoNumeroDeEjecuciones.value();
+    else if (nombre.value() == "GIRA_IZQUIERDA")
+      runtime_.left_limit = maximoNumeroDeEjecuciones.value();
+    else if (nombre.value() == "COGE_ZUMBADOR")
+      runtime_.pickbuzzer_limit = maximoNumeroDeEjecuciones.value();
+    else if (nombre.value() == "DEJA_ZUMBADOR")
+      runtime_.leavebuzzer_limit = maximoNumeroDeEjecuciones.value();
+    else {
+      LOG(ERROR) << "Invalid limit name " << nombre.value();
+      return false;
+    }
+  } else if (name == "monton") {
+    auto x = node->template GetNumber<size_t>("x"),
+         y = node->template GetNumber<size_t>("y");
+    auto count = node->template GetNumber<uint32_t>("zumbadores");
+    if (!x || !y || !count)
+      return false;
+    (*x)--;
+    (*y)--;
+    if (x.value() >= width_ || y.value() >= height_)
+      return true;
+    buzzers_[coordinates(*x, *y)] = *count;
+  } else if (name == "pared") {
+    auto x1 = node->template GetNumber<size_t>("x1"),
+         y1 = node->template GetNumber<size_t>("y1"),
+         x2 = node->template GetNumber<size_t>("x2"),
+         y2 = node->template GetNumber<size_t>("y2");
+    if (x1 && x2 && y1 && !y2) {
+      // Horizontal
+      size_t x = std::min(*x1, *x2);
+      size_t y = *y1;
+      if (x >= width_ || y >= height_)
+        return true;
+      walls_[coordinates(x, y)] |= 1 << 3;
+      if (y)
+        walls_[coordinates(x, y - 1)] |= 1 << 1;
+    } else if (y1 && y2 && x1 && !x2) {
+      // Vertical
+      size_t x = *x1;
+      size_t y = std::min(*y1, *y2);
+      if (x >= width_ || y >= height_)
+        return true;
+      walls_[coordinates(x, y)] |= 1 << 0;
+      if (x)
+        walls_[coordinates(x - 1, y)] |= 1 << 2;
+    } else {
+      LOG(ERROR) << "Invalid pared";
+      return false;
+    }
+  } else if (name == "posicionDump") {
+    auto x = node->template GetNumber<size_t>("x"),
+         y = node->template GetNumber<size_t>("y");
+    if (!x || !y)
+      return false;
+    (*x)--;
+    (*y)--;
+    if (x.value() >= width_ || y.value() >= height_)
+      return true;
+    buzzer_dump_[coordinates(x.value(), y.value())] = true;
+  } else if (name == "programa") {
+    auto karel_x = node->template GetNumber<size_t>("xKarel"),
+         karel_y = node->template GetNumber<size_t>("yKarel");
+    auto direccion_karel = node->GetAttribute("direccionKarel");
+    auto karel_bag = node->template GetNumber<uint32_t>("mochilaKarel");
+    auto nombre = node->GetAttribute("nombre");
+    if (karel_x)
+      runtime_.x = karel_x.value() - 1;
+    if (karel_y)
+      runtime_.y = karel_y.value() - 1;
+    if (karel_bag)
+      runtime_.bag = karel_bag.value();
+    if (nombre)
+      program_name_ = std::string(nombre.value());
+    if (direccion_karel) {
+      if (direccion_karel.value() == "OESTE")
+        runtime_.orientation = 0;
+      else if (direccion_karel.value() == "NORTE")
+        runtime_.orientation = 1;
+      else if (direccion_karel.value() == "ESTE")
+        runtime_.orientation = 2;
+      else if (direccion_karel.value() == "SUR")
+        runtime_.orientation = 3;
+      else {
+        LOG(ERROR) << "Invalid orientation " << direccion_karel.value();
+        return false;
+      }
+    }
+  } else if (name == "despliega") {
+    auto tipo = node->GetAttribute("tipo");
+    if (!tipo) {
+      LOG(ERROR) << "Invalid despliega";
+      return false;
+    }
+    if (*tipo == "MUNDO") {
+      dump_world_ = true;
+    } else if (*tipo == "UNIVERSO") {
+      dump_universe_ = true;
+    } else if (*tipo == "ORIENTACION") {
+      dump_orientation_ = true;
+    } else if (*tipo == "POSICION") {
+      dump_position_ = true;
+    } else if (*tipo == "MOCHILA") {
+      dump_bag_ = true;
+    } else if (*tipo == "AVANZA") {
+      dump_forward_ = true;
+    } else if (*tipo == "GIRA_IZQUIERDA") {
+      dump_left_ = true;
+    } else if (*tipo == "DEJA_ZUMBADOR") {
+      dump_leavebuzzer_ = true;
+    } else if (*tipo == "COGE_ZUMBADOR") {
+      dump_pickbuzzer_ = true;
+    } else {
+      LOG(ERROR) << "Invalid dump type " << *tipo;
+      return false;
+    }
+  }
+
+
+  return true;
+}
+
+// static
+bool WorldImage::IsBinary(std::string_view contents) {
+  uint32_t magic;
+  if (contents.size() < sizeof(magic))
+    return false;
+  memcpy(&magic, contents.data(), sizeof(magic));
+  return magic == kBinaryMagic;
+}
+
+bool WorldImage::ParseBinary(std::string_view data) {
+  if (data.size() < sizeof(BinaryHeader)) {
+    LOG(ERROR) << "Truncated binary world header";
+    return false;
+  }
+  const auto* header = reinterpret_cast<const BinaryHeader*>(data.data());
+  if (header->version != kBinaryVersion) {
+    LOG(ERROR) << "Unsupported binary world version " << header->version;
+    return false;
+  }
+  if (header->section_count >
+      (data.size() - sizeof(BinaryHeader)) / sizeof(BinarySection)) {
+    LOG(ERROR) << "Truncated binary world section table";
+    return false;
+  }
+  if ((header->width == 0) != (header->height == 0)) {
+    LOG(ERROR) << "Invalid binary world dimensions";
+    return false;
+  }
+  const auto* sections =
+      reinterpret_cast<const BinarySection*>(data.data() + sizeof(*header));
+
+  std::string_view name, program_name;
+  const BinaryCell* walls = nullptr;
+  size_t wall_count = 0;
+  const BinaryCell* buzzers = nullptr;
+  size_t buzzer_count = 0;
+  const uint32_t* buzzer_dump = nullptr;
+  size_t buzzer_dump_count = 0;
+  for (size_t i = 0; i < header->section_count; ++i) {
+    const BinarySection& section = sections[i];
+    size_t entry_size = EntrySize(section.type);
+    if (entry_size == 0)
+      continue;
+    if (section.offset % kAlignment != 0 || section.offset > data.size() ||
+        section.count > (data.size() - section.offset) / entry_size) {
+      LOG(ERROR) << "Invalid binary world section "
+                 << static_cast<uint32_t>(section.type);
+      return false;
+    }
+    const char* begin = data.data() + section.offset;
+    switch (section.type) {
+      case SectionType::NAME:
+        name = std::string_view(begin, section.count);
+        break;
+      case SectionType::PROGRAM_NAME:
+        program_name = std::string_view(begin, section.count);
+        break;
+      case SectionType::WALLS:
+        walls = reinterpret_cast<const BinaryCell*>(begin);
+        wall_count = section.count;
+        break;
+      case SectionType::BUZZERS:
+        buzzers = reinterpret_cast<const BinaryCell*>(begin);
+        buzzer_count = section.count;
+        break;
+      case SectionType::BUZZER_DUMP:
+        buzzer_dump = reinterpret_cast<const uint32_t*>(begin);
+        buzzer_dump_count = section.count;
+        break;
+    }
+  }
+
+  // Everything in the header ends up in the Runtime that the interpreter and
+  // the dumpers trust, so check it before allocating anything.
+  const size_t size = static_cast<size_t>(header->width) * header->height;
+  if (header->orientation >= 4) {
+    LOG(ERROR) << "Invalid binary world orientation " << header->orientation;
+    return false;
+  }
+  if (size != 0 &&
+      (header->x >= header->width || header->y >= header->height)) {
+    LOG(ERROR) << "Invalid binary world position " << header->x << ","
+               << header->y;
+    return false;
+  }
+  if (wall_count > size || buzzer_count > size || buzzer_dump_count > size) {
+    LOG(ERROR) << "Binary world sections larger than its " << header->width
+               << "x" << header->height << " cells";
+    return false;
+  }
+
+  Init(header->width, header->height, name);
+  program_name_ = std::string(program_name);
+  for (size_t i = 0; i < wall_count; ++i) {
+    if (walls[i].index >= size) {
+      LOG(ERROR) << "Invalid binary world wall " << walls[i].index;
+      return false;
+    }
+    walls_[walls[i].index] = walls[i].value;
+  }
+  for (size_t i = 0; i < buzzer_count; ++i) {
+    if (buzzers[i].index >= size) {
+      LOG(ERROR) << "Invalid binary world buzzer " << buzzers[i].index;
+      return false;
+    }
+    buzzers_[buzzers[i].index] = buzzers[i].value;
+  }
+  for (size_t i = 0; i < buzzer_dump_count; ++i) {
+    if (buzzer_dump[i] >= size) {
+      LOG(ERROR) << "Invalid binary world dump cell " << buzzer_dump[i];
+      return false;
+    }
+    buzzer_dump_[buzzer_dump[i]] = true;
+  }
+
+  runtime_.orientation = header->orientation;
+  runtime_.x = header->x;
+  runtime_.y = header->y;
+  runtime_.bag = header->bag;
+  runtime_.instruction_limit = header->instruction_limit;
+  runtime_.stack_limit = header->stack_limit;
+  runtime_.forward_limit = header->forward_limit;
+  runtime_.left_limit = header->left_limit;
+  runtime_.pickbuzzer_limit = header->pickbuzzer_limit;
+  runtime_.leavebuzzer_limit = header->leavebuzzer_limit;
+
+  const uint32_t dump_flags = header->dump_flags;
+  dump_world_ = dump_flags & DUMP_WORLD;
+  dump_universe_ = dump_flags & DUMP_UNIVERSE;
+  dump_position_ = dump_flags & DUMP_POSITION;
+  dump_orientation_ = dump_flags & DUMP_ORIENTATION;
+  dump_bag_ = dump_flags & DUMP_BAG;
+  dump_forward_ = dump_flags & DUMP_FORWARD;
+  dump_left_ = dump_flags & DUMP_LEFT;
+  dump_leavebuzzer_ = dump_flags & DUMP_LEAVEBUZZER;
+  dump_pickbuzzer_ = dump_flags & DUMP_PICKBUZZER;
+  return true;
+}
+
+std::string WorldImage::ToBinary() const {
+  std::vector<BinaryCell> walls, buzzers;
+  std::vector<uint32_t> buzzer_dump;
+  for (size_t i = 0; i < width_ * height_; ++i) {
+    if (walls_[i])
+      walls.push_back(BinaryCell{static_cast<uint32_t>(i), walls_[i]});
+    if (buzzers_[i])
+      buzzers.push_back(BinaryCell{static_cast<uint32_t>(i), buzzers_[i]});
+    if (buzzer_dump_[i])
+      buzzer_dump.push_back(i);
+  }
+
+  struct Table {
+    SectionType type;
+    size_t count;
+    const void* data;
+  };
+  const Table tables[] = {
+      {SectionType::NAME, name_.size(), name_.data()},
+      {SectionType::PROGRAM_NAME, program_name_.size(), program_name_.data()},
+      {SectionType::WALLS, walls.size(), walls.data()},
+      {SectionType::BUZZERS, buzzers.size(), buzzers.data()},
+      {SectionType::BUZZER_DUMP, buzzer_dump.size(), buzzer_dump.data()},
+  };
+
+  BinaryHeader header{};
+  header.magic = kBinaryMagic;
+  header.version = kBinaryVersion;
+  header.width = width_;
+  header.height = height_;
+  header.orientation = runtime_.orientation;
+  header.x = runtime_.x;
+  header.y = runtime_.y;
+  header.bag = runtime_.bag;
+  header.instruction_limit = runtime_.instruction_limit;
+  header.stack_limit = runtime_.stack_limit;
+  header.forward_limit = runtime_.forward_limit;
+  header.left_limit = runtime_.left_limit;
+  header.pickbuzzer_limit = runtime_.pickbuzzer_limit;
+  header.leavebuzzer_limit = runtime_.leavebuzzer_limit;
+  header.dump_flags = (dump_world_ ? DUMP_WORLD : 0) |
+                      (dump_universe_ ? DUMP_UNIVERSE : 0) |
+                      (dump_position_ ? DUMP_POSITION : 0) |
+                      (dump_orientation_ ? DUMP_ORIENTATION : 0) |
+                      (dump_bag_ ? DUMP_BAG : 0) |
+                      (dump_forward_ ? DUMP_FORWARD : 0) |
+                      (dump_left_ ? DUMP_LEFT : 0) |
+                      (dump_leavebuzzer_ ? DUMP_LEAVEBUZZER : 0) |
+                      (dump_pickbuzzer_ ? DUMP_PICKBUZZER : 0);
+  header.section_count = array_length(tables);
+
+  std::string output(reinterpret_cast<const char*>(&header), sizeof(header));
+  size_t offset =
+      Align(sizeof(header) + array_length(tables) * sizeof(BinarySection));
+  for (const auto& table : tables) {
+    BinarySection section{table.type, static_cast<uint32_t>(table.count),
+                          offset};
+    output.append(reinterpret_cast<const char*>(&section), sizeof(section));
+    offset = Align(offset + table.count * EntrySize(table.type));
+  }
+  for (const auto& table : tables) {
+    output.resize(Align(output.size()));
+    output.append(static_cast<const char*>(table.data),
+                  table.count * EntrySize(table.type));
+  }
+  return output;
+}
+
+// static
+std::shared_ptr<const WorldImage> WorldImage::Import(std::string_view mdo,
+                                                     std::string_view kec) {
+  // Both files are arrays of little-endian 16-bit words.
+  auto word = [](std::string_view data, size_t index) -> uint32_t {
+    return static_cast<uint8_t>(data[2 * index]) |
+           static_cast<uint8_t>(data[2 * index + 1]) << 8;
+  };
+  if (mdo.size() % 2 != 0 || kec.size() % 2 != 0 || mdo.size() / 2 < 20 ||
+      kec.size() / 2 < 30) {
+    LOG(ERROR) << "Invalid file format";
+    return nullptr;
+  }
+  const size_t mdo_size = mdo.size() / 2, kec_size = kec.size() / 2;
+  constexpr uint32_t kMagic[] = {0x414b, 0x4552, 0x204c, 0x4d4f, 0x2e49};
+  for (size_t i = 0; i < array_length(kMagic); ++i) {
+    if (word(mdo, i) != kMagic[i]) {
+      LOG(ERROR) << "Invalid magic number";
+      return nullptr;
+    }
+  }
+
+  const size_t width = word(mdo, 6), height = word(mdo, 7);
+  if (width == 0 || height == 0) {
+    LOG(ERROR) << "Invalid world dimensions " << width << "x" << height;
+    return nullptr;
+  }
+  std::shared_ptr<WorldImage> world(new WorldImage());
+  world->Init(width, height, "mundo_0");
+
+  // The JS world keeps its cells 1-based, at |width| * i + j of an array with
+  // room for a border. Walls are recorded there first, just like the JS
+  // importer does, since addWall() accepts a 0 row or column, which aliases
+  // the last column of the previous row.
+  std::vector<uint8_t> wall_map((width + 2) * (height + 2));
+  auto add_wall = [&wall_map, width, height](size_t i, size_t j,
+                                             size_t orientation) {
+    if (orientation >= 4 || i > height || j > width)
+      return;
+    wall_map[width * i + j] |= 1 << orientation;
+    if (orientation == 0 && j > 1)
+      wall_map[width * i + (j - 1)] |= 1 << 2;
+    else if (orientation == 1 && i < height)
+      wall_map[width * (i + 1) + j] |= 1 << 3;
+    else if (orientation == 2 && j < width)
+      wall_map[width * i + (j + 1)] |= 1 << 0;
+    else if (orientation == 3 && i > 1)
+      wall_map[width * (i - 1) + j] |= 1 << 1;
+  };
+  for (size_t i = 1; i <= height; ++i) {
+    add_wall(i, 1, 0);
+    add_wall(i, width, 2);
+  }
+  for (size_t j = 1; j <= width; ++j) {
+    add_wall(height, j, 1);
+    add_wall(1, j, 3);
+  }
+
+  Runtime& runtime = world->runtime_;
+  const uint32_t bag = word(mdo, 8);
+  runtime.bag = bag == 0xffff ? kInfinity : bag;
+  const size_t karel_x = word(mdo, 9), karel_y = word(mdo, 10);
+  if (1 <= karel_x && karel_x <= width && 1 <= karel_y && karel_y <= height) {
+    runtime.x = karel_x - 1;
+    runtime.y = karel_y - 1;
+  }
+  runtime.orientation = word(mdo, 11) % 4;
+
+  // Entries that run past the end of the file are ignored, since they have
+  // no effect in the JS importer either.
+  const size_t wall_count = word(mdo, 12), heap_count = word(mdo, 13);
+  auto entry_count = [](size_t count, size_t offset, size_t size) {
+    return std::min(count, (size - std::min(size, offset)) / 3);
+  };
+  const size_t walls = entry_count(wall_count, 15, mdo_size);
+  for (size_t entry = 0; entry < walls; ++entry) {
+    const size_t i = 15 + 3 * entry;
+    const uint32_t mask = word(mdo, i + 2);
+    for (size_t bit = 0; bit < 4; ++bit) {
+      if (mask & (1 << bit))
+        add_wall(word(mdo, i + 1), word(mdo, i), (bit + 1) % 4);
+    }
+  }
+  const size_t heaps =
+      entry_count(heap_count, 15 + 3 * wall_count, mdo_size);
+  for (size_t entry = 0; entry < heaps; ++entry) {
+    const size_t i = 15 + 3 * (wall_count + entry);
+    const size_t x = word(mdo, i), y = word(mdo, i + 1);
+    const uint32_t count = word(mdo, i + 2);
+    if (1 <= x && x <= width && 1 <= y && y <= height)
+      world->buzzers_[world->coordinates(x - 1, y - 1)] =
+          count == 0xffff ? kInfinity : count;
+  }
+
+  // Only the north and east walls of the interior cells survive
+  // World.prototype.save().
+  for (size_t i = 1; i <= height; ++i) {
+    for (size_t j = 1; j <= width; ++j) {
+      const uint8_t cell_walls = wall_map[width * i + j];
+      if (i < height && (cell_walls & (1 << 1))) {
+        world->walls_[world->coordinates(j - 1, i)] |= 1 << 3;
+        world->walls_[world->coordinates(j - 1, i - 1)] |= 1 << 1;
+      }
+      if (j < width && (cell_walls & (1 << 2))) {
+        world->walls_[world->coordinates(j, i - 1)] |= 1 << 0;
+        world->walls_[world->coordinates(j - 1, i - 1)] |= 1 << 2;
+      }
+    }
+  }
+
+  if (word(kec, 0))
+    runtime.instruction_limit = word(kec, 1);
+  if (word(kec, 3))
+    runtime.forward_limit = word(kec, 4);
+  if (word(kec, 6))
+    runtime.left_limit = word(kec, 7);
+  if (word(kec, 9))
+    runtime.pickbuzzer_limit = word(kec, 10);
+  if (word(kec, 12))
+    runtime.leavebuzzer_limit = word(kec, 13);
+  world->dump_position_ = word(kec, 21);
+  world->dump_orientation_ = word(kec, 24);
+  const size_t dump_count = word(kec, 27) ? word(kec, 28) : 0;
+  world->dump_world_ = dump_count != 0;
+  const size_t dumps = entry_count(dump_count, 30, kec_size);
+  for (size_t entry = 0; entry < dumps; ++entry) {
+    const size_t i = 30 + 3 * entry;
+    const size_t x = word(kec, i), y = word(kec, i + 1);
+    if (1 <= x && x <= width && 1 <= y && y <= height)
+      world->buzzer_dump_[world->coordinates(x - 1, y - 1)] = true;
+  }
+
+  return world;
+}
+
+std::shared_ptr<WorldImage> WorldImage::Clone() const {
+  std::shared_ptr<WorldImage> world(new WorldImage());
+  world->Init(width_, height_, name_);
+  world->CopyFrom(*this);
+  return world;
+}
+
+void WorldImage::CopyFrom(const WorldImage& other) {
+  const size_t cells = width_ * height_;
+  name_ = other.name_;
+  program_name_ = other.program_name_;
+  memcpy(buzzers_.get(), other.buzzers_.get(), cells * sizeof(uint32_t));
+  memcpy(walls_.get(), other.walls_.get(), cells * sizeof(uint8_t));
+  memcpy(buzzer_dump_.get(), other.buzzer_dump_.get(), cells * sizeof(bool));
+  dump_world_ = other.dump_world_;
+  dump_universe_ = other.dump_universe_;
+  dump_position_ = other.dump_position_;
+  dump_orientation_ = other.dump_orientation_;
+  dump_bag_ = other.dump_bag_;
+  dump_forward_ = other.dump_forward_;
+  dump_left_ = other.dump_left_;
+  dump_leavebuzzer_ = other.dump_leavebuzzer_;
+  dump_pickbuzzer_ = other.dump_pickbuzzer_;
+  runtime_ = other.runtime_;
+  digest_.store(other.digest_.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+  has_digest_.store(other.has_digest_.load(std::memory_order_acquire),
+                    std::memory_order_release);
+}
+
+template <typename Callback>
+void WorldImage::ForEachDumpedBuzzer(const BuzzerOverlay& buzzers,
+                                     Callback callback) const {
+  if (!dump_world_ && !dump_universe_)
+    return;
+  std::vector<uint32_t> columns(width_);
+  for (size_t y = 0; y < height_; ++y) {
+    const uint32_t* row = buzzers.row(y);
+    size_t count;
+    if (dump_universe_) {
+      count = scan::FindNonZero(row, width_, columns.data());
+    } else {
+      count = scan::FindNonZero(
+          reinterpret_cast<const uint8_t*>(buzzer_dump_.get() +
+                                           coordinates(0, y)),
+          width_, 1, columns.data());
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (row[columns[i]] != 0)
+        callback(columns[i], y, row[columns[i]]);
+    }
+  }
+}
+
+uint64_t WorldImage::ScanDigest(const BuzzerOverlay& buzzers) const {
+  uint64_t digest = 0;
+  ForEachDumpedBuzzer(buzzers,
+                      [this, &digest](size_t x, size_t y, uint32_t count) {
+                        digest ^= BuzzerDigest::Key(coordinates(x, y), count);
+                      });
+  return digest;
+}
+
+uint64_t WorldImage::initial_digest() const {
+  if (has_digest_.load(std::memory_order_acquire))
+    return digest_.load(std::memory_order_relaxed);
+  uint64_t digest =
+      ScanDigest(BuzzerOverlay(buzzers_.get(), width_, height_));
+  digest_.store(digest, std::memory_order_relaxed);
+  has_digest_.store(true, std::memory_order_release);
+  return digest;
+}
+
+void WorldImage::AddWall(size_t x, size_t y, size_t direction) {
+  walls_[coordinates(x, y)] |= 1 << direction;
+  switch (direction) {
+    case 0:
+      if (x > 0)
+        walls_[coordinates(x - 1, y)] |= 1 << 2;
+      break;
+    case 1:
+      if (y + 1 < height_)
+        walls_[coordinates(x, y + 1)] |= 1 << 3;
+      break;
+    case 2:
+      if (x + 1 < width_)
+        walls_[coordinates(x + 1, y)] |= 1 << 0;
+      break;
+    case 3:
+      if (y > 0)
+        walls_[coordinates(x, y - 1)] |= 1 << 1;
+      break;
+  }
+}
+
+void WorldImage::Init(size_t width, size_t height, std::string_view name) {
+  width_ = width;
+  height_ = height;
+  name_ = std::string(name);
+  program_name_ = "p1";
+  buzzers_ = std::make_unique<uint32_t[]>(width_ * height_);
+  walls_ = std::make_unique<uint8_t[]>(width_ * height_);
+  buzzer_dump_ = std::make_unique<bool[]>(width_ * height_);
+  has_digest_.store(false, std::memory_order_relaxed);
+  for (size_t x = 0; x < width_; x++) {
+    walls_[coordinates(x, 0)] |= 1 << 0x3;
+    walls_[coordinates(x, height_ - 1)] |= 1 << 0x1;
+  }
+  for (size_t y = 0; y < height_; y++) {
+    walls_[coordinates(0, y)] |= 1 << 0x0;
+    walls_[coordinates(width_ - 1, y)] |= 1 << 0x2;
+  }
+  runtime_.width = width_;
+  runtime_.height = height_;
+}
+
+World::World(std::shared_ptr<const WorldImage> image)
+    : image_(std::move(image)),
+      overlay_(image_->buzzers(), image_->width(), image_->height()) {
+  Reset();
+}
+
+World::World(World&& other)
+    : image_(std::move(other.image_)),
+      overlay_(std::move(other.overlay_)),
+      heatmap_(std::move(other.heatmap_)),
+      digest_(std::move(other.digest_)),
+      initial_digest_(other.initial_digest_),
+      runtime_(other.runtime_) {
+  runtime_.overlay = &overlay_;
+  runtime_.heatmap = heatmap_.get();
+  runtime_.digest = digest_.get();
+}
+
+World::~World() = default;
+
+// static
+std::optional<World> World::Parse(int fd) {
+  auto image = WorldImage::Parse(fd);
+  if (!image)
+    return std::nullopt;
+  return std::make_optional<World>(std::move(image));
+}
+
+void World::Reset() {
+  overlay_.Reset();
+  runtime_ = image_->runtime();
+  runtime_.buzzers = nullptr;
+  runtime_.walls = image_->walls();
+  runtime_.overlay = &overlay_;
+  if (heatmap_) {
+    std::fill_n(heatmap_.get(), image_->width() * image_->height(),
+                CellCounters());
+  }
+  runtime_.heatmap = heatmap_.get();
+  if (digest_)
+    digest_->value = initial_digest_;
+  runtime_.digest = digest_.get();
+}
+
+void World::Reset(std::shared_ptr<const WorldImage> image) {
+  const bool heatmap = heatmap_ != nullptr, digest = digest_ != nullptr;
+  if (heatmap &&
+      image->width() * image->height() != image_->width() * image_->height()) {
+    heatmap_.reset();
+  }
+  // The digest depends on the dumped cells of the image.
+  digest_.reset();
+  image_ = std::move(image);
+  overlay_.Reset(image_->buzzers(), image_->width(), image_->height());
+  if (heatmap)
+    EnableHeatmap();
+  Reset();
+  if (digest)
+    EnableDigest();
+}
+
+void World::EnableHeatmap() {
+  if (!heatmap_) {
+    heatmap_ =
+        std::make_unique<CellCounters[]>(image_->width() * image_->height());
+  }
+  runtime_.heatmap = heatmap_.get();
+}
+
+void World::EnableDigest() {
+  const WorldImage& image = *image_;
+  // Without lines in the result, the buzzers are not part of the digest.
+  if (digest_ || (!image.dump_world() && !image.dump_universe()))
+    return;
+  digest_ = std::make_unique<BuzzerDigest>();
+  if (!image.dump_universe())
+    digest_->mask = image.buzzer_dump();
+  initial_digest_ = image.initial_digest();
+  digest_->value = overlay_.dirty_bands() == 0 ? initial_digest_
+                                                : image.ScanDigest(overlay_);
+  runtime_.digest = digest_.get();
+}
+
+
+uint64_t World::Digest(RunResult result) const {
+  const WorldImage& image = *image_;
+  uint64_t buzzers = digest_ ? digest_->value : image.ScanDigest(overlay_);
+
+  // Everything else in the result is a handful of values. Those that are not
+  // dumped are replaced by a value that no dumped one can have.
+  constexpr uint64_t kAbsent = std::numeric_limits<uint64_t>::max();
+  auto direccion = OrientationName(runtime_.orientation);
+  const uint64_t fields[] = {
+      hash::Hash64(image.name()),
+      hash::Hash64(image.program_name()),
+      hash::Hash64(ExecutionResultName(result)),
+      image.dump_world() || image.dump_universe(),
+      image.dump_universe(),
+      image.dump_position() ? runtime_.x : kAbsent,
+      image.dump_position() ? runtime_.y : kAbsent,
+      image.dump_orientation() && direccion ? runtime_.orientation : kAbsent,
+      image.dump_bag() ? runtime_.bag : kAbsent,
+      image.dump_forward() ? runtime_.forward_count : kAbsent,
+      image.dump_left() ? runtime_.left_count : kAbsent,
+      image.dump_pickbuzzer() ? runtime_.pickbuzzer_count : kAbsent,
+      image.dump_leavebuzzer() ? runtime_.leavebuzzer_count : kAbsent,
+  };
+  return hash::Hash64(
+      std::string_view(reinterpret_cast<const char*>(fields), sizeof(fields)),
+      buzzers);
+}
+
+bool World::WriteHeatmap(int fd, HeatmapFormat format) const {
+  if (!heatmap_) {
+    LOG(ERROR) << "Heatmap was not enabled";
+    return false;
+  }
+  const size_t width = image_->width();
+  const size_t height = image_->height();
+
+  std::string output;
+  if (format == HeatmapFormat::BINARY) {
+    static_assert(sizeof(CellCounters) == 3 * sizeof(uint32_t),
+                  "CellCounters should be packed");
+    const uint32_t header[] = {0x314d484bu,  // "KHM1"
+                               static_cast<uint32_t>(width),
+                               static_cast<uint32_t>(height)};
+    output.append(reinterpret_cast<const char*>(header), sizeof(header));
+    output.append(reinterpret_cast<const char*>(heatmap_.get()),
+                  width * height * sizeof(CellCounters));
+  } else {
+    output = "x,y,visits,picks,leaves\n";
+    for (size_t y = 0; y < height; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        const CellCounters& counters = heatmap_[coordinates(x, y)];
+        if (!counters.visits && !counters.picks && !counters.leaves)
+          continue;
+        output += StringPrintf("%zu,%zu,%u,%u,%u\n", x + 1, y + 1,
+                               counters.visits, counters.picks,
+                               counters.leaves);
+      }
+    }
+  }
+  return WriteFileDescriptor(fd, output);
+}
+
+void World::Dump() const {
+  const WorldImage& image = *image_;
+  const size_t width = image.width();
+  const size_t height = image.height();
+  xml::Buffer out(STDOUT_FILENO);
+
+  // Limits are printed as signed numbers, like they always were.
+  out.Add("<ejecucion>\n\t<condiciones");
+  AddAttribute(&out, "instruccionesMaximasAEjecutar",
+               static_cast<ssize_t>(runtime_.instruction_limit));
+  AddAttribute(&out, "longitudStack",
+               static_cast<ssize_t>(runtime_.stack_limit));
+  const std::pair<std::string_view, size_t> limits[] = {
+      {"AVANZA", runtime_.forward_limit},
+      {"GIRA_IZQUIERDA", runtime_.left_limit},
+      {"COGE_ZUMBADOR", runtime_.pickbuzzer_limit},
+      {"DEJA_ZUMBADOR", runtime_.leavebuzzer_limit},
+  };
+  Element condiciones(&out, 1);
+  for (const auto& limit : limits) {
+    if (limit.second == std::numeric_limits<size_t>::max())
+      continue;
+    condiciones.AddChild();
+    out.Add("\t\t<comando");
+    AddAttribute(&out, "nombre", limit.first);
+    AddAttribute(&out, "maximoNumeroDeEjecuciones", limit.second);
+    out.Add("/>\n");
+  }
+  condiciones.Close("condiciones");
+
+  out.Add("\t<mundos>\n\t\t<mundo nombre=\"mundo_0\"");
+  AddAttribute(&out, "ancho", static_cast<ssize_t>(width));
+  AddAttribute(&out, "alto", static_cast<ssize_t>(height));
+  Element mundo(&out, 2);
+
+  for (const auto& cell : CollectColumnMajor(
+           width, height, [this, width](size_t y, uint32_t* columns) {
+             return scan::FindNonZero(overlay_.row(y), width, columns);
+           })) {
+    uint32_t buzzers = get_buzzers(cell.x, cell.y);
+    mundo.AddChild();
+    out.Add("\t\t\t<monton");
+    AddAttribute(&out, "x", cell.x + 1);
+    AddAttribute(&out, "y", cell.y + 1);
+    if (buzzers == kInfinity)
+      AddAttribute(&out, "zumbadores", "INFINITO");
+    else
+      AddAttribute(&out, "zumbadores", buzzers);
+    out.Add("/>\n");
+  }
+
+  // Only the north and east walls are written, and not the ones on the
+  // border of the world.
+  for (const auto& cell : CollectColumnMajor(
+           width, height, [&image](size_t y, uint32_t* columns) {
+             uint8_t mask =
+                 (y + 1 < image.height() ? (1 << 1) : 0) | (1 << 2);
+             return scan::FindNonZero(image.walls() + image.coordinates(0, y),
+                                      image.width(), mask, columns);
+           })) {
+    uint8_t walls = get_walls(cell.x, cell.y);
+    if (cell.y + 1 < height && walls & (1 << 1)) {
+      mundo.AddChild();
+      out.Add("\t\t\t<pared");
+      AddAttribute(&out, "x1", cell.x);
+      AddAttribute(&out, "y1", cell.y + 1);
+      AddAttribute(&out, "x2", cell.x + 1);
+      out.Add("/>\n");
+    }
+    if (cell.x + 1 < width && walls & (1 << 2)) {
+      mundo.AddChild();
+      out.Add("\t\t\t<pared");
+      AddAttribute(&out, "x1", cell.x + 1);
+      AddAttribute(&out, "y1", cell.y);
+      AddAttribute(&out, "y2", cell.y + 1);
+      out.Add("/>\n");
+    }
+  }
+
+  for (const auto& cell : CollectColumnMajor(
+           width, height, [&image](size_t y, uint32_t* columns) {
+             return scan::FindNonZero(
+                 reinterpret_cast<const uint8_t*>(image.buzzer_dump() +
+                                                  image.coordinates(0, y)),
+                 image.width(), 1, columns);
+           })) {
+    mundo.AddChild();
+    out.Add("\t\t\t<posicionDump");
+    AddAttribute(&out, "x", cell.x + 1);
+    AddAttribute(&out, "y", cell.y + 1);
+    out.Add("/>\n");
+  }
+  mundo.Close("mundo");
+  out.Add("\t</mundos>\n");
+
+  out.Add(
+      "\t<programas tipoEjecucion=\"CONTINUA\" "
+      "intruccionesCambioContexto=\"1\" milisegundosParaPasoAutomatico=\"0\">\n"
+      "\t\t<programa nombre=\"p1\" ruta=\"{$2$}\" "
+      "mundoDeEjecucion=\"mundo_0\"");
+  AddAttribute(&out, "xKarel", static_cast<ssize_t>(runtime_.x + 1));
+  AddAttribute(&out, "yKarel", static_cast<ssize_t>(runtime_.y + 1));
+  if (runtime_.orientation < array_length(kOrientationNames))
+    AddAttribute(&out, "direccionKarel",
+                 kOrientationNames[runtime_.orientation]);
+  if (runtime_.bag == kInfinity)
+    AddAttribute(&out, "mochilaKarel", "INFINITO");
+  else
+    AddAttribute(&out, "mochilaKarel", runtime_.bag);
+
+  const std::pair<std::string_view, bool> dumps[] = {
+      {"MUNDO", image.dump_world()},
+      {"UNIVERSO", image.dump_universe()},
+      {"ORIENTACION", image.dump_orientation()},
+      {"POSICION", image.dump_position()},
+      {"MOCHILA", image.dump_bag()},
+      {"AVANZA", image.dump_forward()},
+      {"GIRA_IZQUIERDA", image.dump_left()},
+      {"DEJA_ZUMBADOR", image.dump_leavebuzzer()},
+      {"COGE_ZUMBADOR", image.dump_pickbuzzer()},
+  };
+  Element programa(&out, 2);
+  for (const auto& dump : dumps) {
+    if (!dump.second)
+      continue;
+    programa.AddChild();
+    out.Add("\t\t\t<despliega");
+    AddAttribute(&out, "tipo", dump.first);
+    out.Add("/>\n");
+  }
+  programa.Close("programa");
+  out.Add("\t</programas>\n</ejecucion>\n");
+}
+
+void World::DumpResult(RunResult result, ResultFormat format) const {
+  xml::Buffer out(STDOUT_FILENO);
+  DumpResult(result, format, &out);
+}
+
+void World::DumpResult(RunResult result,
+                       ResultFormat format,
+                       xml::Buffer* output) const {
+  switch (format) {
+    case ResultFormat::XML:
+      DumpResultXml(result, output);
+      break;
+    case ResultFormat::JSON:
+      DumpResultJson(result, output);
+      break;
+    case ResultFormat::BINARY:
+      DumpResultBinary(result, false, output);
+      break;
+    case ResultFormat::DELTA:
+      DumpResultBinary(result, true, output);
+      break;
+  }
+}
+
+// static
+std::string_view World::ExecutionResultName(RunResult result) {
+  switch (result) {
+    case RunResult::OK:
+      return "FIN PROGRAMA";
+    case RunResult::WALL:
+      return "MOVIMIENTO INVALIDO";
+    case RunResult::WORLDUNDERFLOW:
+    case RunResult::BAGUNDERFLOW:
+      return "ZUMBADOR INVALIDO";
+    case RunResult::INSTRUCTION:
+      return "LIMITE DE INSTRUCCIONES";
+    case RunResult::STACK:
+      return "STACK OVERFLOW";
+  }
+  return "";
+}
+
+// static
+std::optional<std::string_view> World::OrientationName(size_t orientation) {
+  if (orientation >= array_length(kOrientationNames))
+    return std::nullopt;
+  return kOrientationNames[orientation];
+}
+
+void World::DumpResultXml(RunResult result, xml::Buffer* output) const {
+  const WorldImage& image = *image_;
+  xml::Buffer& out = *output;
+
+  out.Add("<resultados>\n");
+  if (image.dump_world() || image.dump_universe()) {
+    out.Add("\t<mundos>\n\t\t<mundo");
+    AddAttribute(&out, "nombre", image.name());
+    Element mundo(&out, 2);
+
+    class LineWriter {
+     public:
+      LineWriter(xml::Buffer* out, Element* mundo) : out_(out), mundo_(mundo) {}
+
+      void BeginLine(size_t y) {
+        mundo_->AddChild();
+        out_->Add("\t\t\t<linea");
+        AddAttribute(out_, "fila", static_cast<ssize_t>(y + 1));
+        out_->Add(" compresionDeCeros=\"true\">");
+      }
+      void Coordinate(uint32_t x) {
+        out_->Add('(');
+        out_->AddNumber(x + 1);
+        out_->Add(") ");
+      }
+      void Value(uint32_t buzzers) {
+        out_->AddNumber(buzzers);
+        out_->Add(' ');
+      }
+      void EndLine() { out_->Add("</linea>\n"); }
+
+     private:
+      xml::Buffer* const out_;
+      Element* const mundo_;
+    } line_writer(&out, &mundo);
+    ForEachResultLine(&line_writer);
+
+    mundo.Close("mundo");
+    out.Add("\t</mundos>\n");
+  }
+
+  out.Add("\t<programas>\n\t\t<programa");
+  AddAttribute(&out, "nombre", image.program_name());
+  AddAttribute(&out, "resultadoEjecucion", ExecutionResultName(result));
+  Element programa(&out, 2);
+  if (image.dump_position() || image.dump_orientation() || image.dump_bag()) {
+    programa.AddChild();
+    out.Add("\t\t\t<karel");
+    if (image.dump_position()) {
+      AddAttribute(&out, "x", runtime_.x + 1);
+      AddAttribute(&out, "y", runtime_.y + 1);
+    }
+    auto direccion = OrientationName(runtime_.orientation);
+    if (image.dump_orientation() && direccion)
+      AddAttribute(&out, "direccion", direccion.value());
+    if (image.dump_bag()) {
+      if (runtime_.bag == kInfinity)
+        AddAttribute(&out, "mochila", "INFINITO");
+      else
+        AddAttribute(&out, "mochila", runtime_.bag);
+    }
+    out.Add("/>\n");
+  }
+  if (image.dump_forward() || image.dump_left() || image.dump_leavebuzzer() ||
+      image.dump_pickbuzzer()) {
+    programa.AddChild();
+    out.Add("\t\t\t<instrucciones");
+    if (image.dump_forward())
+      AddAttribute(&out, "avanza", runtime_.forward_count);
+    if (image.dump_left())
+      AddAttribute(&out, "gira_izquierda", runtime_.left_count);
+    if (image.dump_pickbuzzer())
+      AddAttribute(&out, "coge_zumbador", runtime_.pickbuzzer_count);
+    if (image.dump_leavebuzzer())
+      AddAttribute(&out, "deja_zumbador", runtime_.leavebuzzer_count);
+    out.Add("/>\n");
+  }
+  programa.Close("programa");
+  out.Add("\t</programas>\n</resultados>\n\n");
+}
+
+std::optional<RunResult> World::ApplyDelta(std::string_view delta) {
+  BinaryResult header;
+  if (delta.size() < sizeof(header)) {
+    LOG(ERROR) << "Truncated delta header";
+    return std::nullopt;
+  }
+  memcpy(&header, delta.data(), sizeof(header));
+  delta.remove_prefix(sizeof(header));
+  if (header.magic != kDeltaResultMagic ||
+      header.version != kBinaryResultVersion) {
+    LOG(ERROR) << "Unsupported delta format";
+    return std::nullopt;
+  }
+  if (header.result > static_cast<uint32_t>(RunResult::STACK)) {
+    LOG(ERROR) << "Invalid delta result " << header.result;
+    return std::nullopt;
+  }
+  if (header.orientation >= 4) {
+    LOG(ERROR) << "Invalid delta orientation " << header.orientation;
+    return std::nullopt;
+  }
+  if (header.cell_count != delta.size() / sizeof(BinaryResultCell) ||
+      delta.size() % sizeof(BinaryResultCell) != 0) {
+    LOG(ERROR) << "Truncated delta cells";
+    return std::nullopt;
+  }
+
+  Reset();
+  for (size_t i = 0; i < header.cell_count; ++i) {
+    BinaryResultCell cell;
+    memcpy(&cell, delta.data() + i * sizeof(cell), sizeof(cell));
+    if (cell.x == 0 || cell.x > image_->width() || cell.y == 0 ||
+        cell.y > image_->height()) {
+      LOG(ERROR) << "Invalid delta cell " << cell.x << "," << cell.y;
+      return std::nullopt;
+    }
+    uint32_t* buzzers = overlay_.mutable_row(cell.y - 1) + cell.x - 1;
+    if (digest_) {
+      digest_->Update(coordinates(cell.x - 1, cell.y - 1), *buzzers,
+                      cell.buzzers);
+    }
+    *buzzers = cell.buzzers;
+  }
+  runtime_.orientation = header.orientation;
+  runtime_.x = header.x - 1;
+  runtime_.y = header.y - 1;
+  runtime_.bag = header.bag;
+  runtime_.instruction_count = header.instruction_count;
+  runtime_.forward_count = header.forward_count;
+  runtime_.left_count = header.left_count;
+  runtime_.pickbuzzer_count = header.pickbuzzer_count;
+  runtime_.leavebuzzer_count = header.leavebuzzer_count;
+  return static_cast<RunResult>(header.result);
+}
+
+void World::DumpResultJson(RunResult result, xml::Buffer* output) const {
+  constexpr std::string_view kResultNames[] = {
+      "OK", "INSTRUCTION", "WALL", "WORLDUNDERFLOW", "BAGUNDERFLOW", "STACK",
+  };
+  xml::Buffer& out = *output;
+
+  // Infinite buzzers are written as -1, like js/karel.js does.
+  auto add_buzzers = [&out](size_t buzzers) {
+    if (buzzers == kInfinity)
+      out.Add("-1");
+    else
+      out.AddNumber(buzzers);
+  };
+
+  out.Add("{\"result\":\"");
+  out.Add(kResultNames[static_cast<uint32_t>(result)]);
+  out.Add("\",\"karel\":{\"x\":");
+  out.AddNumber(runtime_.x + 1);
+  out.Add(",\"y\":");
+  out.AddNumber(runtime_.y + 1);
+  out.Add(",\"orientation\":\"");
+  if (runtime_.orientation < array_length(kOrientationNames))
+    out.Add(kOrientationNames[runtime_.orientation]);
+  out.Add("\",\"bag\":");
+  add_buzzers(runtime_.bag);
+  out.Add("},\"instructions\":{\"total\":");
+  out.AddNumber(runtime_.instruction_count);
+  out.Add(",\"forward\":");
+  out.AddNumber(runtime_.forward_count);
+  out.Add(",\"left\":");
+  out.AddNumber(runtime_.left_count);
+  out.Add(",\"pickbuzzer\":");
+  out.AddNumber(runtime_.pickbuzzer_count);
+  out.Add(",\"leavebuzzer\":");
+  out.AddNumber(runtime_.leavebuzzer_count);
+  out.Add("},\"buzzers\":[");
+  bool first = true;
+  image_->ForEachDumpedBuzzer(
+      overlay_, [&](size_t x, size_t y, uint32_t buzzers) {
+        out.Add(first ? "[" : ",[");
+        first = false;
+        out.AddNumber(x + 1);
+        out.Add(',');
+        out.AddNumber(y + 1);
+        out.Add(',');
+        add_buzzers(buzzers);
+        out.Add(']');
+      });
+  out.Add("]}\n");
+}
+
+void World::DumpResultBinary(RunResult result,
+                             bool delta,
+                             xml::Buffer* output) const {
+  std::vector<BinaryResultCell> cells;
+  auto add_cell = [&cells](size_t x, size_t y, uint32_t buzzers) {
+    cells.push_back(BinaryResultCell{static_cast<uint32_t>(x + 1),
+                                     static_cast<uint32_t>(y + 1), buzzers});
+  };
+  if (delta) {
+    // Only the bands of the overlay that were written to can differ from the
+    // image.
+    for (size_t y : overlay_.DirtyRows()) {
+      const uint32_t* row = overlay_.row(y);
+      const uint32_t* initial_row = image_->buzzers() + coordinates(0, y);
+      for (size_t x = 0; x < image_->width(); ++x) {
+        if (row[x] != initial_row[x])
+          add_cell(x, y, row[x]);
+      }
+    }
+  } else {
+    image_->ForEachDumpedBuzzer(overlay_, add_cell);
+  }
+
+  BinaryResult header{};
+  header.magic = delta ? kDeltaResultMagic : kBinaryResultMagic;
+  header.version = kBinaryResultVersion;
+  header.result = static_cast<uint32_t>(result);
+  header.orientation = runtime_.orientation;
+  header.x = runtime_.x + 1;
+  header.y = runtime_.y + 1;
+  header.bag = runtime_.bag;
+  header.instruction_count = runtime_.instruction_count;
+  header.forward_count = runtime_.forward_count;
+  header.left_count = runtime_.left_count;
+  header.pickbuzzer_count = runtime_.pickbuzzer_count;
+  header.leavebuzzer_count = runtime_.leavebuzzer_count;
+  header.cell_count = cells.size();
+
+  output->Add(std::string_view(reinterpret_cast<const char*>(&header),
+                               sizeof(header)));
+  output->Add(std::string_view(reinterpret_cast<const char*>(cells.data()),
+                               cells.size() * sizeof(BinaryResultCell)));
+}
+
+}  // namespace karel
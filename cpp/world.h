@@ -0,0 +1,402 @@
+#ifndef WORLD_H_
+#define WORLD_H_
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "karel.h"
+#include "macros.h"
+#include "scan.h"
+
+namespace xml {
+class Buffer;
+}  // namespace xml
+
+namespace karel {
+
+// The parsed, immutable contents of a world file: its dimensions, walls,
+// initial buzzers, limits, Karel's start state and what to dump at the end.
+// An image is never modified once parsed, so it can be shared by any number of
+// concurrent runs.
+//
+// Besides the XML world files, images can be stored in a little-endian binary
+// format. It starts with a BinaryHeader that holds the dimensions, limits,
+// start state and dump flags, followed by |section_count| BinarySections that
+// point to 8-byte aligned tables:
+//
+//  * NAME, PROGRAM_NAME: the characters of the world and program names.
+//  * WALLS, BUZZERS: one BinaryCell per cell with a non-zero value.
+//  * BUZZER_DUMP: the uint32 index of every cell in the buzzer dump.
+//
+// Cells are indexed in row-major order. Readers must ignore sections they
+// don't know about, and must reject files with a different |version|.
+class WorldImage {
+ public:
+  static constexpr uint32_t kBinaryMagic = 0x3142574bu;  // "KWB1"
+  static constexpr uint32_t kBinaryVersion = 1;
+
+  enum class SectionType : uint32_t {
+    NAME,
+    PROGRAM_NAME,
+    WALLS,
+    BUZZERS,
+    BUZZER_DUMP,
+  };
+
+  // The bits of BinaryHeader::dump_flags.
+  enum DumpFlag : uint32_t {
+    DUMP_WORLD = 1 << 0,
+    DUMP_UNIVERSE = 1 << 1,
+    DUMP_POSITION = 1 << 2,
+    DUMP_ORIENTATION = 1 << 3,
+    DUMP_BAG = 1 << 4,
+    DUMP_FORWARD = 1 << 5,
+    DUMP_LEFT = 1 << 6,
+    DUMP_LEAVEBUZZER = 1 << 7,
+    DUMP_PICKBUZZER = 1 << 8,
+  };
+
+  struct BinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint64_t orientation;
+    uint64_t x;
+    uint64_t y;
+    uint64_t bag;
+    uint64_t instruction_limit;
+    uint64_t stack_limit;
+    uint64_t forward_limit;
+    uint64_t left_limit;
+    uint64_t pickbuzzer_limit;
+    uint64_t leavebuzzer_limit;
+    uint32_t dump_flags;
+    uint32_t section_count;
+  };
+
+  struct BinarySection {
+    SectionType type;
+    uint32_t count;
+    uint64_t offset;
+  };
+
+  struct BinaryCell {
+    uint32_t index;
+    uint32_t value;
+  };
+
+  // Parses a world in either format.
+  static std::shared_ptr<const WorldImage> Parse(int fd);
+  static std::shared_ptr<const WorldImage> Parse(std::string_view document);
+
+  // Builds an image from the world (.mdo) and conditions (.kec) files of the
+  // original Karel, exactly like World.prototype.import() in js/karel.js
+  // followed by World.prototype.save() would.
+  static std::shared_ptr<const WorldImage> Import(std::string_view mdo,
+                                                  std::string_view kec);
+
+  static bool IsBinary(std::string_view contents);
+
+  // Serializes the image in the binary format.
+  std::string ToBinary() const;
+
+  // Returns a copy of the image that can be modified, to derive variants of a
+  // world from it.
+  std::shared_ptr<WorldImage> Clone() const;
+  // Makes the image a copy of |other|, which must have the same dimensions,
+  // without allocating.
+  void CopyFrom(const WorldImage& other);
+
+  void set_buzzers(size_t x, size_t y, uint32_t count) {
+    buzzers_[coordinates(x, y)] = count;
+    has_digest_.store(false, std::memory_order_relaxed);
+  }
+  // Adds a wall on the |direction| side of a cell, and on the opposite side of
+  // its neighbor. Directions are numbered like orientations: west, north, east
+  // and south.
+  void AddWall(size_t x, size_t y, size_t direction);
+  Runtime* mutable_runtime() { return &runtime_; }
+
+  size_t width() const { return width_; }
+  size_t height() const { return height_; }
+  const std::string& name() const { return name_; }
+  const std::string& program_name() const { return program_name_; }
+
+  size_t coordinates(size_t x, size_t y) const { return y * width_ + x; }
+
+  const uint32_t* buzzers() const { return buzzers_.get(); }
+  const uint8_t* walls() const { return walls_.get(); }
+  const bool* buzzer_dump() const { return buzzer_dump_.get(); }
+
+  // The state Karel starts every run with. Its grid pointers are not set.
+  const Runtime& runtime() const { return runtime_; }
+
+  bool dump_world() const { return dump_world_; }
+  bool dump_universe() const { return dump_universe_; }
+  bool dump_position() const { return dump_position_; }
+  bool dump_orientation() const { return dump_orientation_; }
+  bool dump_bag() const { return dump_bag_; }
+  bool dump_forward() const { return dump_forward_; }
+  bool dump_left() const { return dump_left_; }
+  bool dump_leavebuzzer() const { return dump_leavebuzzer_; }
+  bool dump_pickbuzzer() const { return dump_pickbuzzer_; }
+
+  // Calls |callback| with the 0-based coordinates and the buzzers of every
+  // non-empty cell of |buzzers|, a grid of the size of the image, in the
+  // dumped region, in row-major order.
+  template <typename Callback>
+  void ForEachDumpedBuzzer(const BuzzerOverlay& buzzers,
+                           Callback callback) const;
+
+  // Computes the digest of the dumped buzzers of |buzzers| from scratch.
+  uint64_t ScanDigest(const BuzzerOverlay& buzzers) const;
+
+  // The digest of the dumped buzzers of the image itself, which every World
+  // with a digest starts from. It is only scanned the first time.
+  uint64_t initial_digest() const;
+
+ private:
+  WorldImage() = default;
+
+  void Init(size_t width, size_t height, std::string_view name);
+  bool ParseBinary(std::string_view data);
+
+  // Applies one element of the world file. |Element| is either of the
+  // adapters in world.cpp, one for each XML parser.
+  template <typename Element>
+  bool HandleElement(Element* node);
+
+  size_t width_ = 0;
+  size_t height_ = 0;
+  std::string name_;
+  std::string program_name_;
+  std::unique_ptr<uint32_t[]> buzzers_;
+  std::unique_ptr<uint8_t[]> walls_;
+  std::unique_ptr<bool[]> buzzer_dump_;
+  bool dump_world_ = false;
+  bool dump_universe_ = false;
+  bool dump_position_ = false;
+  bool dump_orientation_ = false;
+  bool dump_bag_ = false;
+  bool dump_forward_ = false;
+  bool dump_left_ = false;
+  bool dump_leavebuzzer_ = false;
+  bool dump_pickbuzzer_ = false;
+
+  Runtime runtime_;
+
+  // initial_digest(), once it has been computed. Worlds on different threads
+  // may share the image, and all of them would compute the same value.
+  mutable std::atomic<bool> has_digest_ = false;
+  mutable std::atomic<uint64_t> digest_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(WorldImage);
+};
+
+// A single run over a shared WorldImage. Walls are used straight from the
+// image, and buzzers go through a copy-on-write overlay, so creating and
+// resetting a World only costs the bands of the grid that a program modified.
+class World {
+ public:
+  explicit World(std::shared_ptr<const WorldImage> image);
+  World(World&& other);
+  ~World();
+
+  static std::optional<World> Parse(int fd);
+
+  size_t coordinates(size_t x, size_t y) const {
+    return image_->coordinates(x, y);
+  }
+
+  uint32_t get_buzzers(size_t x, size_t y) const {
+    return overlay_.get(x, y);
+  }
+
+  uint8_t get_walls(size_t x, size_t y) const {
+    return image_->walls()[coordinates(x, y)];
+  }
+
+  // The buzzers of row |y|. The pointer is valid until the next change to
+  // that row or the next Reset().
+  const uint32_t* buzzer_row(size_t y) const { return overlay_.row(y); }
+
+  // Restores the initial state of the image so the World can be reused.
+  void Reset();
+  // Switches the World to the initial state of another image, reusing the
+  // allocations of the previous runs. The heatmap and the digest stay
+  // enabled if they were.
+  void Reset(std::shared_ptr<const WorldImage> image);
+
+  // Starts counting visits and buzzer changes per cell for the next runs. The
+  // counters are cleared by Reset().
+  void EnableHeatmap();
+
+  // Starts maintaining the digest of the dumped buzzers incrementally for the
+  // next runs, so that Digest() does not need to scan the grid.
+  void EnableDigest();
+
+  // A 64-bit digest of everything the XML result of a run that ended with
+  // |result| shows: the buzzers of the dumped cells, and the dumped parts of
+  // Karel's state and of the command counters. Two runs over the same world
+  // with identical XML results have the same digest.
+  uint64_t Digest(RunResult result) const;
+
+  enum class HeatmapFormat { BINARY, CSV };
+
+  // Writes the heatmap counters. The binary format is the "KHM1" magic, the
+  // width and the height, followed by the visits, picks and leaves of every
+  // cell in row-major order, all as little-endian uint32. The CSV format has
+  // one "x,y,visits,picks,leaves" line per cell that was touched, using
+  // 1-based coordinates like the world files.
+  bool WriteHeatmap(int fd, HeatmapFormat format) const;
+
+  enum class ResultFormat { XML, JSON, BINARY, DELTA };
+
+  // Magic numbers of the binary result format, "KRS1", and of the delta
+  // format, "KRD1".
+  static constexpr uint32_t kBinaryResultMagic = 0x3153524bu;
+  static constexpr uint32_t kDeltaResultMagic = 0x3144524bu;
+  static constexpr uint32_t kBinaryResultVersion = 1;
+
+  // The binary result format is a BinaryResult followed by |cell_count|
+  // BinaryResultCells, all little-endian. Coordinates are 1-based and an
+  // infinite number of buzzers is stored as kInfinity.
+  //
+  // The delta format has the same layout, but its cells are the ones whose
+  // buzzers differ from the initial world, wherever they are, with their
+  // final count. Applying it to the same initial world reproduces the final
+  // state of the run.
+  struct BinaryResult {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t result;
+    uint32_t orientation;
+    uint64_t x;
+    uint64_t y;
+    uint64_t bag;
+    uint64_t instruction_count;
+    uint64_t forward_count;
+    uint64_t left_count;
+    uint64_t pickbuzzer_count;
+    uint64_t leavebuzzer_count;
+    uint64_t cell_count;
+  };
+
+  struct BinaryResultCell {
+    uint32_t x;
+    uint32_t y;
+    uint32_t buzzers;
+  };
+
+  void Dump() const;
+
+  // Writes the outcome of a run. The XML format only has what the world asks
+  // to be dumped. The JSON and binary formats always have Karel's final
+  // state, the command counters and the total number of executed
+  // instructions, plus the buzzers of the dumped cells (or of every cell, for
+  // UNIVERSO) in sparse form.
+  void DumpResult(RunResult result,
+                  ResultFormat format = ResultFormat::XML) const;
+  // Same as above, but into |output| instead of stdout.
+  void DumpResult(RunResult result,
+                  ResultFormat format,
+                  xml::Buffer* output) const;
+
+  // Produces the <linea> elements of the XML result, from the top row down.
+  // For each row that has one, |sink| gets BeginLine(y), then Coordinate(x)
+  // and Value(buzzers) for every token of its content, and then EndLine().
+  // Rows and columns are 0-based.
+  template <typename Sink>
+  void ForEachResultLine(Sink* sink) const;
+
+  // The resultadoEjecucion attribute of the XML result for |result|.
+  static std::string_view ExecutionResultName(RunResult result);
+
+  // The direccion attribute of the XML result for |orientation|, if valid.
+  static std::optional<std::string_view> OrientationName(size_t orientation);
+
+  // Restores the final state of a run from its delta, as written by
+  // DumpResult() with ResultFormat::DELTA, and returns its result.
+  std::optional<RunResult> ApplyDelta(std::string_view delta);
+
+  const WorldImage& image() const { return *image_; }
+  const std::shared_ptr<const WorldImage>& shared_image() const {
+    return image_;
+  }
+  Runtime* runtime() { return &runtime_; }
+  const Runtime& runtime() const { return runtime_; }
+
+ private:
+  void DumpResultXml(RunResult result, xml::Buffer* output) const;
+  void DumpResultJson(RunResult result, xml::Buffer* output) const;
+  void DumpResultBinary(RunResult result,
+                        bool delta,
+                        xml::Buffer* output) const;
+
+  std::shared_ptr<const WorldImage> image_;
+  BuzzerOverlay overlay_;
+  std::unique_ptr<CellCounters[]> heatmap_;
+  std::unique_ptr<BuzzerDigest> digest_;
+  // A copy of the initial_digest() of the image.
+  uint64_t initial_digest_ = 0;
+  Runtime runtime_;
+
+  DISALLOW_COPY_AND_ASSIGN(World);
+};
+
+template <typename Sink>
+void World::ForEachResultLine(Sink* sink) const {
+  const WorldImage& image = *image_;
+  std::vector<uint32_t> columns(image.width());
+  for (size_t y = image.height(); y-- > 0;) {
+    const uint32_t* row = overlay_.row(y);
+    if (image.dump_universe()) {
+      // A run of non-zero cells only carries the coordinate of its first
+      // cell.
+      size_t count = scan::FindNonZero(row, image.width(), columns.data());
+      if (count == 0)
+        continue;
+      sink->BeginLine(y);
+      for (size_t i = 0; i < count; ++i) {
+        uint32_t x = columns[i];
+        if (x == 0 || row[x - 1] == 0)
+          sink->Coordinate(x);
+        sink->Value(row[x] & 0xFFFF);
+      }
+      sink->EndLine();
+    } else {
+      // Only the dumped cells with buzzers are printed, and a run is broken by
+      // a dumped cell without buzzers, but not by the cells in between.
+      size_t count = scan::FindNonZero(
+          reinterpret_cast<const uint8_t*>(image.buzzer_dump() +
+                                           coordinates(0, y)),
+          image.width(), 1, columns.data());
+      bool empty = true;
+      for (size_t i = 0; i < count && empty; ++i)
+        empty = row[columns[i]] == 0;
+      if (empty)
+        continue;
+      sink->BeginLine(y);
+      bool printCoordinate = true;
+      for (size_t i = 0; i < count; ++i) {
+        uint32_t x = columns[i];
+        if (row[x] != 0) {
+          if (printCoordinate)
+            sink->Coordinate(x);
+          sink->Value(row[x] & 0xFFFF);
+        }
+        printCoordinate = row[x] == 0;
+      }
+      sink->EndLine();
+    }
+  }
+}
+
+}  // namespace karel
+
+#endif  // WORLD_H_
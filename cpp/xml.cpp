@@ -1,7 +1,10 @@
 #include "xml.h"
 
+#include <limits.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 
 #include <expat.h>
@@ -11,20 +14,98 @@
 
 namespace xml {
 
-Buffer::Buffer(int fd) : fd_(fd), buffer_(std::make_unique<char[]>(8192)) {}
+Buffer::Buffer(int fd) : fd_(fd) {
+  Grow();
+}
+Buffer::Buffer(std::string* output) : fd_(-1), output_(output) {
+  Grow();
+}
 Buffer::Buffer(Buffer&& other)
-    : fd_(-1), buffer_(std::move(other.buffer_)), size_(other.size_) {
+    : fd_(-1),
+      output_(other.output_),
+      chunks_(std::move(other.chunks_)),
+      sizes_(std::move(other.sizes_)),
+      ptr_(other.ptr_),
+      end_(other.end_) {
   std::swap(fd_, other.fd_);
+  other.output_ = nullptr;
+  other.ptr_ = other.end_ = nullptr;
 }
 Buffer::~Buffer() {
-  if (fd_ == -1)
+  if (fd_ == -1 && !output_)
     return;
   Flush();
 }
 
 void Buffer::Flush() {
-  WriteFileDescriptor(fd_, std::string_view(buffer_.get(), size_));
-  size_ = 0;
+  std::vector<iovec> iov(chunks_.size());
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    iov[i].iov_base = chunks_[i].get();
+    iov[i].iov_len = i < sizes_.size()
+                         ? sizes_[i]
+                         : static_cast<size_t>(ptr_ - chunks_[i].get());
+  }
+
+  iovec* pending = iov.data();
+  size_t pending_count = iov.size();
+  if (output_) {
+    for (const iovec& chunk : iov)
+      output_->append(static_cast<const char*>(chunk.iov_base), chunk.iov_len);
+    pending_count = 0;
+  }
+  // writev() returns 0 for empty chunks, which is not an error.
+  while (pending_count && pending->iov_len == 0) {
+    ++pending;
+    --pending_count;
+  }
+  while (pending_count) {
+    ssize_t bytes_written = HANDLE_EINTR(
+        writev(fd_, pending, std::min<size_t>(pending_count, IOV_MAX)));
+    if (bytes_written <= 0) {
+      PLOG(ERROR) << "Failed to write output";
+      break;
+    }
+    size_t remaining = bytes_written;
+    while (pending_count && remaining >= pending->iov_len) {
+      remaining -= pending->iov_len;
+      ++pending;
+      --pending_count;
+    }
+    if (remaining) {
+      pending->iov_base = static_cast<char*>(pending->iov_base) + remaining;
+      pending->iov_len -= remaining;
+    }
+  }
+
+  // Keep one chunk around for whatever comes next.
+  chunks_.resize(1);
+  sizes_.clear();
+  ptr_ = chunks_.front().get();
+  end_ = ptr_ + kChunkSize;
+}
+
+void Buffer::Grow() {
+  if (!chunks_.empty()) {
+    sizes_.push_back(ptr_ - chunks_.back().get());
+    if (chunks_.size() == kMaxChunks) {
+      Flush();
+      return;
+    }
+  }
+  chunks_.push_back(std::make_unique<char[]>(kChunkSize));
+  ptr_ = chunks_.back().get();
+  end_ = ptr_ + kChunkSize;
+}
+
+void Buffer::AddSlow(std::string_view str) {
+  while (!str.empty()) {
+    if (ptr_ == end_)
+      Grow();
+    size_t size = std::min<size_t>(str.size(), end_ - ptr_);
+    memcpy(ptr_, str.data(), size);
+    ptr_ += size;
+    str.remove_prefix(size);
+  }
 }
 
 Writer::Writer(int fd) : buffer_{fd} {}
@@ -107,11 +188,14 @@ void Writer::PopDepth() {
 Reader::Reader() = default;
 Reader::~Reader() = default;
 
-bool Reader::Parse(int fd, ParseCallback callback) {
-  char buffer[4096];
-  ssize_t bytes_read;
+bool Reader::Parse(std::string_view document,
+                   ParseCallback callback,
+                   TextCallback text_callback) {
+  // The document is fed in chunks, and parsing stops after the first chunk in
+  // which |callback| fails.
+  constexpr size_t kChunkSize = 4096;
 
-  State state{true, std::move(callback)};
+  State state{true, std::move(callback), std::move(text_callback)};
 
   XML_Parser parser = XML_ParserCreate(nullptr);
   if (!parser)
@@ -119,14 +203,20 @@ bool Reader::Parse(int fd, ParseCallback callback) {
   XML_SetUserData(parser, &state);
   XML_SetElementHandler(parser, &Reader::StartElementHandler,
                         &Reader::EndElementHandler);
+  if (state.text_callback)
+    XML_SetCharacterDataHandler(parser, &Reader::CharacterDataHandler);
 
-  while (state.success && (bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
-    if (XML_Parse(parser, buffer, bytes_read, false) == XML_STATUS_ERROR) {
+  for (size_t offset = 0; state.success && offset < document.size();
+       offset += kChunkSize) {
+    std::string_view chunk = document.substr(offset, kChunkSize);
+    if (XML_Parse(parser, chunk.data(), chunk.size(), false) ==
+        XML_STATUS_ERROR) {
       LOG(ERROR) << "Parse error at line " << XML_GetCurrentLineNumber(parser)
                  << ": " << XML_ErrorString(XML_GetErrorCode(parser));
     }
   }
-  if (state.success && XML_Parse(parser, buffer, 0, true) == XML_STATUS_ERROR) {
+  if (state.success &&
+      XML_Parse(parser, document.data(), 0, true) == XML_STATUS_ERROR) {
     LOG(ERROR) << "Parse error at line " << XML_GetCurrentLineNumber(parser)
                << ": " << XML_ErrorString(XML_GetErrorCode(parser));
   }
@@ -140,14 +230,24 @@ void Reader::StartElementHandler(void* user_data,
                                  const char* name,
                                  const char** attrs) {
   State& state = *reinterpret_cast<State*>(user_data);
-  state.success &= state.callback(Element(name, attrs));
+  state.success &= state.callback(Element(name, attrs, state.depth++));
+}
+
+// static
+void Reader::EndElementHandler(void* user_data, const char* name) {
+  State& state = *reinterpret_cast<State*>(user_data);
+  --state.depth;
 }
 
 // static
-void Reader::EndElementHandler(void* user_data, const char* name) {}
+void Reader::CharacterDataHandler(void* user_data, const char* s, int len) {
+  State& state = *reinterpret_cast<State*>(user_data);
+  if (state.success)
+    state.text_callback(std::string_view(s, len));
+}
 
-Reader::Element::Element(const char* name, const char** attrs)
-    : name_(name), attrs_(attrs) {}
+Reader::Element::Element(const char* name, const char** attrs, size_t depth)
+    : name_(name), attrs_(attrs), depth_(depth) {}
 Reader::Element::Element(Element&&) = default;
 Reader::Element::~Element() = default;
 
@@ -167,4 +267,215 @@ std::optional<std::string_view> Reader::Element::GetAttribute(
   return std::nullopt;
 }
 
+std::vector<std::pair<std::string_view, std::string_view>>
+Reader::Element::GetAttributes() {
+  std::vector<std::pair<std::string_view, std::string_view>> attributes;
+  for (size_t i = 0; attrs_[i]; i += 2)
+    attributes.emplace_back(attrs_[i], attrs_[i + 1]);
+  return attributes;
+}
+
+namespace {
+
+bool IsWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool IsNameStartChar(char c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_' ||
+         c == ':';
+}
+
+bool IsNameChar(char c) {
+  return IsNameStartChar(c) || ('0' <= c && c <= '9') || c == '-' ||
+         c == '.';
+}
+
+bool StartsWith(const char* ptr, const char* end, std::string_view prefix) {
+  return static_cast<size_t>(end - ptr) >= prefix.size() &&
+         std::string_view(ptr, prefix.size()) == prefix;
+}
+
+}  // namespace
+
+Tokenizer::Tokenizer(std::string_view document)
+    : ptr_(document.data()), end_(document.data() + document.size()) {
+  if (StartsWith(ptr_, end_, "<?xml") && ptr_ + 5 != end_ &&
+      IsWhitespace(ptr_[5])) {
+    supported_ = SkipDeclaration();
+  }
+}
+
+Tokenizer::~Tokenizer() = default;
+
+Tokenizer::Result Tokenizer::Next() {
+  while (supported_) {
+    bool in_epilog = seen_root_ && depth_ == 0;
+    if (!SkipWhitespace()) {
+      // The document must end right after the root element is closed.
+      return in_epilog ? Result::END : Result::UNSUPPORTED;
+    }
+    if (*ptr_ != '<')
+      break;
+    if (StartsWith(ptr_, end_, "<!--")) {
+      if (!SkipComment())
+        break;
+    } else if (StartsWith(ptr_, end_, "</")) {
+      if (in_epilog || !ReadEndTag())
+        break;
+    } else if (!in_epilog && ptr_ + 1 != end_ && IsNameStartChar(ptr_[1])) {
+      if (!ReadStartTag())
+        break;
+      return Result::ELEMENT;
+    } else {
+      break;
+    }
+  }
+  supported_ = false;
+  return Result::UNSUPPORTED;
+}
+
+std::optional<std::string_view> Tokenizer::GetAttribute(
+    std::string_view name) const {
+  for (size_t i = 0; i < attribute_count_; ++i) {
+    if (attributes_[i][0] == name)
+      return attributes_[i][1];
+  }
+  return std::nullopt;
+}
+
+bool Tokenizer::SkipWhitespace() {
+  while (ptr_ != end_ && IsWhitespace(*ptr_))
+    ++ptr_;
+  return ptr_ != end_;
+}
+
+bool Tokenizer::SkipDeclaration() {
+  // Only the pseudo-attributes of a plain UTF-8, version 1.0 declaration are
+  // accepted, in the order that XML requires.
+  ptr_ += 5;
+  std::string_view pseudo_attributes[][3] = {
+      {"version", "1.0", "1.0"},
+      {"encoding", "UTF-8", "utf-8"},
+      {"standalone", "yes", "no"},
+  };
+  bool first = true;
+  for (const auto& pseudo_attribute : pseudo_attributes) {
+    const char* start = ptr_;
+    std::string_view name, value;
+    if (ptr_ == end_ || !IsWhitespace(*ptr_) || !SkipWhitespace() ||
+        !ReadName(&name) || name != pseudo_attribute[0] ||
+        !ReadAttributeValue(&value) ||
+        (value != pseudo_attribute[1] && value != pseudo_attribute[2])) {
+      if (first)
+        return false;
+      ptr_ = start;
+      continue;
+    }
+    first = false;
+  }
+  SkipWhitespace();
+  if (!StartsWith(ptr_, end_, "?>"))
+    return false;
+  ptr_ += 2;
+  return true;
+}
+
+bool Tokenizer::SkipComment() {
+  ptr_ += 4;
+  for (; ptr_ != end_; ++ptr_) {
+    if (*ptr_ == '-' && StartsWith(ptr_, end_, "--")) {
+      if (!StartsWith(ptr_, end_, "-->"))
+        return false;
+      ptr_ += 3;
+      return true;
+    }
+    if (static_cast<uint8_t>(*ptr_) >= 0x80 ||
+        (static_cast<uint8_t>(*ptr_) < 0x20 && !IsWhitespace(*ptr_))) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool Tokenizer::ReadName(std::string_view* name) {
+  const char* start = ptr_;
+  if (ptr_ == end_ || !IsNameStartChar(*ptr_))
+    return false;
+  while (ptr_ != end_ && IsNameChar(*ptr_))
+    ++ptr_;
+  *name = std::string_view(start, ptr_ - start);
+  return true;
+}
+
+bool Tokenizer::ReadAttributeValue(std::string_view* value) {
+  SkipWhitespace();
+  if (ptr_ == end_ || *ptr_ != '=')
+    return false;
+  ++ptr_;
+  if (!SkipWhitespace() || (*ptr_ != '"' && *ptr_ != '\''))
+    return false;
+  const char quote = *ptr_++;
+  const char* start = ptr_;
+  for (; ptr_ != end_ && *ptr_ != quote; ++ptr_) {
+    // Entity references, markup and the characters that are normalized to
+    // spaces are left to the real parser.
+    if (*ptr_ == '&' || *ptr_ == '<' || static_cast<uint8_t>(*ptr_) < 0x20 ||
+        static_cast<uint8_t>(*ptr_) >= 0x80) {
+      return false;
+    }
+  }
+  if (ptr_ == end_)
+    return false;
+  *value = std::string_view(start, ptr_ - start);
+  ++ptr_;
+  return true;
+}
+
+bool Tokenizer::ReadStartTag() {
+  ++ptr_;
+  if (!ReadName(&name_))
+    return false;
+  attribute_count_ = 0;
+  while (true) {
+    bool separated = ptr_ != end_ && IsWhitespace(*ptr_);
+    if (!SkipWhitespace())
+      return false;
+    if (*ptr_ == '>' || StartsWith(ptr_, end_, "/>"))
+      break;
+    std::string_view name, value;
+    if (!separated || attribute_count_ == kMaxAttributes || !ReadName(&name) ||
+        !ReadAttributeValue(&value) || GetAttribute(name)) {
+      return false;
+    }
+    attributes_[attribute_count_][0] = name;
+    attributes_[attribute_count_][1] = value;
+    attribute_count_++;
+  }
+
+  seen_root_ = true;
+  if (*ptr_ == '/') {
+    ptr_ += 2;
+    return true;
+  }
+  ++ptr_;
+  if (depth_ == kMaxDepth)
+    return false;
+  open_elements_[depth_++] = name_;
+  return true;
+}
+
+bool Tokenizer::ReadEndTag() {
+  ptr_ += 2;
+  std::string_view name;
+  if (depth_ == 0 || !ReadName(&name) || name != open_elements_[depth_ - 1])
+    return false;
+  SkipWhitespace();
+  if (ptr_ == end_ || *ptr_ != '>')
+    return false;
+  ++ptr_;
+  depth_--;
+  return true;
+}
+
 }  // namespace xml
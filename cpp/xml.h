@@ -1,39 +1,66 @@
+#include <charconv>
 #include <cstring>
 #include <functional>
 #include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "macros.h"
 
 namespace xml {
 
+// An output buffer that grows in fixed-size chunks, so that appending never
+// moves what was already written. Chunks are written out together with
+// writev() when the buffer is flushed, destroyed, or holds kMaxChunks chunks.
+// A buffer can also collect its output in a string instead of writing it.
 class Buffer {
  public:
   explicit Buffer(int fd);
+  explicit Buffer(std::string* output);
   Buffer(Buffer&& other);
   ~Buffer();
 
   void Add(char c) {
-    buffer_[size_++] = c;
-    if (Full())
-      Flush();
+    if (ptr_ == end_)
+      Grow();
+    *ptr_++ = c;
   }
   void Add(std::string_view str) {
-    memcpy(buffer_.get() + size_, str.data(), str.size());
-    size_ += str.size();
-    if (Full())
-      Flush();
+    if (static_cast<size_t>(end_ - ptr_) < str.size()) {
+      AddSlow(str);
+      return;
+    }
+    memcpy(ptr_, str.data(), str.size());
+    ptr_ += str.size();
+  }
+  template <typename T>
+  void AddNumber(T value) {
+    if (end_ - ptr_ < kMaxNumberSize)
+      Grow();
+    ptr_ = std::to_chars(ptr_, end_, value).ptr;
   }
   void Flush();
 
  private:
-  bool Full() const { return size_ > 4096; }
+  static constexpr size_t kChunkSize = 64 * 1024;
+  static constexpr size_t kMaxChunks = 16;
+  // Enough for any 64-bit integer, including its sign.
+  static constexpr ptrdiff_t kMaxNumberSize = 24;
+
+  // Moves on to a new chunk, flushing first if there are too many.
+  void Grow();
+  void AddSlow(std::string_view str);
+
   int fd_;
-  std::unique_ptr<char[]> buffer_;
-  size_t size_ = 0;
+  std::string* output_ = nullptr;
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  // How much of each chunk but the last one was used.
+  std::vector<size_t> sizes_;
+  char* ptr_ = nullptr;
+  char* end_ = nullptr;
   DISALLOW_COPY_AND_ASSIGN(Buffer);
 };
 
@@ -94,32 +121,91 @@ class Reader {
     std::string_view GetName();
     std::optional<std::string_view> GetAttribute(std::string_view name,
                                                  bool required = false);
+    std::vector<std::pair<std::string_view, std::string_view>>
+    GetAttributes();
+    // How many elements enclose this one. The root element has depth 0.
+    size_t depth() const { return depth_; }
 
    private:
     friend class Reader;
-    Element(const char* name, const char** attrs);
+    Element(const char* name, const char** attrs, size_t depth);
 
     const char* name_;
     const char** attrs_;
+    size_t depth_;
 
     DISALLOW_COPY_AND_ASSIGN(Element);
   };
 
   using ParseCallback = std::function<bool(Element element)>;
-  bool Parse(int fd, ParseCallback callback);
+  // Receives the character data of the document, possibly split in pieces.
+  using TextCallback = std::function<void(std::string_view text)>;
+  bool Parse(std::string_view document,
+             ParseCallback callback,
+             TextCallback text_callback = nullptr);
 
  private:
   struct State {
     bool success = true;
     ParseCallback callback;
+    TextCallback text_callback;
+    size_t depth = 0;
   };
 
   static void StartElementHandler(void* user_data,
                                   const char* name,
                                   const char** attrs);
   static void EndElementHandler(void* user_data, const char* name);
+  static void CharacterDataHandler(void* user_data, const char* s, int len);
 
   DISALLOW_COPY_AND_ASSIGN(Reader);
 };
 
+// A pull tokenizer for the well-formed subset of XML that world files are
+// written in: an optional <?xml?> declaration, elements whose attribute values
+// have no entity references, comments and whitespace. Anything else (DTDs,
+// CDATA, entities, text content, non-ASCII characters, or a document that is
+// not well-formed) makes it return UNSUPPORTED, and the caller is expected to
+// fall back to Reader, which handles all of XML.
+class Tokenizer {
+ public:
+  enum class Result { ELEMENT, END, UNSUPPORTED };
+
+  explicit Tokenizer(std::string_view document);
+  ~Tokenizer();
+
+  // Advances to the next start tag. END is only returned once the root
+  // element has been closed and the rest of the document has been validated.
+  Result Next();
+
+  std::string_view name() const { return name_; }
+  std::optional<std::string_view> GetAttribute(std::string_view name) const;
+
+ private:
+  static constexpr size_t kMaxAttributes = 16;
+  static constexpr size_t kMaxDepth = 16;
+
+  bool SkipWhitespace();
+  bool SkipDeclaration();
+  bool SkipComment();
+  bool ReadName(std::string_view* name);
+  bool ReadAttributeValue(std::string_view* value);
+  bool ReadStartTag();
+  bool ReadEndTag();
+
+  const char* ptr_;
+  const char* const end_;
+  bool supported_ = true;
+
+  std::string_view name_;
+  std::string_view attributes_[kMaxAttributes][2];
+  size_t attribute_count_ = 0;
+
+  std::string_view open_elements_[kMaxDepth];
+  size_t depth_ = 0;
+  bool seen_root_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(Tokenizer);
+};
+
 }  // namespace xml
@@ -0,0 +1,203 @@
+// Runs a compiled Karel program over many worlds at once with the wasm build
+// of the C++ interpreter (cpp/karel.js and cpp/karel.wasm, from `make
+// karel.js`). The wasm module is compiled once and shared by a pool of
+// workers, and each worker runs its share of the worlds with a single
+// run_batch() call.
+//
+//   var pool = new KarelPool();
+//   pool.run(JSON.stringify(karel.compile(code)), worlds).then(results => ...);
+//
+// Every result has the execution result, Karel's final state and counters, and
+// |buzzers|, a row-major Uint32Array with the final buzzers of every cell,
+// where cell (i, j) is at (i - 1) * w + (j - 1).
+(function () {
+  // The words of the header of a packed world, and of a packed result. They
+  // must match PackedWorldField and PackedResultField in
+  // cpp/karel_wasm_main.cpp.
+  var WORLD_HEADER_SIZE = 12;
+  var RESULT_SIZE = 10;
+
+  // Indexed by karel::RunResult.
+  var RESULT_NAMES = [
+    'FIN PROGRAMA',
+    'LIMITE DE INSTRUCCIONES',
+    'MOVIMIENTO INVALIDO',
+    'ZUMBADOR INVALIDO',
+    'ZUMBADOR INVALIDO',
+    'STACK OVERFLOW',
+  ];
+
+  function packedWorldSize(world) {
+    var cells = world.w * world.h;
+    return WORLD_HEADER_SIZE + cells + Math.ceil(cells / 4);
+  }
+
+  // Packs the initial state of |worlds| in the format that run_batch()
+  // expects. Unlimited values are -1 in the World, which the Uint32Array
+  // stores as 0xFFFFFFFF, just like the wasm side wants them.
+  function packWorlds(worlds) {
+    var size = 0;
+    for (var n = 0; n < worlds.length; n++) {
+      size += packedWorldSize(worlds[n]);
+    }
+    var packed = new Uint32Array(size);
+    var walls = new Uint8Array(packed.buffer);
+    var offset = 0;
+    for (var n = 0; n < worlds.length; n++) {
+      var world = worlds[n];
+      packed.set(
+        [
+          world.w,
+          world.h,
+          world.start_j - 1,
+          world.start_i - 1,
+          world.startOrientation,
+          world.startBagBuzzers,
+          world.maxInstructions,
+          world.maxStackSize,
+          world.maxMove,
+          world.maxTurnLeft,
+          world.maxPickBuzzer,
+          world.maxLeaveBuzzer,
+        ],
+        offset,
+      );
+      var cells = world.w * world.h;
+      var buzzers = offset + WORLD_HEADER_SIZE;
+      var wallOffset = (buzzers + cells) * 4;
+      for (var i = 1; i <= world.h; i++) {
+        for (var j = 1; j <= world.w; j++) {
+          var cell = (i - 1) * world.w + (j - 1);
+          packed[buzzers + cell] = world.map[world.w * i + j];
+          walls[wallOffset + cell] = world.wallMap[world.w * i + j];
+        }
+      }
+      offset += packedWorldSize(world);
+    }
+    return packed;
+  }
+
+  // Turns what a worker sent back into one result per world.
+  function unpackResults(worlds, packed, results) {
+    var unpacked = [];
+    var offset = 0;
+    for (var n = 0; n < worlds.length; n++) {
+      var world = worlds[n];
+      var cells = world.w * world.h;
+      var result = results.subarray(n * RESULT_SIZE, (n + 1) * RESULT_SIZE);
+      unpacked.push({
+        result: RESULT_NAMES[result[0]],
+        i: result[2] + 1,
+        j: result[1] + 1,
+        orientation: result[3],
+        bag: result[4] == 0xffffffff ? -1 : result[4],
+        instructions: result[5],
+        moveCount: result[6],
+        turnLeftCount: result[7],
+        pickBuzzerCount: result[8],
+        leaveBuzzerCount: result[9],
+        buzzers: packed.subarray(
+          offset + WORLD_HEADER_SIZE,
+          offset + WORLD_HEADER_SIZE + cells,
+        ),
+      });
+      offset += packedWorldSize(world);
+    }
+    return unpacked;
+  }
+
+  // Options, all optional:
+  // .size: the number of workers. Defaults to one per core.
+  // .worker, .glue, .wasm: the URLs of js/karel_pool_worker.js and of the
+  // emscripten output.
+  var KarelPool = function (options) {
+    var self = this;
+
+    options = options || {};
+    var size = options.size || navigator.hardwareConcurrency || 4;
+    var resolve = function (url) {
+      return new URL(url, location.href).href;
+    };
+    var glue = resolve(options.glue || 'cpp/karel.js');
+
+    self.workers = [];
+    self.pending = {};
+    self.nextId = 0;
+    self.ready = fetch(resolve(options.wasm || 'cpp/karel.wasm'))
+      .then(response => response.arrayBuffer())
+      .then(bytes => WebAssembly.compile(bytes))
+      .then(module => {
+        for (var n = 0; n < size; n++) {
+          var worker = new Worker(
+            resolve(options.worker || 'js/karel_pool_worker.js'),
+          );
+          worker.addEventListener('message', function (message) {
+            var callbacks = self.pending[message.data.id];
+            delete self.pending[message.data.id];
+            if (message.data.error) {
+              callbacks.reject(new Error(message.data.error));
+            } else {
+              callbacks.resolve(message.data);
+            }
+          });
+          // Modules can be cloned, so every worker instantiates the same one
+          // without compiling it again.
+          worker.postMessage({ type: 'init', module: module, glue: glue });
+          self.workers.push(worker);
+        }
+      });
+  };
+
+  // Runs |program|, the contents of a .kx file, over |worlds|, an array of
+  // World. Resolves to one result per world, in the same order.
+  KarelPool.prototype.run = function (program, worlds) {
+    var self = this;
+
+    return self.ready.then(() => {
+      var chunk = Math.ceil(worlds.length / self.workers.length);
+      var batches = [];
+      for (var n = 0; n < self.workers.length; n++) {
+        var slice = worlds.slice(n * chunk, (n + 1) * chunk);
+        if (slice.length == 0) break;
+        batches.push(self.runBatch(self.workers[n], program, slice));
+      }
+      return Promise.all(batches).then(results => [].concat(...results));
+    });
+  };
+
+  KarelPool.prototype.runBatch = function (worker, program, worlds) {
+    var self = this;
+
+    var id = self.nextId++;
+    var packed = packWorlds(worlds);
+    return new Promise((resolve, reject) => {
+      self.pending[id] = { resolve: resolve, reject: reject };
+      worker.postMessage(
+        {
+          type: 'run',
+          id: id,
+          program: program,
+          worlds: packed,
+          count: worlds.length,
+        },
+        [packed.buffer],
+      );
+    }).then(data => unpackResults(worlds, data.worlds, data.results));
+  };
+
+  KarelPool.prototype.terminate = function () {
+    var self = this;
+
+    for (var n = 0; n < self.workers.length; n++) {
+      self.workers[n].terminate();
+    }
+    self.workers = [];
+  };
+
+  if (typeof exports !== 'undefined') {
+    exports.KarelPool = KarelPool;
+    exports.packWorlds = packWorlds;
+  } else {
+    this.KarelPool = KarelPool;
+  }
+}.call(this));
@@ -0,0 +1,98 @@
+// A worker of KarelPool in js/karel_pool.js. It instantiates the wasm module
+// it is sent, and runs every batch of packed worlds with run_batch().
+(function () {
+  var ready = null;
+  // The last program that was compiled, which most batches reuse.
+  var compiled = null;
+
+  // Copies |string| into the wasm heap as a NUL-terminated UTF-8 string.
+  function allocateString(string) {
+    var bytes = new TextEncoder().encode(string);
+    var ptr = Module._malloc(bytes.length + 1);
+    Module.HEAPU8.set(bytes, ptr);
+    Module.HEAPU8[ptr + bytes.length] = 0;
+    return ptr;
+  }
+
+  function runBatch(data) {
+    if (data.program !== compiled) {
+      var programPtr = allocateString(data.program);
+      var success = Module._compile(programPtr);
+      Module._free(programPtr);
+      if (!success) {
+        compiled = null;
+        throw new Error('Invalid program');
+      }
+      compiled = data.program;
+    }
+
+    var resultSize = 10 * data.count;
+    var worldsPtr = Module._malloc(data.worlds.byteLength);
+    var resultsPtr = Module._malloc(resultSize * 4);
+    try {
+      Module.HEAPU32.set(data.worlds, worldsPtr >> 2);
+      if (
+        !Module._run_batch(
+          worldsPtr,
+          data.worlds.length,
+          data.count,
+          resultsPtr,
+        )
+      ) {
+        throw new Error('Invalid worlds');
+      }
+      // The runs updated the buzzers of the worlds in place.
+      return {
+        worlds: Module.HEAPU32.slice(
+          worldsPtr >> 2,
+          (worldsPtr >> 2) + data.worlds.length,
+        ),
+        results: Module.HEAPU32.slice(
+          resultsPtr >> 2,
+          (resultsPtr >> 2) + resultSize,
+        ),
+      };
+    } finally {
+      Module._free(worldsPtr);
+      Module._free(resultsPtr);
+    }
+  }
+
+  self.addEventListener(
+    'message',
+    function (message) {
+      var data = message.data;
+      if (data.type == 'init') {
+        ready = new Promise(function (resolve) {
+          self.Module = {
+            instantiateWasm: function (imports, receiveInstance) {
+              WebAssembly.instantiate(data.module, imports).then(
+                receiveInstance,
+              );
+              return {};
+            },
+            onRuntimeInitialized: resolve,
+          };
+          self.importScripts(data.glue);
+        });
+        return;
+      }
+
+      ready.then(function () {
+        try {
+          var result = runBatch(data);
+          self.postMessage(
+            { id: data.id, worlds: result.worlds, results: result.results },
+            [result.worlds.buffer, result.results.buffer],
+          );
+        } catch (ex) {
+          self.postMessage({
+            id: data.id,
+            error: (ex && (ex.message || ex.name)) || '',
+          });
+        }
+      });
+    },
+    false,
+  );
+}.call(this));